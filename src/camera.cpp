@@ -1,5 +1,4 @@
 #include "camera.h"
-#include <qgl.h>
 
 Camera::Camera()
 {
@@ -17,11 +16,30 @@ Camera::~Camera()
 {
 }
 
-void Camera::multMatrix()
+/**
+  The view matrix looking from the eye along the look vector, as
+  gluLookAt would build it
+  **/
+Matrix4x4 Camera::getViewMatrix() const
 {
-    gluLookAt(eye_.x, eye_.y, eye_.z,
-              eye_.x + look_.x, eye_.y + look_.y, eye_.z + look_.z,
-              up_.x, up_.y, up_.z);
+    Vector4 u = getU(), v = getV(), w = getW();
+    return Matrix4x4(u.x, u.y, u.z, -u.dot(eye_),
+                     v.x, v.y, v.z, -v.dot(eye_),
+                     w.x, w.y, w.z, -w.dot(eye_),
+                     0, 0, 0, 1);
+}
+
+/**
+  The perspective projection of the camera's field of view and clip
+  planes, as gluPerspective would build it
+  **/
+Matrix4x4 Camera::getProjectionMatrix(float aspect) const
+{
+    float f = 1.0f / tanf(fovy_ * M_PI / 360.0f);
+    return Matrix4x4(f / aspect, 0, 0, 0,
+                     0, f, 0, 0,
+                     0, 0, (far_ + near_) / (near_ - far_), 2.0f * far_ * near_ / (near_ - far_),
+                     0, 0, -1, 0);
 }
 
 void Camera::lookAt(const Vector4 &eye, const Vector4 &look, const Vector4 &up)
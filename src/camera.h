@@ -24,7 +24,8 @@ public:
     Vector4 getV() const { return getU().cross(look_).getNormalized(); }
     Vector4 getW() const { return -look_.getNormalized(); }
 
-    void multMatrix();
+    Matrix4x4 getViewMatrix() const;
+    Matrix4x4 getProjectionMatrix(float aspect) const;
     void lookAt(const Vector4 &eye, const Vector4 &look, const Vector4 &up);
 
     void mouseMove(const Vector2 &delta, const Qt::MouseButtons &buttons);
@@ -18,6 +18,10 @@ SOURCES += main.cpp \
     glm.cpp \
     terrain.cpp \
     camera.cpp \
+    occlusionculler.cpp \
+    framegraph.cpp \
+    glstate.cpp \
+    uniformring.cpp \
     CS123Vector.inl \
     CS123Matrix.inl \
     CS123Matrix.cpp
@@ -31,6 +35,12 @@ HEADERS += mainwindow.h \
     terrain.h \
     glext.h \
     camera.h \
+    frustum.h \
+    occlusionculler.h \
+    framegraph.h \
+    glstate.h \
+    uniformring.h \
+    shaderids.h \
     CS123Vector.h \
     CS123Matrix.h \
     CS123Algebra.h \
@@ -2,36 +2,115 @@
 #include <GL/gl.h>
 #define GL_GLEXT_PROTOTYPES
 #include "glext.h"
-#include <GL/glu.h>
 #include "glm.h"
 
 #include "drawengine.h"
 #include <QKeyEvent>
 #include <QGLContext>
-#include <QHash>
 #include <QGLShaderProgram>
 #include <QQuaternion>
 #include <QVector3D>
 #include <QString>
 #include <iostream>
+#include <string.h>
+#include <stdio.h>
 #include <QFile>
-#include <QGLFramebufferObject>
+#include <QSettings>
 
 using std::cout;
 using std::endl;
 
-enum SKYBOX_TYPE {
-    SKYBOX_ALPINE,
-    SKYBOX_ISLAND,
-    SKYBOX_HOURGLASS
-};
-
-// Changes the skybox texture
-#define SKYBOX SKYBOX_ISLAND
 // Changes the water level
 #define SEA_LEVEL 7.3f
 // Changes the water quad size
 #define WATER_QUAD_SIZE 10.0f
+// Half the width of the skybox cube
+#define SKYBOX_EXTENT 50.0f
+// Pixels the water's screen bounds are grown by, to cover the bump map's
+// distortion of the reflection lookup
+#define WATER_SCISSOR_MARGIN 32.0f
+// Camera movement past which the reflection and refraction are redrawn in
+// full rather than reprojected from earlier frames
+#define WATER_REFRESH_DISTANCE 0.1f
+#define WATER_REFRESH_ANGLE 3.0f
+// How fast the refraction fades to the water's color with the depth of
+// water in front of it, per unit, when refracting the opaque scene
+#define REFRACTION_DEPTH_FADE 0.4f
+// Limits of the screen space reflection's ray march: steps, eye space
+// length, and how far behind the scene's depth a ray still hits it
+#define SSR_MAX_STEPS 64
+#define SSR_MAX_DISTANCE 40.0f
+#define SSR_THICKNESS 0.5f
+// Reach of the depth of field blur in scene texels at a blur factor of 1,
+// the outermost tap of blurx.vert
+#define BLUR_EXTENT 11.44f
+// Largest radius and tile size of shaders/blur.comp
+#define COMPUTE_BLUR_MAX_RADIUS 12
+#define COMPUTE_BLUR_TILE 16
+// Quality settings file, next to the shaders and textures
+#define QUALITY_SETTINGS "quality.ini"
+// Automatic quality: the quality is lowered a step after this many frames
+// in a row over budget, and raised again after this many frames under the
+// headroom fraction of it.  Frames right after a change aren't measured,
+// the timings need to settle on the new settings first.
+#define FRAME_BUDGET 16.6f
+#define QUALITY_DOWN_FRAMES 20
+#define QUALITY_UP_FRAMES 120
+#define QUALITY_UP_HEADROOM 0.7f
+#define QUALITY_SETTLE_FRAMES 30
+// Weight of the newest frame in the smoothed frame times
+#define FRAME_TIME_SMOOTHING 0.1f
+// Dynamic resolution: the render scale is left alone while the GPU's
+// frame time is between the headroom fraction of the budget and the
+// budget, and is otherwise moved towards the scale that would take the aim
+// fraction of it.  It moves at most a step every interval frames, which
+// lets the GPU timings catch up, and stays between the minimum and 1.
+#define RENDER_SCALE_HEADROOM 0.8f
+#define RENDER_SCALE_AIM 0.9f
+#define RENDER_SCALE_STEP 0.05f
+#define RENDER_SCALE_INTERVAL 8
+#define MIN_RENDER_SCALE 0.5f
+// Render targets are allocated in steps of this many pixels, so a window
+// being resized draws into part of them, and only fitted to the window
+// once its size hasn't changed for this many ms
+#define RESIZE_BUCKET 128
+#define RESIZE_SETTLE_TIME 250.0f
+
+// Names used in the quality settings file, in enum order
+static const char *QUALITY_PRESET_NAMES[] = { "low", "medium", "high", "ultra", "custom" };
+static const char *SKYBOX_NAMES[] = { "alpine", "island", "hourglass" };
+static const char *REFLECTION_MODE_NAMES[] = { "mirrored", "screenspace" };
+static const char *WATER_UPDATE_MODE_NAMES[] = { "everyframe", "everynframes", "interleaved" };
+
+static const char *UNIFORM_BLOCK_NAMES[] = { "FrameUniforms", "PassUniforms" };
+
+/**
+  Whether a compute shader can write vec4s to a texture of this format
+  through an image, which takes one of the float or normalized formats
+  image load and store support
+  **/
+static bool is_image_format(GLenum format) {
+    switch (format) {
+    case GL_RGBA32F: case GL_RGBA16F: case GL_RG32F: case GL_RG16F: case GL_R32F: case GL_R16F:
+    case GL_R11F_G11F_B10F: case GL_RGB10_A2: case GL_RGBA16: case GL_RGBA8:
+    case GL_RG16: case GL_RG8: case GL_R16: case GL_R8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+  Index of name in names, or fallback when it isn't one of them
+  **/
+static int name_index(const QString &name, const char **names, int count, int fallback) {
+    for (int i = 0; i < count; i++) {
+        if (name == names[i]) {
+            return i;
+        }
+    }
+    return fallback;
+}
 
 
 /**
@@ -45,31 +124,62 @@ enum SKYBOX_TYPE {
   @param h The viewport heigh used to alloacte the correct framebuffer size.
 
 **/
-DrawEngine::DrawEngine(const QGLContext *context, int w, int h) : context_(context),
-        dofEnabled_(true), depthmapEnabled_(false), offsetX_(0.0f), offsetY_(0.0f), bumpMap_(-1),
-        blurFactor_(1.6f) {
-    // Initialize OGL settings
-    glEnable(GL_TEXTURE_2D);
-
+DrawEngine::DrawEngine(const QGLContext *context, int w, int h) : cubeMap_(0), context_(context),
+        terrain_(NULL), autoQuality_(false), qualityLevel_(0), frameBudget_(FRAME_BUDGET), gpuFrameTime_(0.0f),
+        cpuFrameTime_(0.0f), overBudgetFrames_(0), underBudgetFrames_(0), qualitySettleFrames_(0),
+        dynamicResolution_(false), renderScale_(1.0f), renderScaleFrames_(0), windowWidth_(w),
+        windowHeight_(h), resizeTime_(0.0f), frameQueryNext_(0), frameQueriesPending_(0),
+        dofEnabled_(true), depthmapEnabled_(false), dofPyramid_(true), computeBlur_(true),
+        computeBlurProgram_(0), postSteps_(0), offsetX_(0.0f), offsetY_(0.0f), bumpMap_(-1),
+        blurFactor_(1.6f), reflectionScale_(1.0f), refractionScale_(1.0f),
+        reflectionMode_(REFLECTION_MIRRORED), refractionFromScene_(true), layeredWater_(true),
+        waterUpdateMode_(WATER_UPDATE_EVERY_FRAME), waterUpdateInterval_(2), frameCount_(0), waterRows_(0),
+        waterCulling_(true), waterQueryPending_(false), waterOccluded_(false), waterVisibility_(WATER_VISIBLE),
+        waterClipPlanes_(true) {
+    // Initialize OGL settings.  Everything is drawn with shaders, so none
+    // of the fixed function state is set up.
     glEnable(GL_POLYGON_SMOOTH); //Enable smoothing
 
-    glShadeModel(GL_SMOOTH); //Smooth or flat shading model
-    glPolygonMode(GL_FRONT, GL_FILL); //Shaded mode
-    glPolygonMode(GL_BACK, GL_FILL);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL); //Shaded mode
 
     glHint(GL_POLYGON_SMOOTH_HINT, GL_NICEST);
     glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
-    glHint(GL_POINT_SMOOTH_HINT, GL_NICEST);
-    glEnable(GL_TEXTURE_2D);
-    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 
     glFrontFace(GL_CCW);
     glDisable(GL_DITHER);
-    glDisable(GL_LIGHTING);
     glClearColor(0.0f,0.0f,0.0f,0.0f);
 
     // Initialize member variables
     previous_time_ = 0.0;
+    reflectionHistory_.valid = false;
+    refractionHistory_.valid = false;
+    frameGraphDirty_ = true;
+    for (int i = 0; i < 2; i++) {
+        fillQueryPending_[i] = false;
+        waterPassSamples_[i] = 0;
+    }
+    for (int i = 0; i < PASS_COUNT; i++) {
+        stateChanges_[i] = skippedStateChanges_[i] = 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        clipPlane_[i] = 0.0f;
+    }
+    // The blur is worked out from the scene's depth, so color targets
+    // don't need an alpha channel for it.  The pyramid levels keep theirs,
+    // and the blurs store weight sums in alpha.
+    for (int i = 0; i < TARGET_COUNT; i++) {
+        targetFormats_[i] = GL_R11F_G11F_B10F;
+    }
+    targetFormats_[TARGET_REFLECTION_DEPTH] = GL_DEPTH_COMPONENT24;
+    targetFormats_[TARGET_REFRACTION_DEPTH] = GL_DEPTH_COMPONENT24;
+    targetFormats_[TARGET_WATER_LAYERS_DEPTH] = GL_DEPTH_COMPONENT24;
+    targetFormats_[TARGET_SCENE_DEPTH] = GL_DEPTH_COMPONENT24;
+    targetFormats_[TARGET_SCENE_COPY_DEPTH] = GL_DEPTH_COMPONENT24;
+    targetFormats_[TARGET_DEPTH_PYRAMID] = GL_R32F;
+    targetFormats_[TARGET_DOF_HALF] = GL_RGBA8;
+    targetFormats_[TARGET_DOF_QUARTER] = GL_RGBA8;
+    targetFormats_[TARGET_BLUR_X] = GL_RGBA16F_ARB;
+    targetFormats_[TARGET_BLUR_Y] = GL_RGBA16F_ARB;
 
     //Initialize resources
     cout << "Using OpenGL Version " << glGetString(GL_VERSION) << endl << endl;
@@ -79,32 +189,38 @@ DrawEngine::DrawEngine(const QGLContext *context, int w, int h) : context_(conte
     cout << "Loading Resources" << endl;
     load_models();
     load_shaders();
-
-    terrain_ = new Terrain();
-    srand(2);
-    float3 tl(-10, 10, 2);
-    float3 tr(10, 10, 4);
-    float3 bl(-10, -10, 8);
-    float3 br(10, -10, 6);
-    terrain_->populateTerrain(tl, tr, bl, br);
-    terrain_->populateNormals();
-
     load_textures();
-    create_fbos(w,h);
+    // Nothing is set up yet, so the preset builds the skybox and terrain
+    memset(&quality_, 0, sizeof(quality_));
+    loadQualitySettings(QUALITY_SETTINGS);
+    build_frame_graph(resize_bucket(w), resize_bucket(h));
+    glGenQueries(1, &waterQuery_);
+    glGenQueries(2, fillQueries_);
+    glGenQueries(FRAME_QUERIES, frameQueries_);
+    glGenVertexArrays(1, &emptyVertexArray_);
+    uniformRing_.create();
+    cout << "Uniform blocks " << (uniformRing_.isPersistent() ? "persistently mapped" : "written with glBufferSubData")
+         << endl;
 
     cout << "Rendering..." << endl;
 }
 
 DrawEngine::~DrawEngine() {
     delete terrain_;
-    foreach(QGLShaderProgram *sp,shader_programs_)
-        delete sp;
-    foreach(QGLFramebufferObject *fbo,framebuffer_objects_)
-        delete fbo;
-    foreach(GLuint id,textures_)
-        ((QGLContext *)(context_))->deleteTexture(id);
-    foreach(Model m,models_)
-        glmDelete(m.model);
+    glDeleteQueries(1, &waterQuery_);
+    glDeleteQueries(2, fillQueries_);
+    glDeleteQueries(FRAME_QUERIES, frameQueries_);
+    glDeleteVertexArrays(1, &emptyVertexArray_);
+    if (computeBlurProgram_) {
+        glDeleteProgram(computeBlurProgram_);
+    }
+    for (int i = 0; i < PROGRAM_COUNT; i++)
+        delete programs_[i];
+    ((QGLContext *)(context_))->deleteTexture(cubeMap_);
+    glDeleteVertexArrays(1, &skyboxVertexArray_);
+    glDeleteBuffers(2, skyboxBuffers_);
+    glDeleteVertexArrays(1, &waterVertexArray_);
+    glDeleteBuffers(1, &waterBuffer_);
 }
 
 /**
@@ -113,91 +229,254 @@ DrawEngine::~DrawEngine() {
 **/
 void DrawEngine::load_models() {
     cout << "Loading models..." << endl;
-    models_["skybox"].idx = glGenLists(1);
-    glNewList(models_["skybox"].idx,GL_COMPILE);
-    //Be glad we wrote this for you...ugh.
-    glBegin(GL_QUADS);
-    float fExtent = 50.f;
-    glTexCoord3f(1.0f,-1.0f,-1.0f); glVertex3f(fExtent,-fExtent,-fExtent);
-    glTexCoord3f(-1.0f,-1.0f,-1.0f);glVertex3f(-fExtent,-fExtent,-fExtent);
-    glTexCoord3f(-1.0f,1.0f,-1.0f);glVertex3f(-fExtent,fExtent,-fExtent);
-    glTexCoord3f(1.0f,1.0f,-1.0f); glVertex3f(fExtent,fExtent,-fExtent);
-    glTexCoord3f(1.0f,-1.0f,1.0f);glVertex3f(fExtent,-fExtent,fExtent);
-    glTexCoord3f(1.0f,-1.0f,-1.0f); glVertex3f(fExtent,-fExtent,-fExtent);
-    glTexCoord3f(1.0f,1.0f,-1.0f);  glVertex3f(fExtent,fExtent,-fExtent);
-    glTexCoord3f(1.0f,1.0f,1.0f); glVertex3f(fExtent,fExtent,fExtent);
-    glTexCoord3f(-1.0f,-1.0f,1.0f);  glVertex3f(-fExtent,-fExtent,fExtent);
-    glTexCoord3f(1.0f,-1.0f,1.0f); glVertex3f(fExtent,-fExtent,fExtent);
-    glTexCoord3f(1.0f,1.0f,1.0f);  glVertex3f(fExtent,fExtent,fExtent);
-    glTexCoord3f(-1.0f,1.0f,1.0f); glVertex3f(-fExtent,fExtent,fExtent);
-    glTexCoord3f(-1.0f,-1.0f,-1.0f); glVertex3f(-fExtent,-fExtent,-fExtent);
-    glTexCoord3f(-1.0f,-1.0f,1.0f);glVertex3f(-fExtent,-fExtent,fExtent);
-    glTexCoord3f(-1.0f,1.0f,1.0f); glVertex3f(-fExtent,fExtent,fExtent);
-    glTexCoord3f(-1.0f,1.0f,-1.0f);glVertex3f(-fExtent,fExtent,-fExtent);
-    glTexCoord3f(-1.0f,1.0f,-1.0f);glVertex3f(-fExtent,fExtent,-fExtent);
-    glTexCoord3f(-1.0f,1.0f,1.0f);glVertex3f(-fExtent,fExtent,fExtent);
-    glTexCoord3f(1.0f,1.0f,1.0f);glVertex3f(fExtent,fExtent,fExtent);
-    glTexCoord3f(1.0f,1.0f,-1.0f);glVertex3f(fExtent,fExtent,-fExtent);
-    glTexCoord3f(-1.0f,-1.0f,-1.0f);glVertex3f(-fExtent,-fExtent,-fExtent);
-    glTexCoord3f(-1.0f,-1.0f,1.0f);glVertex3f(-fExtent,-fExtent,fExtent);
-    glTexCoord3f(1.0f,-1.0f,1.0f); glVertex3f(fExtent,-fExtent,fExtent);
-    glTexCoord3f(1.0f,-1.0f,-1.0f);glVertex3f(fExtent,-fExtent,-fExtent);
-    glEnd();
-    glEndList();
-    cout << "\t  skybox compiled " << endl;
+    // The corners of each face of the skybox, the cube map is looked up
+    // with the corner itself
+    static const float skyboxCorners[6][4][3] = {
+        { { 1,-1,-1}, {-1,-1,-1}, {-1, 1,-1}, { 1, 1,-1} },
+        { { 1,-1, 1}, { 1,-1,-1}, { 1, 1,-1}, { 1, 1, 1} },
+        { {-1,-1, 1}, { 1,-1, 1}, { 1, 1, 1}, {-1, 1, 1} },
+        { {-1,-1,-1}, {-1,-1, 1}, {-1, 1, 1}, {-1, 1,-1} },
+        { {-1, 1,-1}, {-1, 1, 1}, { 1, 1, 1}, { 1, 1,-1} },
+        { {-1,-1,-1}, {-1,-1, 1}, { 1,-1, 1}, { 1,-1,-1} }
+    };
+    GLfloat skyboxVertices[6*4*3];
+    GLubyte skyboxIndices[6*6];
+    for (int q = 0; q < 6; q++) {
+        for (int v = 0; v < 4; v++) {
+            for (int k = 0; k < 3; k++) {
+                skyboxVertices[(q*4 + v)*3 + k] = skyboxCorners[q][v][k] * SKYBOX_EXTENT;
+            }
+        }
+        // Each quad as two triangles
+        static const GLubyte quadIndices[6] = { 0, 1, 2, 0, 2, 3 };
+        for (int i = 0; i < 6; i++) {
+            skyboxIndices[q*6 + i] = q*4 + quadIndices[i];
+        }
+    }
+    glGenVertexArrays(1, &skyboxVertexArray_);
+    glGenBuffers(2, skyboxBuffers_);
+    glBindVertexArray(skyboxVertexArray_);
+    glBindBuffer(GL_ARRAY_BUFFER, skyboxBuffers_[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), skyboxVertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(ATTRIB_VERTEX);
+    glVertexAttribPointer(ATTRIB_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, skyboxBuffers_[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(skyboxIndices), skyboxIndices, GL_STATIC_DRAW);
+
+    // The water quad at sea level, position and bump map coordinate
+    static const GLfloat waterVertices[4*5] = {
+        -WATER_QUAD_SIZE, -WATER_QUAD_SIZE, SEA_LEVEL, 0.0f, 0.0f,
+         WATER_QUAD_SIZE, -WATER_QUAD_SIZE, SEA_LEVEL, 1.0f, 0.0f,
+         WATER_QUAD_SIZE,  WATER_QUAD_SIZE, SEA_LEVEL, 1.0f, 1.0f,
+        -WATER_QUAD_SIZE,  WATER_QUAD_SIZE, SEA_LEVEL, 0.0f, 1.0f
+    };
+    glGenVertexArrays(1, &waterVertexArray_);
+    glGenBuffers(1, &waterBuffer_);
+    glBindVertexArray(waterVertexArray_);
+    glBindBuffer(GL_ARRAY_BUFFER, waterBuffer_);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(waterVertices), waterVertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(ATTRIB_VERTEX);
+    glVertexAttribPointer(ATTRIB_VERTEX, 3, GL_FLOAT, GL_FALSE, 5*sizeof(GLfloat), 0);
+    glEnableVertexAttribArray(ATTRIB_TEX_COORD);
+    glVertexAttribPointer(ATTRIB_TEX_COORD, 2, GL_FLOAT, GL_FALSE, 5*sizeof(GLfloat),
+                          (GLvoid *)(3*sizeof(GLfloat)));
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    cout << "\t  skybox and water quad loaded " << endl;
 }
 /**
   Loads shaders used by the program.  Caleed by the ctor once upon
   initialization.
 **/
 void DrawEngine::load_shaders() {
-    shader_programs_["terrain"] = new QGLShaderProgram(context_);
-    shader_programs_["terrain"]->addShaderFromSourceFile(QGLShader::Vertex,
-                                                         "shaders/terrain.vert");
-    shader_programs_["terrain"]->addShaderFromSourceFile(QGLShader::Fragment,
-                                                         "shaders/terrain.frag");
-    shader_programs_["terrain"]->link();
+    for (int i = 0; i < PROGRAM_COUNT; i++) {
+        programs_[i] = NULL;
+    }
+    programs_[PROGRAM_TERRAIN] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_TERRAIN]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_TERRAIN].vertex));
+    programs_[PROGRAM_TERRAIN]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_TERRAIN].fragment));
+    programs_[PROGRAM_TERRAIN]->bindAttributeLocation("gridPosition", Terrain::ATTRIB_GRID_POSITION);
+    programs_[PROGRAM_TERRAIN]->bindAttributeLocation("packedNormal", Terrain::ATTRIB_NORMAL);
+    programs_[PROGRAM_TERRAIN]->link();
     cout << "\t  shaders/terrain " << endl;
 
-    shader_programs_["water"] = new QGLShaderProgram(context_);
-    shader_programs_["water"]->addShaderFromSourceFile(QGLShader::Vertex,
-                                                         "shaders/water.vert");
-    shader_programs_["water"]->addShaderFromSourceFile(QGLShader::Fragment,
-                                                         "shaders/water.frag");
-    shader_programs_["water"]->link();
+    programs_[PROGRAM_WATER] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_WATER]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_WATER].vertex));
+    programs_[PROGRAM_WATER]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_WATER].fragment));
+    programs_[PROGRAM_WATER]->bindAttributeLocation("vertex", ATTRIB_VERTEX);
+    programs_[PROGRAM_WATER]->bindAttributeLocation("vertexTexCoord", ATTRIB_TEX_COORD);
+    programs_[PROGRAM_WATER]->link();
     cout << "\t  shaders/water " << endl;
 
-    shader_programs_["blur_x"] = new QGLShaderProgram(context_);
-    shader_programs_["blur_x"]->addShaderFromSourceFile(QGLShader::Vertex,
-                                                            "shaders/blurx.vert");
-    shader_programs_["blur_x"]->addShaderFromSourceFile(QGLShader::Fragment,
-                                                            "shaders/blurx.frag");
-    shader_programs_["blur_x"]->link();
+    programs_[PROGRAM_SKYBOX] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_SKYBOX]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                        shader_source(PROGRAM_SOURCES[PROGRAM_SKYBOX].vertex));
+    programs_[PROGRAM_SKYBOX]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                        shader_source(PROGRAM_SOURCES[PROGRAM_SKYBOX].fragment));
+    programs_[PROGRAM_SKYBOX]->bindAttributeLocation("vertex", ATTRIB_VERTEX);
+    programs_[PROGRAM_SKYBOX]->link();
+    cout << "\t  shaders/skybox " << endl;
+
+    // The layered water pass: terrain and skybox are drawn once and sent
+    // to both layers by geometry shaders, the water reads the layers from
+    // a texture array
+    programs_[PROGRAM_TERRAIN_LAYERED] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_TERRAIN_LAYERED]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                                 shader_source(PROGRAM_SOURCES[PROGRAM_TERRAIN_LAYERED].vertex));
+    programs_[PROGRAM_TERRAIN_LAYERED]->addShaderFromSourceCode(QGLShader::Geometry,
+                                                                 shader_source(PROGRAM_SOURCES[PROGRAM_TERRAIN_LAYERED].geometry));
+    programs_[PROGRAM_TERRAIN_LAYERED]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                                 shader_source(PROGRAM_SOURCES[PROGRAM_TERRAIN_LAYERED].fragment));
+    programs_[PROGRAM_TERRAIN_LAYERED]->setGeometryInputType(GL_TRIANGLES);
+    programs_[PROGRAM_TERRAIN_LAYERED]->setGeometryOutputType(GL_TRIANGLE_STRIP);
+    programs_[PROGRAM_TERRAIN_LAYERED]->setGeometryOutputVertexCount(6);
+    programs_[PROGRAM_TERRAIN_LAYERED]->bindAttributeLocation("gridPosition", Terrain::ATTRIB_GRID_POSITION);
+    programs_[PROGRAM_TERRAIN_LAYERED]->bindAttributeLocation("packedNormal", Terrain::ATTRIB_NORMAL);
+    programs_[PROGRAM_TERRAIN_LAYERED]->link();
+    cout << "\t  shaders/terrain_layered " << endl;
+
+    programs_[PROGRAM_SKYBOX_LAYERED] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_SKYBOX_LAYERED]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                                shader_source(PROGRAM_SOURCES[PROGRAM_SKYBOX_LAYERED].vertex));
+    programs_[PROGRAM_SKYBOX_LAYERED]->addShaderFromSourceCode(QGLShader::Geometry,
+                                                                shader_source(PROGRAM_SOURCES[PROGRAM_SKYBOX_LAYERED].geometry));
+    programs_[PROGRAM_SKYBOX_LAYERED]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                                shader_source(PROGRAM_SOURCES[PROGRAM_SKYBOX_LAYERED].fragment));
+    programs_[PROGRAM_SKYBOX_LAYERED]->setGeometryInputType(GL_TRIANGLES);
+    programs_[PROGRAM_SKYBOX_LAYERED]->setGeometryOutputType(GL_TRIANGLE_STRIP);
+    programs_[PROGRAM_SKYBOX_LAYERED]->setGeometryOutputVertexCount(6);
+    programs_[PROGRAM_SKYBOX_LAYERED]->bindAttributeLocation("vertex", ATTRIB_VERTEX);
+    programs_[PROGRAM_SKYBOX_LAYERED]->link();
+    cout << "\t  shaders/skybox_layered " << endl;
+
+    QByteArray layeredWater = shader_source(PROGRAM_SOURCES[PROGRAM_WATER_LAYERED].fragment, "#define LAYERED_WATER\n");
+    programs_[PROGRAM_WATER_LAYERED] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_WATER_LAYERED]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                               shader_source(PROGRAM_SOURCES[PROGRAM_WATER_LAYERED].vertex));
+    programs_[PROGRAM_WATER_LAYERED]->addShaderFromSourceCode(QGLShader::Fragment, layeredWater);
+    programs_[PROGRAM_WATER_LAYERED]->bindAttributeLocation("vertex", ATTRIB_VERTEX);
+    programs_[PROGRAM_WATER_LAYERED]->bindAttributeLocation("vertexTexCoord", ATTRIB_TEX_COORD);
+    programs_[PROGRAM_WATER_LAYERED]->link();
+    cout << "\t  shaders/water, layered " << endl;
+
+    programs_[PROGRAM_HIZ] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_HIZ]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_HIZ].vertex));
+    programs_[PROGRAM_HIZ]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_HIZ].fragment));
+    programs_[PROGRAM_HIZ]->link();
+    cout << "\t  shaders/hiz " << endl;
+
+    programs_[PROGRAM_SSR] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_SSR]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_SSR].vertex));
+    programs_[PROGRAM_SSR]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                         shader_source(PROGRAM_SOURCES[PROGRAM_SSR].fragment));
+    programs_[PROGRAM_SSR]->bindAttributeLocation("vertex", ATTRIB_VERTEX);
+    programs_[PROGRAM_SSR]->link();
+    cout << "\t  shaders/ssr " << endl;
+
+    programs_[PROGRAM_DOF_DOWN] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_DOF_DOWN]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                            shader_source(PROGRAM_SOURCES[PROGRAM_DOF_DOWN].vertex));
+    programs_[PROGRAM_DOF_DOWN]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                            shader_source(PROGRAM_SOURCES[PROGRAM_DOF_DOWN].fragment));
+    programs_[PROGRAM_DOF_DOWN]->link();
+    cout << "\t  shaders/dofdown " << endl;
+
+    programs_[PROGRAM_BLUR_X] = new QGLShaderProgram(context_);
+    programs_[PROGRAM_BLUR_X]->addShaderFromSourceCode(QGLShader::Vertex,
+                                                            shader_source(PROGRAM_SOURCES[PROGRAM_BLUR_X].vertex));
+    programs_[PROGRAM_BLUR_X]->addShaderFromSourceCode(QGLShader::Fragment,
+                                                            shader_source(PROGRAM_SOURCES[PROGRAM_BLUR_X].fragment));
+    programs_[PROGRAM_BLUR_X]->link();
     cout << "\t  shaders/blurx " << endl;
 
-    shader_programs_["blur_y"] = new QGLShaderProgram(context_);
-    shader_programs_["blur_y"]->addShaderFromSourceFile(QGLShader::Vertex,
-                                                            "shaders/blury.vert");
-    shader_programs_["blur_y"]->addShaderFromSourceFile(QGLShader::Fragment,
-                                                            "shaders/blury.frag");
-    shader_programs_["blur_y"]->link();
-    cout << "\t  shaders/blury " << endl;
+    // QGLShaderProgram has no compute shaders, so this one is built by hand
+    int major = 0, minor = 0;
+    sscanf((const char *)glGetString(GL_VERSION), "%d.%d", &major, &minor);
+    if (major > 4 || (major == 4 && minor >= 3)) {
+        computeBlurProgram_ = load_compute_shader(COMPUTE_BLUR_SOURCE);
+        cout << "\t  shaders/blur.comp " << endl;
+    }
 
-    shader_programs_["lerp"] = new QGLShaderProgram(context_);
-    shader_programs_["lerp"]->addShaderFromSourceFile(QGLShader::Vertex,
-                                                            "shaders/lerp.vert");
-    shader_programs_["lerp"]->addShaderFromSourceFile(QGLShader::Fragment,
-                                                            "shaders/lerp.frag");
-    shader_programs_["lerp"]->link();
-    cout << "\t  shaders/lerp " << endl;
+    // One program for each combination of post processing steps the last
+    // pass can run, the steps defined after the #version line
+    for (unsigned i = 0; i < sizeof(POST_PROGRAM_STEPS) / sizeof(POST_PROGRAM_STEPS[0]); i++) {
+        int steps = POST_PROGRAM_STEPS[i];
+        QByteArray defines;
+        if (steps & POST_BLUR_Y) {
+            defines.append("#define BLUR_Y\n");
+        }
+        if (steps & POST_COMPOSITE) {
+            defines.append("#define COMPOSITE\n");
+        }
+        if (steps & POST_DEPTHMAP) {
+            defines.append("#define DEPTHMAP\n");
+        }
+        QByteArray source = shader_source(PROGRAM_SOURCES[PROGRAM_POST].fragment, defines);
+        QGLShaderProgram *program = new QGLShaderProgram(context_);
+        program->addShaderFromSourceCode(QGLShader::Vertex, shader_source(PROGRAM_SOURCES[PROGRAM_POST].vertex));
+        program->addShaderFromSourceCode(QGLShader::Fragment, source);
+        program->link();
+        programs_[PROGRAM_POST + steps] = program;
+    }
+    cout << "\t  shaders/post " << endl;
 
-    shader_programs_["depthmap"] = new QGLShaderProgram(context_);
-    shader_programs_["depthmap"]->addShaderFromSourceFile(QGLShader::Vertex,
-                                                            "shaders/depthmap.vert");
-    shader_programs_["depthmap"]->addShaderFromSourceFile(QGLShader::Fragment,
-                                                            "shaders/depthmap.frag");
-    shader_programs_["depthmap"]->link();
-    cout << "\t  shaders/depthmap " << endl;
+    // Looked up once here, drawing sets uniforms by location
+    for (int i = 0; i < PROGRAM_COUNT; i++) {
+        if (programs_[i]) {
+            get_uniform_locations(programs_[i]->programId(), uniforms_[i]);
+            bind_uniform_blocks(programs_[i]->programId());
+        }
+    }
+    if (computeBlurProgram_) {
+        get_uniform_locations(computeBlurProgram_, computeBlurUniforms_);
+        bind_uniform_blocks(computeBlurProgram_);
+    }
+    Terrain::getUniformLocations(programs_[PROGRAM_TERRAIN]->programId(), terrainUniforms_);
+    Terrain::getUniformLocations(programs_[PROGRAM_TERRAIN_LAYERED]->programId(), terrainLayeredUniforms_);
+}
+
+/**
+  Looks up the location of every ShaderUniform in a linked program, -1
+  for those it doesn't use
+  **/
+void DrawEngine::get_uniform_locations(GLuint program, GLint *locations) {
+    for (int i = 0; i < UNIFORM_COUNT; i++) {
+        locations[i] = glGetUniformLocation(program, UNIFORM_NAMES[i]);
+    }
+}
+
+/**
+  Binds the uniform blocks a linked program uses to their UniformBlock
+  binding points
+  **/
+void DrawEngine::bind_uniform_blocks(GLuint program) {
+    for (int i = 0; i < UNIFORM_BLOCK_COUNT; i++) {
+        GLuint index = glGetUniformBlockIndex(program, UNIFORM_BLOCK_NAMES[i]);
+        if (index != GL_INVALID_INDEX) {
+            glUniformBlockBinding(program, index, i);
+        }
+    }
+}
+
+/**
+  Reads a shader, with the uniform blocks of shaders/uniforms.glsl and
+  the given defines inserted after its #version line.
+  **/
+QByteArray DrawEngine::shader_source(const QString &path, const QByteArray &defines) {
+    QFile file(path), blocks("shaders/uniforms.glsl");
+    file.open(QFile::ReadOnly | QFile::Text);
+    blocks.open(QFile::ReadOnly | QFile::Text);
+    QByteArray source = file.readAll(), header = blocks.readAll();
+    header.append(defines);
+    source.insert(source.indexOf('\n') + 1, header);
+    return source;
 }
 
 /**
@@ -206,9 +485,21 @@ void DrawEngine::load_shaders() {
 **/
 void DrawEngine::load_textures() {
     cout << "Loading textures..." << endl;
+    terrainTextures_[0] = load_texture(TERRAIN_TEX0);
+    terrainTextures_[1] = load_texture(TERRAIN_TEX1);
+    terrainTextures_[2] = load_texture(TERRAIN_TEX2);
+    terrainTextures_[3] = load_texture(TERRAIN_TEX3);
+    bumpMap_ = load_texture(QString("textures/water01_bumpmap.jpg"));
+}
+
+/**
+  Loads the skybox the quality settings choose at their face width,
+  replacing the one loaded before.
+  **/
+void DrawEngine::load_skybox() {
     QList<QFile *> fileList;
 
-    switch (SKYBOX) {
+    switch (quality_.skybox) {
     case SKYBOX_ALPINE:
         fileList.append(new QFile("textures/alpine/alpine_west.bmp"));
         fileList.append(new QFile("textures/alpine/alpine_east.bmp"));
@@ -235,15 +526,35 @@ void DrawEngine::load_textures() {
         fileList.append(new QFile("textures/islands/islands_north.bmp"));
     }
 
-    GLuint terrainTextures[4];
-    terrainTextures[0] = load_texture(TERRAIN_TEX0);
-    terrainTextures[1] = load_texture(TERRAIN_TEX1);
-    terrainTextures[2] = load_texture(TERRAIN_TEX2);
-    terrainTextures[3] = load_texture(TERRAIN_TEX3);
-    bumpMap_ = load_texture(QString("textures/water01_bumpmap.jpg"));
-    textures_["cube_map_1"] = load_cube_map(fileList);
+    if (cubeMap_) {
+        ((QGLContext *)(context_))->deleteTexture(cubeMap_);
+    }
+    cubeMap_ = load_cube_map(fileList);
+    foreach(QFile *file, fileList)
+        delete file;
+}
 
-    terrain_->setTextures(terrainTextures);
+/**
+  Generates the terrain at the depth the quality settings choose,
+  replacing the one generated before.
+  **/
+void DrawEngine::create_terrain() {
+    bool occlusionCulling = terrain_ ? terrain_->getOcclusionCulling() : true;
+    delete terrain_;
+
+    terrain_ = new Terrain(quality_.terrainDepth);
+    terrain_->setSeed(2);
+    float3 tl(-10, 10, 2);
+    float3 tr(10, 10, 4);
+    float3 bl(-10, -10, 8);
+    float3 br(10, -10, 6);
+    terrain_->populateTerrain(tl, tr, bl, br);
+    terrain_->populateNormals();
+    terrain_->createBuffers();
+    terrain_->setSeaLevel(SEA_LEVEL);
+    terrain_->setTextures(terrainTextures_, UNIT_TERRAIN_REGIONS);
+    glState_.invalidate();
+    terrain_->setOcclusionCulling(occlusionCulling);
 }
 
 /**
@@ -265,58 +576,201 @@ GLuint DrawEngine::load_texture(const QFile &file) {
     texture = QGLWidget::convertToGLFormat(image);
 
     glGenTextures(1, &toReturn);
-    glActiveTexture(GL_TEXTURE0 + toReturn);
+    glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, toReturn);
-    gluBuild2DMipmaps(GL_TEXTURE_2D, 3, texture.width(), texture.height(), GL_RGBA, GL_UNSIGNED_BYTE, texture.bits());
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, texture.width(), texture.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, texture.bits());
+    glGenerateMipmap(GL_TEXTURE_2D);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP); glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE); glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
     return toReturn;
 }
 
 
 /**
-  Creates the intial framebuffers for drawing.  Called by the ctor once
-  upon initialization.
-
-  @todo Finish filling this in.
+  Declares the passes of a frame and the render targets they read and
+  write, then compiles the frame graph.  Called by the ctor and again
+  whenever the window size or the enabled effects change.
 
   @param w:    the viewport width
   @param h:    the viewport height
 **/
-void DrawEngine::create_fbos(int w, int h) {
-    //Allocate the main framebuffer object for rendering the scene to
-    //This needs a depth attachment.
-    framebuffer_objects_["fbo_0"] = new QGLFramebufferObject(w,h,QGLFramebufferObject::Depth,
-                                                             GL_TEXTURE_2D,GL_RGBA16F_ARB);
-    framebuffer_objects_["fbo_0"]->format().setSamples(16);
-    //Allocate the secondary framebuffer obejcts for rendering textures to (post process effects)
-    //These do not require depth attachments.
-    framebuffer_objects_["fbo_1"] = new QGLFramebufferObject(w,h,QGLFramebufferObject::NoAttachment,
-                                                             GL_TEXTURE_2D,GL_RGBA16F_ARB);
-    framebuffer_objects_["fbo_2"] = new QGLFramebufferObject(w,h,QGLFramebufferObject::NoAttachment,
-                                                             GL_TEXTURE_2D,GL_RGBA16F_ARB);
-    framebuffer_objects_["reflection"] = new QGLFramebufferObject(w,h,QGLFramebufferObject::Depth,
-                                                             GL_TEXTURE_2D,GL_RGBA16F_ARB);
-    framebuffer_objects_["refraction"] = new QGLFramebufferObject(w,h,QGLFramebufferObject::Depth,
-                                                             GL_TEXTURE_2D,GL_RGBA16F_ARB);
-}
-
-/**
-  Reallocates all the framebuffers.  Called when the viewport is
-  resized.
+void DrawEngine::build_frame_graph(int w, int h) {
+    frameGraph_.reset(w, h);
+    // The water distorts the reflection and refraction with its bump map,
+    // so they can be rendered smaller and upsampled without it showing
+    frameGraph_.setTarget(TARGET_REFLECTION, targetFormats_[TARGET_REFLECTION], reflectionScale_);
+    frameGraph_.setTarget(TARGET_REFLECTION_DEPTH, targetFormats_[TARGET_REFLECTION_DEPTH], reflectionScale_);
+    frameGraph_.setTarget(TARGET_REFRACTION, targetFormats_[TARGET_REFRACTION], refractionScale_);
+    frameGraph_.setTarget(TARGET_REFRACTION_DEPTH, targetFormats_[TARGET_REFRACTION_DEPTH], refractionScale_);
+    // Layer 0 is the reflection, layer 1 the refraction
+    frameGraph_.setTarget(TARGET_WATER_LAYERS, targetFormats_[TARGET_WATER_LAYERS], reflectionScale_);
+    frameGraph_.setLayers(TARGET_WATER_LAYERS, 2);
+    frameGraph_.setTarget(TARGET_WATER_LAYERS_DEPTH, targetFormats_[TARGET_WATER_LAYERS_DEPTH], reflectionScale_);
+    frameGraph_.setLayers(TARGET_WATER_LAYERS_DEPTH, 2);
+    if (waterUpdateMode_ != WATER_UPDATE_EVERY_FRAME) {
+        // Kept between frames so they can be updated less often
+        frameGraph_.setPersistent(TARGET_REFLECTION);
+        frameGraph_.setPersistent(TARGET_REFRACTION);
+        frameGraph_.setPersistent(TARGET_WATER_LAYERS);
+    }
+    frameGraph_.setTarget(TARGET_SCENE, targetFormats_[TARGET_SCENE]);
+    frameGraph_.setTarget(TARGET_SCENE_DEPTH, targetFormats_[TARGET_SCENE_DEPTH]);
+    frameGraph_.setTarget(TARGET_SCENE_COPY, targetFormats_[TARGET_SCENE_COPY]);
+    frameGraph_.setTarget(TARGET_SCENE_COPY_DEPTH, targetFormats_[TARGET_SCENE_COPY_DEPTH]);
+    // The pyramid blurs at a quarter of the resolution
+    float blurScale = dofPyramid_ ? 0.25f : 1.0f;
+    frameGraph_.setTarget(TARGET_DOF_HALF, targetFormats_[TARGET_DOF_HALF], 0.5f);
+    frameGraph_.setTarget(TARGET_DOF_QUARTER, targetFormats_[TARGET_DOF_QUARTER], 0.25f);
+    frameGraph_.setTarget(TARGET_BLUR_X, targetFormats_[TARGET_BLUR_X], blurScale);
+    frameGraph_.setTarget(TARGET_BLUR_Y, targetFormats_[TARGET_BLUR_Y], blurScale);
+    // Everything drawn from the scene's point of view is drawn at the
+    // render scale, see tune_render_scale.  The reflection and refraction
+    // are looked up by projection, they have scales of their own.
+    static const RenderTarget dynamicTargets[] = {
+        TARGET_SCENE, TARGET_SCENE_DEPTH, TARGET_SCENE_COPY, TARGET_SCENE_COPY_DEPTH,
+        TARGET_DOF_HALF, TARGET_DOF_QUARTER, TARGET_BLUR_X, TARGET_BLUR_Y
+    };
+    for (unsigned i = 0; i < sizeof(dynamicTargets) / sizeof(dynamicTargets[0]); i++) {
+        frameGraph_.setDynamic(dynamicTargets[i]);
+    }
 
-  @param w:    the viewport width
-  @param h:    the viewport height
-**/
-void DrawEngine::realloc_framebuffers(int w, int h) {
-    foreach(QGLFramebufferObject *fbo,framebuffer_objects_)  {
-        const QString &key = framebuffer_objects_.key(fbo);
-        QGLFramebufferObjectFormat format = fbo->format();
-        delete fbo;
-        framebuffer_objects_[key] = new QGLFramebufferObject(w,h,format);
+    if (layered_water()) {
+        // Render the reflected scene and the scene below sea level at once
+        frameGraph_.addPass(PASS_WATER_LAYERS);
+        frameGraph_.write(TARGET_WATER_LAYERS);
+        frameGraph_.write(TARGET_WATER_LAYERS_DEPTH);
+    } else {
+        if (reflectionMode_ == REFLECTION_MIRRORED) {
+            // Render just the reflected scene about sea level
+            frameGraph_.addPass(PASS_REFLECTION);
+            frameGraph_.write(TARGET_REFLECTION);
+            frameGraph_.write(TARGET_REFLECTION_DEPTH);
+        }
+        if (!refractionFromScene_) {
+            // Render just the scene below sea level
+            frameGraph_.addPass(PASS_REFRACTION);
+            frameGraph_.write(TARGET_REFRACTION);
+            frameGraph_.write(TARGET_REFRACTION_DEPTH);
+        }
     }
+
+    if (copies_scene()) {
+        // Render the opaque scene, tracking how much we need to blur later
+        frameGraph_.addPass(PASS_SCENE);
+        frameGraph_.write(TARGET_SCENE);
+        frameGraph_.write(TARGET_SCENE_DEPTH);
+
+        // Copy it for the water to refract and reflect, depth included to
+        // fade the refraction with and to march reflections through
+        frameGraph_.addPass(PASS_SCENE_COPY);
+        frameGraph_.read(TARGET_SCENE);
+        frameGraph_.read(TARGET_SCENE_DEPTH);
+        frameGraph_.write(TARGET_SCENE_COPY);
+        frameGraph_.write(TARGET_SCENE_COPY_DEPTH);
+
+        if (reflectionMode_ == REFLECTION_SCREEN_SPACE) {
+            // Nearest depths of ever larger blocks of the screen, down to
+            // a single texel, so rays can skip empty space quickly
+            int size = MAX(w, h), levels = 1;
+            for (; size > 1; size >>= 1) {
+                levels++;
+            }
+            frameGraph_.setTarget(TARGET_DEPTH_PYRAMID, targetFormats_[TARGET_DEPTH_PYRAMID]);
+            frameGraph_.setLevels(TARGET_DEPTH_PYRAMID, levels);
+            frameGraph_.setDynamic(TARGET_DEPTH_PYRAMID);
+            frameGraph_.addPass(PASS_DEPTH_PYRAMID);
+            frameGraph_.read(TARGET_SCENE_COPY_DEPTH);
+            frameGraph_.write(TARGET_DEPTH_PYRAMID);
+
+            frameGraph_.addPass(PASS_SCREEN_SPACE_REFLECTION);
+            frameGraph_.read(TARGET_SCENE_COPY);
+            frameGraph_.read(TARGET_DEPTH_PYRAMID);
+            frameGraph_.write(TARGET_REFLECTION);
+        }
+
+        // Then draw the water over the scene
+        frameGraph_.addPass(PASS_WATER);
+        frameGraph_.read(TARGET_REFLECTION);
+        if (refractionFromScene_) {
+            frameGraph_.read(TARGET_SCENE_COPY);
+            frameGraph_.read(TARGET_SCENE_COPY_DEPTH);
+        } else {
+            frameGraph_.read(TARGET_REFRACTION);
+        }
+        frameGraph_.write(TARGET_SCENE);
+        frameGraph_.write(TARGET_SCENE_DEPTH);
+    } else {
+        // Render the scene, tracking how much we need to blur later
+        frameGraph_.addPass(PASS_SCENE);
+        if (layered_water()) {
+            frameGraph_.read(TARGET_WATER_LAYERS);
+        } else {
+            frameGraph_.read(TARGET_REFLECTION);
+            frameGraph_.read(TARGET_REFRACTION);
+        }
+        frameGraph_.write(TARGET_SCENE);
+        frameGraph_.write(TARGET_SCENE_DEPTH);
+    }
+
+    // Gaussian filtering along the X and then the Y axis.  Culled along
+    // with their targets unless the composite below reads them.
+    if (dofPyramid_) {
+        // Halve the scene twice, then blur only the quarter level
+        frameGraph_.addPass(PASS_DOF_HALF);
+        frameGraph_.read(TARGET_SCENE);
+        frameGraph_.read(TARGET_SCENE_DEPTH);
+        frameGraph_.write(TARGET_DOF_HALF);
+        frameGraph_.addPass(PASS_DOF_QUARTER);
+        frameGraph_.read(TARGET_DOF_HALF);
+        frameGraph_.write(TARGET_DOF_QUARTER);
+    }
+    if (compute_blur()) {
+        // Both directions in one dispatch, straight into the blurred target
+        frameGraph_.addPass(PASS_BLUR_COMPUTE);
+        frameGraph_.read(dofPyramid_ ? TARGET_DOF_QUARTER : TARGET_SCENE);
+        frameGraph_.read(TARGET_SCENE_DEPTH);
+        frameGraph_.write(TARGET_BLUR_Y);
+    } else {
+        // The Y axis is blurred by the pass that composites
+        frameGraph_.addPass(PASS_BLUR_X);
+        frameGraph_.read(dofPyramid_ ? TARGET_DOF_QUARTER : TARGET_SCENE);
+        frameGraph_.read(TARGET_SCENE_DEPTH);
+        frameGraph_.write(TARGET_BLUR_X);
+    }
+
+    // The post processing steps left run fused in the pass drawing to the
+    // screen: just the alpha (blend) values, the scene blended with its
+    // blurred copy, or the scene as it is
+    frameGraph_.addPass(PASS_POST);
+    frameGraph_.read(TARGET_SCENE);
+    frameGraph_.read(TARGET_SCENE_DEPTH);
+    if (depthmapEnabled_) {
+        postSteps_ = POST_DEPTHMAP;
+    } else if (dofEnabled_) {
+        postSteps_ = POST_COMPOSITE;
+        if (compute_blur()) {
+            frameGraph_.read(TARGET_BLUR_Y);
+        } else {
+            postSteps_ |= POST_BLUR_Y;
+            frameGraph_.read(TARGET_BLUR_X);
+        }
+        if (dofPyramid_) {
+            frameGraph_.read(TARGET_DOF_HALF);
+        }
+    } else {
+        postSteps_ = 0;
+    }
+    frameGraph_.write(FrameGraph::BACKBUFFER);
+
+    frameGraph_.compile();
+    frameGraphDirty_ = false;
+    // The targets may have moved, so redraw them in full
+    reflectionHistory_.valid = false;
+    refractionHistory_.valid = false;
+    // Passes no longer in the graph draw nothing
+    waterPassSamples_[0] = waterPassSamples_[1] = 0;
 }
 
 
@@ -330,194 +784,747 @@ void DrawEngine::realloc_framebuffers(int w, int h) {
 **/
 void DrawEngine::draw_frame(float time, int w, int h) {
     fps_ = 1000.f / (time - previous_time_), previous_time_ = time;
+    begin_frame_timing();
+    tune_quality();
+    frameGraph_.setRenderScale(dynamicResolution_ ? renderScale_ : 1.0f);
+
+    // A window being resized draws into part of the targets it has, they
+    // are only reallocated when it outgrows them or stops at a size of
+    // another bucket
+    if (w != windowWidth_ || h != windowHeight_) {
+        windowWidth_ = w;
+        windowHeight_ = h;
+        resizeTime_ = time;
+        // What was kept of the reflection and refraction is in another part
+        reflectionHistory_.valid = false;
+        refractionHistory_.valid = false;
+    }
+    int bucketWidth = resize_bucket(w), bucketHeight = resize_bucket(h);
+    bool outgrown = w > frameGraph_.getWidth() || h > frameGraph_.getHeight();
+    bool settled = time - resizeTime_ >= RESIZE_SETTLE_TIME;
+    if (frameGraphDirty_ || outgrown ||
+        (settled && (bucketWidth != frameGraph_.getWidth() || bucketHeight != frameGraph_.getHeight()))) {
+        build_frame_graph(bucketWidth, bucketHeight);
+    }
+    frameGraph_.setFrameSize(w, h);
+    write_frame_uniforms(w, h);
+    // Qt's text rendering and loading textures change state behind its back
+    glState_.invalidate();
+    // Staggered, so in the amortized modes the two don't update in the same frame
+    frameCount_++;
+    reflectionUpdate_ = plan_water_update(reflectionHistory_, 0);
+    refractionUpdate_ = plan_water_update(refractionHistory_, 1);
+    if (refractionFromScene_) {
+        // The copy of the scene is redone every frame
+        refractionUpdate_ = WATER_DRAW_ALL;
+    } else if (layered_water()) {
+        // Both layers are drawn together
+        refractionUpdate_ = reflectionUpdate_;
+    }
 
-    // Render just the reflected scene about sea level to a framebuffer
-    framebuffer_objects_["reflection"]->bind();
-    perspective_camera(w, h);
-    glActiveTexture(GL_TEXTURE0);
-    render_reflections();
-    framebuffer_objects_["reflection"]->release();
+    // Nothing to reflect or refract if no water shows this frame
+    update_water_visibility(w, h);
+    read_fill_queries();
+    if (waterCulling_ && waterVisibility_ != WATER_VISIBLE) {
+        reflectionUpdate_ = refractionUpdate_ = WATER_DRAW_NOTHING;
+    }
 
-    // Render just the scene below sea level to a framebuffer
-    framebuffer_objects_["refraction"]->bind();
-    perspective_camera(w, h);
-    glActiveTexture(GL_TEXTURE0);
-    render_refraction();
-    framebuffer_objects_["refraction"]->release();
-
-    // Refraction testing
-    if (false) {
-        orthogonal_camera(w, h);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["refraction"]->texture());
-        textured_quad(w, h, true);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    bool marchReflection = reflectionMode_ == REFLECTION_SCREEN_SPACE && reflectionUpdate_ != WATER_DRAW_NOTHING;
+    for (int i = 0; i < PASS_COUNT; i++) {
+        stateChanges_[i] = skippedStateChanges_[i] = 0;
+    }
+    for (int i = 0; i < frameGraph_.getPassCount(); i++) {
+        int pass = frameGraph_.beginPass(i);
+        glState_.resetCounts();
+        switch (pass) {
+        case PASS_REFLECTION:
+            if (reflectionUpdate_ != WATER_DRAW_NOTHING) {
+                perspective_camera(w, h);
+                glState_.activeTexture(GL_TEXTURE0);
+                begin_water_rows(reflectionUpdate_);
+                begin_water_scissor(TARGET_REFLECTION);
+                render_reflections();
+                glState_.disable(GL_SCISSOR_TEST);
+                end_water_rows();
+            }
+            break;
+
+        case PASS_REFRACTION:
+            if (refractionUpdate_ != WATER_DRAW_NOTHING) {
+                perspective_camera(w, h);
+                glState_.activeTexture(GL_TEXTURE0);
+                begin_water_rows(refractionUpdate_);
+                begin_water_scissor(TARGET_REFRACTION);
+                render_refraction();
+                glState_.disable(GL_SCISSOR_TEST);
+                end_water_rows();
+            }
+            break;
+
+        case PASS_WATER_LAYERS:
+            if (reflectionUpdate_ != WATER_DRAW_NOTHING) {
+                perspective_camera(w, h);
+                glState_.activeTexture(GL_TEXTURE0);
+                begin_water_rows(reflectionUpdate_);
+                begin_water_scissor(TARGET_WATER_LAYERS);
+                render_water_layers();
+                glState_.disable(GL_SCISSOR_TEST);
+                end_water_rows();
+            }
+            break;
+
+        case PASS_SCENE:
+            perspective_camera(w, h);
+            // Ensure that GL_TEXTURE0 is active before rendering the scene!
+            glState_.activeTexture(GL_TEXTURE0);
+            render_scene(w, h);
+            break;
+
+        case PASS_SCENE_COPY:
+            if (marchReflection || (refractionFromScene_ && refractionUpdate_ != WATER_DRAW_NOTHING)) {
+                int sw = frameGraph_.getViewWidth(TARGET_SCENE), sh = frameGraph_.getViewHeight(TARGET_SCENE);
+                frameGraph_.bindReadTargets(TARGET_SCENE, TARGET_SCENE_DEPTH);
+                // Reflected rays can end anywhere on screen
+                if (!marchReflection) {
+                    begin_water_scissor(TARGET_SCENE_COPY);
+                }
+                glBlitFramebuffer(0, 0, sw, sh, 0, 0, sw, sh, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+                glState_.disable(GL_SCISSOR_TEST);
+            }
+            break;
+
+        case PASS_DEPTH_PYRAMID:
+            if (reflectionUpdate_ != WATER_DRAW_NOTHING) {
+                build_depth_pyramid();
+            }
+            break;
+
+        case PASS_SCREEN_SPACE_REFLECTION:
+            if (reflectionUpdate_ != WATER_DRAW_NOTHING) {
+                perspective_camera(w, h);
+                begin_water_rows(reflectionUpdate_);
+                begin_water_scissor(TARGET_REFLECTION);
+                render_screen_space_reflections();
+                glState_.disable(GL_SCISSOR_TEST);
+                end_water_rows();
+            }
+            break;
+
+        case PASS_WATER:
+            perspective_camera(w, h);
+            glState_.activeTexture(GL_TEXTURE0);
+            render_water_pass();
+            break;
+
+        case PASS_DOF_HALF:
+        case PASS_DOF_QUARTER: {
+            RenderTarget source = pass == PASS_DOF_HALF ? TARGET_SCENE : TARGET_DOF_HALF;
+            glState_.useProgram(programs_[PROGRAM_DOF_DOWN]->programId());
+            const GLint *u = uniforms_[PROGRAM_DOF_DOWN];
+            programs_[PROGRAM_DOF_DOWN]->setUniformValue(u[UNIFORM_TEX0], 0);
+            programs_[PROGRAM_DOF_DOWN]->setUniformValue(u[UNIFORM_TEXEL_SIZE], 1.0f / frameGraph_.getTargetWidth(source),
+                                                         1.0f / frameGraph_.getTargetHeight(source));
+            set_view_max(PROGRAM_DOF_DOWN, source);
+            programs_[PROGRAM_DOF_DOWN]->setUniformValue(u[UNIFORM_VIEW_SCALE], frameGraph_.getViewScaleX(source),
+                                                         frameGraph_.getViewScaleY(source));
+            set_depth_blur(PROGRAM_DOF_DOWN, source == TARGET_SCENE);
+            glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(source));
+            fullscreen_triangle();
+            end_depth_blur();
+            glState_.useProgram(0);
+            glState_.bindTexture(GL_TEXTURE_2D, 0);
+            break;
+        }
+
+        case PASS_BLUR_X: {
+            // The tap offsets are in the scene's texels whatever the level
+            // blurred, so the blur size is the same in both modes.  They
+            // are scaled to the part of the level drawn, to keep the blur
+            // the same size on screen.
+            RenderTarget source = dofPyramid_ ? TARGET_DOF_QUARTER : TARGET_SCENE;
+            glState_.useProgram(programs_[PROGRAM_BLUR_X]->programId());
+            const GLint *u = uniforms_[PROGRAM_BLUR_X];
+            programs_[PROGRAM_BLUR_X]->setUniformValue(u[UNIFORM_WIDTH],
+                                                       w * blurFactor_ / frameGraph_.getViewScaleX(TARGET_SCENE));
+            set_view_max(PROGRAM_BLUR_X, source);
+            programs_[PROGRAM_BLUR_X]->setUniformValue(u[UNIFORM_VIEW_SCALE], frameGraph_.getViewScaleX(source),
+                                                       frameGraph_.getViewScaleY(source));
+            set_depth_blur(PROGRAM_BLUR_X, !dofPyramid_);
+            glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(source));
+            fullscreen_triangle();
+            end_depth_blur();
+            glState_.useProgram(0);
+            glState_.bindTexture(GL_TEXTURE_2D, 0);
+            break;
+        }
+
+        case PASS_BLUR_COMPUTE:
+            render_compute_blur(w);
+            break;
+
+        case PASS_POST: {
+            ShaderProgramId program = (ShaderProgramId)(PROGRAM_POST + postSteps_);
+            QGLShaderProgram *post = programs_[program];
+            const GLint *u = uniforms_[program];
+            glState_.useProgram(post->programId());
+            post->setUniformValue(u[UNIFORM_SCENE], UNIT_SOURCE);
+            post->setUniformValue(u[UNIFORM_BLURRED], UNIT_BLURRED);
+            post->setUniformValue(u[UNIFORM_HALFRES], UNIT_HALFRES);
+            post->setUniformValue(u[UNIFORM_PYRAMID], dofPyramid_ ? 1.0f : 0.0f);
+            post->setUniformValue(u[UNIFORM_BLUR_HEIGHT], h * blurFactor_ / frameGraph_.getViewScaleY(TARGET_SCENE));
+            // Upscaled from the part of the targets drawn
+            post->setUniformValue(u[UNIFORM_VIEW_SCALE], frameGraph_.getViewScaleX(TARGET_SCENE),
+                                  frameGraph_.getViewScaleY(TARGET_SCENE));
+            set_depth_blur(program, true);
+            glState_.activeTexture(GL_TEXTURE0 + UNIT_HALFRES);
+            glState_.bindTexture(GL_TEXTURE_2D, dofPyramid_ ? frameGraph_.getTexture(TARGET_DOF_HALF) : 0);
+            glState_.activeTexture(GL_TEXTURE0 + UNIT_BLURRED);
+            glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(compute_blur() ? TARGET_BLUR_Y : TARGET_BLUR_X));
+            glState_.activeTexture(GL_TEXTURE0);
+            glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(TARGET_SCENE));
+
+            fullscreen_triangle();
+
+            end_depth_blur();
+            glState_.activeTexture(GL_TEXTURE0 + UNIT_HALFRES);
+            glState_.bindTexture(GL_TEXTURE_2D, 0);
+            glState_.activeTexture(GL_TEXTURE0 + UNIT_BLURRED);
+            glState_.bindTexture(GL_TEXTURE_2D, 0);
+            glState_.activeTexture(GL_TEXTURE0);
+            glState_.bindTexture(GL_TEXTURE_2D, 0);
+            glState_.useProgram(0);
+            break;
+        }
+        }
+        stateChanges_[pass] = glState_.getChanges();
+        skippedStateChanges_[pass] = glState_.getSkipped();
+        frameGraph_.endPass();
+    }
+
+    // Make sure texture0 is active and no buffers are bound for text
+    // rendering afterwards
+    glState_.activeTexture(GL_TEXTURE0);
+    glState_.bindVertexArray(0);
+    glState_.bindBuffer(GL_ARRAY_BUFFER, 0);
+    glState_.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    uniformRing_.endFrame();
+    end_frame_timing();
+}
+
+
+/**
+  GL state changes made by a pass in the last frame, and those skipped as
+  they changed nothing.  Zero for passes culled or not in the frame graph.
+  **/
+int DrawEngine::getStateChanges(RenderPass pass) const {
+    return stateChanges_[pass];
+}
+
+int DrawEngine::getSkippedStateChanges(RenderPass pass) const {
+    return skippedStateChanges_[pass];
+}
+
+/**
+  Starts timing a frame on the CPU and the GPU.  GPU timings come back
+  some frames later, they are read here once ready rather than waited
+  for, and a frame goes untimed on the GPU when all the queries are still
+  in flight.
+  **/
+void DrawEngine::begin_frame_timing() {
+    while (frameQueriesPending_ > 0) {
+        GLuint query = frameQueries_[(frameQueryNext_ - frameQueriesPending_ + FRAME_QUERIES) % FRAME_QUERIES];
+        GLuint available = 0;
+        glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            break;
+        }
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+        gpuFrameTime_ += (elapsed / 1000000.0f - gpuFrameTime_) * FRAME_TIME_SMOOTHING;
+        frameQueriesPending_--;
+    }
+    if (frameQueriesPending_ < FRAME_QUERIES) {
+        glBeginQuery(GL_TIME_ELAPSED, frameQueries_[frameQueryNext_]);
+    }
+    cpuTimer_.start();
+}
+
+void DrawEngine::end_frame_timing() {
+    if (frameQueriesPending_ < FRAME_QUERIES) {
+        glEndQuery(GL_TIME_ELAPSED);
+        frameQueryNext_ = (frameQueryNext_ + 1) % FRAME_QUERIES;
+        frameQueriesPending_++;
+    }
+    cpuFrameTime_ += (cpuTimer_.nsecsElapsed() / 1000000.0f - cpuFrameTime_) * FRAME_TIME_SMOOTHING;
+}
+
+/**
+  Holds the frame budget when automatic quality is on.  The slower of the
+  GPU and the CPU decides: the quality is lowered a step when a frame has
+  been over budget for a while, and raised back towards the preset when
+  frames have had room to spare for much longer, so it doesn't flip back
+  and forth around the budget.
+  **/
+void DrawEngine::tune_quality() {
+    if (qualitySettleFrames_ > 0) {
+        qualitySettleFrames_--;
         return;
     }
+    if (dynamicResolution_) {
+        tune_render_scale();
+    }
+    if (!autoQuality_) {
+        return;
+    }
+    // With dynamic resolution, the quality only changes once the render
+    // scale can't go any further
+    bool shrinking = dynamicResolution_ && renderScale_ > MIN_RENDER_SCALE;
+    bool growing = dynamicResolution_ && renderScale_ < 1.0f;
+    float frameTime = MAX(gpuFrameTime_, cpuFrameTime_);
+    if (frameTime > frameBudget_ && !shrinking) {
+        overBudgetFrames_++;
+        underBudgetFrames_ = 0;
+    } else if (frameTime < frameBudget_ * QUALITY_UP_HEADROOM && !growing) {
+        underBudgetFrames_++;
+        overBudgetFrames_ = 0;
+    } else {
+        overBudgetFrames_ = underBudgetFrames_ = 0;
+    }
 
-    // Render the scene to framebuffer 0, tracking how much we need to blur later
-    framebuffer_objects_["fbo_0"]->bind();
-    perspective_camera(w, h);
-    // Ensure that GL_TEXTURE0 is active before rendering the scene!
-    glActiveTexture(GL_TEXTURE0);
-    render_scene(w, h);
-    framebuffer_objects_["fbo_0"]->release();
+    int level = qualityLevel_;
+    if (overBudgetFrames_ >= QUALITY_DOWN_FRAMES) {
+        level++;
+    } else if (underBudgetFrames_ >= QUALITY_UP_FRAMES && qualityLevel_ > 0) {
+        level--;
+    } else {
+        return;
+    }
+    overBudgetFrames_ = underBudgetFrames_ = 0;
+    QualitySettings quality = presetQuality_;
+    if (lower_quality(quality, level)) {
+        qualityLevel_ = level;
+        applyQuality(quality);
+        qualitySettleFrames_ = QUALITY_SETTLE_FRAMES;
+    }
+}
 
-    orthogonal_camera(w, h);
+/**
+  Scales the resolution the scene is drawn at to hold the GPU's frame time
+  within the budget.  The GPU's time goes roughly with the pixels drawn,
+  the square of the scale.  Nothing is reallocated, the frame graph's
+  dynamic targets are just drawn in part.
+  **/
+void DrawEngine::tune_render_scale() {
+    if (--renderScaleFrames_ > 0 || gpuFrameTime_ <= 0.0f) {
+        return;
+    }
+    renderScaleFrames_ = RENDER_SCALE_INTERVAL;
+    if (gpuFrameTime_ <= frameBudget_ && gpuFrameTime_ >= frameBudget_ * RENDER_SCALE_HEADROOM) {
+        return;
+    }
+    float target = renderScale_ * sqrt(frameBudget_ * RENDER_SCALE_AIM / gpuFrameTime_);
+    float step = target - renderScale_;
+    step = MIN(step, RENDER_SCALE_STEP);
+    step = MAX(step, -RENDER_SCALE_STEP);
+    float scale = renderScale_ + step;
+    scale = MIN(scale, 1.0f);
+    renderScale_ = MAX(scale, MIN_RENDER_SCALE);
+}
 
-    if (depthmapEnabled_) {
-        // If depth map enabled, just render the alpha (blend) values
-        shader_programs_["depthmap"]->bind();
-        glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["fbo_0"]->texture());
-        textured_quad(w, h, true);
-        glBindTexture(GL_TEXTURE_2D, 0);
-        shader_programs_["depthmap"]->release();
-    } else if (dofEnabled_) {
-        glViewport(0, 0, w, h);
-
-        // Third pass: Gaussian filtering along the X axis
-        framebuffer_objects_["fbo_1"]->bind();
-        shader_programs_["blur_x"]->bind();
-        shader_programs_["blur_x"]->setUniformValue("Width", w * blurFactor_);
-        glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["fbo_0"]->texture());
-        textured_quad(w, h, true);
-        shader_programs_["blur_x"]->release();
-        framebuffer_objects_["fbo_1"]->release();
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        // Fourth pass: Gaussian filtering along the Y axis
-        framebuffer_objects_["fbo_2"]->bind();
-        shader_programs_["blur_y"]->bind();
-        shader_programs_["blur_y"]->setUniformValue("Height", h * blurFactor_);
-        glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["fbo_1"]->texture());
-        textured_quad(w, h, true);
-        shader_programs_["blur_y"]->release();
-        framebuffer_objects_["fbo_2"]->release();
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        // Fifth pass: final compositing
-        glDrawBuffer(GL_BACK);
-        shader_programs_["lerp"]->bind();
-        shader_programs_["lerp"]->setUniformValue("Tex0", 0);
-        shader_programs_["lerp"]->setUniformValue("Tex1", 1);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["fbo_0"]->texture());
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["fbo_2"]->texture());
-
-        // Multitextured quad
-        glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
-        glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
-        glBegin(GL_QUADS);
-        glMultiTexCoord2f(GL_TEXTURE0, 0.0f, 1.0f);
-        glMultiTexCoord2f(GL_TEXTURE1, 0.0f, 1.0f);
-        glVertex2f(0.0f, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE0, 1.0f, 1.0f);
-        glMultiTexCoord2f(GL_TEXTURE1, 1.0f, 1.0f);
-        glVertex2f(w, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE0, 1.0f, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE1, 1.0f, 0.0f);
-        glVertex2f(w, h);
-        glMultiTexCoord2f(GL_TEXTURE0, 0.0f, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE1, 0.0f, 0.0f);
-        glVertex2f(0.0f, h);
-        glEnd();
-
-        glBindTexture(GL_TEXTURE_2D, 0);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, 0);
-        shader_programs_["lerp"]->release();
+/**
+  Turns dynamic resolution on or off, off draws at full resolution again.
+  **/
+void DrawEngine::setDynamicResolution(bool enabled) {
+    dynamicResolution_ = enabled;
+    renderScale_ = 1.0f;
+    renderScaleFrames_ = 0;
+}
 
+/**
+  Lowers quality settings by a number of steps, cheapest to give up
+  first: the reflection and refraction resolution down to a quarter, the
+  depth of field blur at a quarter resolution, the terrain's detail down
+  to depth 6, and last the depth of field itself.  Returns false when
+  the settings can't go that low.
+  **/
+bool DrawEngine::lower_quality(QualitySettings &quality, int steps) {
+    for (int i = 0; i < steps; i++) {
+        if (quality.reflectionScale > 0.25f || quality.refractionScale > 0.25f) {
+            float reflectionScale = quality.reflectionScale * 0.5f;
+            float refractionScale = quality.refractionScale * 0.5f;
+            quality.reflectionScale = MAX(reflectionScale, 0.25f);
+            quality.refractionScale = MAX(refractionScale, 0.25f);
+        } else if (quality.dofEnabled && !quality.dofPyramid) {
+            quality.dofPyramid = true;
+        } else if (quality.terrainDepth > 6) {
+            quality.terrainDepth--;
+        } else if (quality.dofEnabled) {
+            quality.dofEnabled = false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+  Turns automatic quality on or off.  Off goes back to the preset's
+  settings.
+  **/
+void DrawEngine::setAutoQuality(bool enabled) {
+    autoQuality_ = enabled;
+    overBudgetFrames_ = underBudgetFrames_ = 0;
+    if (!enabled && qualityLevel_ > 0) {
+        qualityLevel_ = 0;
+        applyQuality(presetQuality_);
+    }
+}
+
+
+/**
+  Works out whether the water shows this frame.  Its screen bounds come
+  from projecting the water quad now, whether it is hidden behind the
+  terrain from an occlusion query on the previous frame's water.  Leaves
+  the bounds, grown by WATER_SCISSOR_MARGIN, in waterBounds_ in normalized
+  device coordinates.
+  **/
+void DrawEngine::update_water_visibility(int w, int h) {
+    if (waterQueryPending_) {
+        // Don't wait for the GPU, keep the last answer until this is ready
+        GLuint available = 0, samples = 0;
+        glGetQueryObjectuiv(waterQuery_, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            glGetQueryObjectuiv(waterQuery_, GL_QUERY_RESULT, &samples);
+            waterOccluded_ = samples == 0;
+            waterQueryPending_ = false;
+        }
+    }
+
+    perspective_camera(w, h);
+    Matrix4x4 view = modelview_;
+    terrain_transform();
+    // Column-major, as the frustum code takes it
+    Matrix4x4 transform = (projection_ * modelview_).getTranspose();
+    const float *mvp = transform.data;
+    modelview_ = view;
+
+    float x0 = 1.0f, y0 = 1.0f, x1 = -1.0f, y1 = -1.0f;
+    bool behind = false;
+    for (int i = 0; i < 4; i++) {
+        float x = (i & 1) ? WATER_QUAD_SIZE : -WATER_QUAD_SIZE;
+        float y = (i & 2) ? WATER_QUAD_SIZE : -WATER_QUAD_SIZE;
+        float clip[4];
+        for (int row = 0; row < 4; row++) {
+            clip[row] = mvp[row] * x + mvp[4 + row] * y + mvp[8 + row] * SEA_LEVEL + mvp[12 + row];
+        }
+        if (clip[3] < camera_.near_) {
+            // The quad reaches behind the near plane, so its projection
+            // doesn't bound it.  Use the whole screen.
+            behind = true;
+            break;
+        }
+        float ndcX = clip[0] / clip[3], ndcY = clip[1] / clip[3];
+        x0 = MIN(x0, ndcX);
+        y0 = MIN(y0, ndcY);
+        x1 = MAX(x1, ndcX);
+        y1 = MAX(y1, ndcY);
+    }
+    if (behind) {
+        x0 = y0 = -1.0f;
+        x1 = y1 = 1.0f;
+    }
+    float marginX = 2.0f * WATER_SCISSOR_MARGIN / w, marginY = 2.0f * WATER_SCISSOR_MARGIN / h;
+    waterBounds_[0] = MAX(x0 - marginX, -1.0f);
+    waterBounds_[1] = MAX(y0 - marginY, -1.0f);
+    waterBounds_[2] = MIN(x1 + marginX, 1.0f);
+    waterBounds_[3] = MIN(y1 + marginY, 1.0f);
+
+    if (waterBounds_[0] >= waterBounds_[2] || waterBounds_[1] >= waterBounds_[3]) {
+        // The query says nothing about water that's off screen, don't let
+        // it hold the passes back once the water comes into view
+        waterVisibility_ = WATER_OFF_SCREEN;
+        waterOccluded_ = false;
+    } else if (waterOccluded_) {
+        waterVisibility_ = WATER_OCCLUDED;
     } else {
-        glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["fbo_0"]->texture());
-        textured_quad(w, h, true);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        waterVisibility_ = WATER_VISIBLE;
     }
+}
 
-    // Make sure texture0 is active for text rendering afterwards
-    glActiveTexture(GL_TEXTURE0);
+/**
+  Limits drawing into a target to the part the water can sample, the
+  water's screen bounds
+  **/
+void DrawEngine::begin_water_scissor(RenderTarget target) {
+    if (!waterCulling_) {
+        return;
+    }
+    int tw = frameGraph_.getViewWidth(target), th = frameGraph_.getViewHeight(target);
+    int x0 = (int)floor((waterBounds_[0] * 0.5f + 0.5f) * tw);
+    int y0 = (int)floor((waterBounds_[1] * 0.5f + 0.5f) * th);
+    int x1 = (int)ceil((waterBounds_[2] * 0.5f + 0.5f) * tw);
+    int y1 = (int)ceil((waterBounds_[3] * 0.5f + 0.5f) * th);
+    glScissor(x0, y0, x1 - x0, y1 - y0);
+    glState_.enable(GL_SCISSOR_TEST);
+}
+
+/**
+  Decides what the reflection or refraction pass draws this frame.  Phase
+  staggers the updates of the two.  Everything is redrawn when the history
+  is invalid or the camera has moved too far since any of it was drawn.
+  **/
+WaterUpdate DrawEngine::plan_water_update(const WaterHistory &history, int phase) {
+    if (!history.valid || waterUpdateMode_ == WATER_UPDATE_EVERY_FRAME) {
+        return WATER_DRAW_ALL;
+    }
+    Vector4 eye = camera_.getEye(), look = camera_.getLook();
+    float minCos = cos(WATER_REFRESH_ANGLE * PI / 180.0);
+    for (int rows = 0; rows < 2; rows++) {
+        if (eye.getDistance(history.eye[rows]) > WATER_REFRESH_DISTANCE ||
+            look.dot(history.look[rows]) < minCos) {
+            return WATER_DRAW_ALL;
+        }
+    }
+    if (waterUpdateMode_ == WATER_UPDATE_EVERY_N_FRAMES) {
+        return (frameCount_ + phase) % waterUpdateInterval_ == 0 ? WATER_DRAW_ALL : WATER_DRAW_NOTHING;
+    }
+    return (frameCount_ + phase) % 2 == 0 ? WATER_DRAW_EVEN_ROWS : WATER_DRAW_ODD_ROWS;
 }
 
+/**
+  Records the camera and the water's modelview-projection for the rows
+  drawn this frame.
+  **/
+void DrawEngine::commit_water_history(WaterHistory &history, WaterUpdate update, const float *mvp) {
+    for (int rows = 0; rows < 2; rows++) {
+        if (update == WATER_DRAW_ALL || (update == WATER_DRAW_EVEN_ROWS && rows == 0) ||
+            (update == WATER_DRAW_ODD_ROWS && rows == 1)) {
+            memcpy(history.mvp[rows], mvp, sizeof(history.mvp[rows]));
+            history.eye[rows] = camera_.getEye();
+            history.look[rows] = camera_.getLook();
+        }
+    }
+    if (update == WATER_DRAW_ALL) {
+        history.valid = true;
+    }
+}
+
+/**
+  Limits the following draws to the even or the odd rows of the target,
+  the fragment shaders discard the other rows (see set_transform).  Clears
+  are not affected.
+  **/
+void DrawEngine::begin_water_rows(WaterUpdate update) {
+    if (update == WATER_DRAW_EVEN_ROWS) {
+        waterRows_ = 1;
+    } else if (update == WATER_DRAW_ODD_ROWS) {
+        waterRows_ = 2;
+    }
+}
+
+void DrawEngine::end_water_rows() {
+    waterRows_ = 0;
+}
 
 /**
   Renders the reflections of the scene about the water level
 **/
 void DrawEngine::render_reflections() {
-    glEnable(GL_DEPTH_TEST);
+    glState_.enable(GL_DEPTH_TEST);
     glClear(GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_TEXTURE_CUBE_MAP);
 
-    glPushMatrix();
-    // 2.38 is a magic number connected to transformations to the terrain
-    glTranslatef(0.0f, -2.38f, 0.0f);
-    glScalef(1.0f, -1.0f, 1.0f);
-    glTranslatef(0.0f, 2.38f, 0.0f);
+    Matrix4x4 view = modelview_;
+    mirror_transform();
 
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textures_["cube_map_1"]);
-    glCallList(models_["skybox"].idx);
+    render_skybox();
 
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_FRONT);
+    glState_.enable(GL_CULL_FACE);
+    glState_.cullFace(GL_FRONT);
 
     // First, render the terrain with the terrain shader
-    shader_programs_["terrain"]->bind();
-    glActiveTexture(GL_TEXTURE0);
-    terrain_->updateTerrainShaderParameters(shader_programs_["terrain"]);
-    shader_programs_["terrain"]->setUniformValue("seaLevel", SEA_LEVEL);
-    shader_programs_["terrain"]->setUniformValue("isReflection", 1.0f);
-    shader_programs_["terrain"]->setUniformValue("focalDistance", camera_.getFocalDistance());
-    shader_programs_["terrain"]->setUniformValue("focalRange", camera_.getFocalRange());
+    glState_.useProgram(programs_[PROGRAM_TERRAIN]->programId());
+    const GLint *u = uniforms_[PROGRAM_TERRAIN];
+    glState_.activeTexture(GL_TEXTURE0);
+    terrain_->updateTerrainShaderParameters(programs_[PROGRAM_TERRAIN], terrainUniforms_);
+    // The clip plane takes the place of flattening the terrain at sea level
+    programs_[PROGRAM_TERRAIN]->setUniformValue(u[UNIFORM_IS_REFLECTION], waterClipPlanes_ ? 0.0f : 1.0f);
+
+    terrain_transform();
+    begin_water_clip(1.0f);
+    set_transform();
+    begin_fill_query(0);
+    render_terrain(TERRAIN_PASS_REFLECTION);
+    end_fill_query(0);
+    end_water_clip();
+    glState_.useProgram(0);
+
+    modelview_ = view;
+
+    glState_.disable(GL_DEPTH_TEST);
+    glState_.disable(GL_CULL_FACE);
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
 
-    glPushMatrix();
-    glTranslatef(0.0f, -28.0f, 0.0f);
-    glRotatef(270.0f, 1.0f, 0.0f, 0.0f);
-    glScalef(3.5f, 3.5f, 3.5f);
-    terrain_->render();
-    glPopMatrix();
-    shader_programs_["terrain"]->release();
+/**
+  Mirrors the scene about sea level
+  **/
+void DrawEngine::mirror_transform() {
+    // 2.38 is a magic number connected to transformations to the terrain
+    modelview_ = modelview_ * getTransMat(Vector4(0.0f, -2.38f, 0.0f, 0.0f)) *
+            getScaleMat(Vector4(1.0f, -1.0f, 1.0f, 0.0f)) * getTransMat(Vector4(0.0f, 2.38f, 0.0f, 0.0f));
+}
 
-    glPopMatrix();
+/**
+  Renders the reflection and the refraction into the two layers of one
+  target, traversing the skybox and the terrain once for both.  Clip
+  planes at sea level take the place of the vertex clamp of the separate
+  passes.
+  **/
+void DrawEngine::render_water_layers() {
+    glState_.enable(GL_DEPTH_TEST);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    // Layer 0 is seen mirrored about sea level, layer 1 straight on, both
+    // row-major like modelview_
+    float layerModelview[2][16];
+    Matrix4x4 view = modelview_;
+    mirror_transform();
+    memcpy(layerModelview[0], modelview_.data, sizeof(layerModelview[0]));
+    modelview_ = view;
+    memcpy(layerModelview[1], modelview_.data, sizeof(layerModelview[1]));
+
+    glState_.useProgram(programs_[PROGRAM_SKYBOX_LAYERED]->programId());
+    set_transform();
+    const GLint *u = uniforms_[PROGRAM_SKYBOX_LAYERED];
+    programs_[PROGRAM_SKYBOX_LAYERED]->setUniformValue(u[UNIFORM_SKYBOX], 0);
+    glUniformMatrix4fv(u[UNIFORM_LAYER_MODELVIEW], 2, GL_TRUE, layerModelview[0]);
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, cubeMap_);
+    skybox_cube();
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glState_.useProgram(0);
+
+    // The geometry shader flips the mirrored layer's winding back
+    glState_.enable(GL_CULL_FACE);
+    glState_.cullFace(GL_BACK);
+    glState_.enable(GL_CLIP_DISTANCE0);
+
+    mirror_transform();
+    terrain_transform();
+    memcpy(layerModelview[0], modelview_.data, sizeof(layerModelview[0]));
+    Matrix4x4 reflectionMvp = (projection_ * modelview_).getTranspose();
+    modelview_ = view;
+    terrain_transform();
+    memcpy(layerModelview[1], modelview_.data, sizeof(layerModelview[1]));
+    Matrix4x4 mvp = (projection_ * modelview_).getTranspose();
+
+    glState_.useProgram(programs_[PROGRAM_TERRAIN_LAYERED]->programId());
+    set_transform();
+    u = uniforms_[PROGRAM_TERRAIN_LAYERED];
+    terrain_->updateTerrainShaderParameters(programs_[PROGRAM_TERRAIN_LAYERED], terrainLayeredUniforms_);
+    glUniformMatrix4fv(u[UNIFORM_LAYER_MODELVIEW], 2, GL_TRUE, layerModelview[0]);
+    // Both layers count as the reflection's samples
+    begin_fill_query(0);
+    terrain_->renderWaterLayers(mvp.data, reflectionMvp.data, glState_);
+    end_fill_query(0);
+    glState_.useProgram(0);
+    modelview_ = view;
+
+    glState_.disable(GL_CLIP_DISTANCE0);
+    glState_.disable(GL_CULL_FACE);
+    glState_.disable(GL_DEPTH_TEST);
+}
+
+/**
+  Clips the terrain drawn next at sea level, keeping the side the given
+  sign points to: 1 above the water, -1 below.  Expects the terrain's
+  transform to be current, clip planes are given in object coordinates.
+  The plane goes to the terrain shader, which writes gl_ClipDistance for
+  it, with the next set_transform.
+  **/
+void DrawEngine::begin_water_clip(float side) {
+    if (!waterClipPlanes_) {
+        return;
+    }
+    clipPlane_[0] = 0.0f;
+    clipPlane_[1] = 0.0f;
+    clipPlane_[2] = side;
+    clipPlane_[3] = -side * SEA_LEVEL;
+    glState_.enable(GL_CLIP_DISTANCE0);
+}
+
+void DrawEngine::end_water_clip() {
+    glState_.disable(GL_CLIP_DISTANCE0);
+}
+
+/**
+  Counts the samples the terrain of a water pass draws, 0 for the
+  reflection and 1 for the refraction, to compare clipping the terrain
+  with flattening it at sea level.  Only one query per pass is kept in
+  flight, passes drawn while it is pending go uncounted.
+  **/
+void DrawEngine::begin_fill_query(int pass) {
+    if (!fillQueryPending_[pass]) {
+        glBeginQuery(GL_SAMPLES_PASSED, fillQueries_[pass]);
+    }
+}
 
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_CULL_FACE);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-    glDisable(GL_TEXTURE_CUBE_MAP);
+void DrawEngine::end_fill_query(int pass) {
+    if (!fillQueryPending_[pass]) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        fillQueryPending_[pass] = true;
+    }
+}
+
+/**
+  Picks up the results of the fill queries that are ready, without
+  waiting for the others.
+  **/
+void DrawEngine::read_fill_queries() {
+    for (int i = 0; i < 2; i++) {
+        if (!fillQueryPending_[i]) {
+            continue;
+        }
+        GLuint available = 0;
+        glGetQueryObjectuiv(fillQueries_[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            glGetQueryObjectuiv(fillQueries_[i], GL_QUERY_RESULT, &waterPassSamples_[i]);
+            fillQueryPending_[i] = false;
+        }
+    }
 }
 
 /**
   Render the refraction to a framebuffer
   **/
 void DrawEngine::render_refraction() {
-    glEnable(GL_DEPTH_TEST);
+    glState_.enable(GL_DEPTH_TEST);
     glClear(GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_TEXTURE_CUBE_MAP);
 
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textures_["cube_map_1"]);
-    glCallList(models_["skybox"].idx);
+    render_skybox();
 
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_BACK);
+    glState_.enable(GL_CULL_FACE);
+    glState_.cullFace(GL_BACK);
 
     // First, render the terrain with the terrain shader
-    shader_programs_["terrain"]->bind();
-    glActiveTexture(GL_TEXTURE0);
-    terrain_->updateTerrainShaderParameters(shader_programs_["terrain"]);
-    shader_programs_["terrain"]->setUniformValue("seaLevel", SEA_LEVEL);
-    shader_programs_["terrain"]->setUniformValue("isReflection", 2.0f);
-    shader_programs_["terrain"]->setUniformValue("focalDistance", camera_.getFocalDistance());
-    shader_programs_["terrain"]->setUniformValue("focalRange", camera_.getFocalRange());
-    glPushMatrix();
-    glTranslatef(0, -28.f, 0.f);
-    glRotatef(270, 1, 0, 0);
-    glScalef(3.5, 3.5, 3.5);
-    terrain_->render();
-    glPopMatrix();
-    shader_programs_["terrain"]->release();
-
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_CULL_FACE);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-    glDisable(GL_TEXTURE_CUBE_MAP);
+    glState_.useProgram(programs_[PROGRAM_TERRAIN]->programId());
+    const GLint *u = uniforms_[PROGRAM_TERRAIN];
+    glState_.activeTexture(GL_TEXTURE0);
+    terrain_->updateTerrainShaderParameters(programs_[PROGRAM_TERRAIN], terrainUniforms_);
+    programs_[PROGRAM_TERRAIN]->setUniformValue(u[UNIFORM_IS_REFLECTION], waterClipPlanes_ ? 0.0f : 2.0f);
+    Matrix4x4 view = modelview_;
+    terrain_transform();
+    begin_water_clip(-1.0f);
+    set_transform();
+    begin_fill_query(1);
+    render_terrain(TERRAIN_PASS_REFRACTION);
+    end_fill_query(1);
+    end_water_clip();
+    modelview_ = view;
+    glState_.useProgram(0);
+
+    glState_.disable(GL_DEPTH_TEST);
+    glState_.disable(GL_CULL_FACE);
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
 }
 
 
@@ -531,49 +1538,213 @@ void DrawEngine::render_refraction() {
 
 **/
 void DrawEngine::render_scene(int w, int h) {
-    glEnable(GL_DEPTH_TEST);
+    glState_.enable(GL_DEPTH_TEST);
     glClear(GL_DEPTH_BUFFER_BIT);
-    glActiveTexture(GL_TEXTURE0);
-    glEnable(GL_TEXTURE_CUBE_MAP);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textures_["cube_map_1"]);
-    glCallList(models_["skybox"].idx);
+    render_skybox();
 
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_BACK);
+    glState_.enable(GL_CULL_FACE);
+    glState_.cullFace(GL_BACK);
 
-    glPushMatrix();
+    Matrix4x4 view = modelview_;
 
     // First, render the terrain with the terrain shader
-    shader_programs_["terrain"]->bind();
-    glActiveTexture(GL_TEXTURE0);
-    terrain_->updateTerrainShaderParameters(shader_programs_["terrain"]);
-    shader_programs_["terrain"]->setUniformValue("focalDistance", camera_.getFocalDistance());
-    shader_programs_["terrain"]->setUniformValue("focalRange", camera_.getFocalRange());
-    shader_programs_["terrain"]->setUniformValue("isReflection", 0.0f);
-
-    glTranslatef(0, -28.f, 0.f);
-    glRotatef(270, 1, 0, 0);
-    glScalef(3.5, 3.5, 3.5);
-    terrain_->render();
-    shader_programs_["terrain"]->release();
-
-    // Then render the water with the water shader
-    shader_programs_["water"]->bind();
-    shader_programs_["water"]->setUniformValue("reflection", 0);
-    shader_programs_["water"]->setUniformValue("bumpMap", 7);
-    shader_programs_["water"]->setUniformValue("refraction", 8);
-    shader_programs_["water"]->setUniformValue("focalDistance", camera_.getFocalDistance());
-    shader_programs_["water"]->setUniformValue("focalRange", camera_.getFocalRange());
-    // These casts to float are necessary, c'mon GLSL
-    shader_programs_["water"]->setUniformValue("screenWidth", (float) w);
-    shader_programs_["water"]->setUniformValue("screenHeight", (float) h);
-    shader_programs_["water"]->setUniformValue("offsetX", offsetX_);
-    shader_programs_["water"]->setUniformValue("offsetY", offsetY_);
+    glState_.useProgram(programs_[PROGRAM_TERRAIN]->programId());
+    const GLint *u = uniforms_[PROGRAM_TERRAIN];
+    glState_.activeTexture(GL_TEXTURE0);
+    terrain_->updateTerrainShaderParameters(programs_[PROGRAM_TERRAIN], terrainUniforms_);
+    programs_[PROGRAM_TERRAIN]->setUniformValue(u[UNIFORM_IS_REFLECTION], 0.0f);
+
+    terrain_transform();
+    set_transform();
+    render_terrain(TERRAIN_PASS_SCENE);
+    glState_.useProgram(0);
+
+    // Then render the water, unless it has a pass of its own to refract or
+    // reflect the scene drawn so far
+    if (!copies_scene()) {
+        render_water_surface();
+    }
 
-    render_water();
-    shader_programs_["water"]->release();
+    modelview_ = view;
+
+    glState_.disable(GL_CULL_FACE);
+    glState_.disable(GL_DEPTH_TEST);
+    glState_.activeTexture(GL_TEXTURE0);
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+/**
+  Draws the water over the opaque scene already in the target, depth
+  tested against it, refracting the copy PASS_SCENE_COPY made of it.
+  **/
+void DrawEngine::render_water_pass() {
+    glState_.enable(GL_DEPTH_TEST);
+    glState_.enable(GL_CULL_FACE);
+    glState_.cullFace(GL_BACK);
+
+    Matrix4x4 view = modelview_;
+    terrain_transform();
+    render_water_surface();
+    modelview_ = view;
+
+    glState_.disable(GL_CULL_FACE);
+    glState_.disable(GL_DEPTH_TEST);
+    glState_.activeTexture(GL_TEXTURE0);
+}
 
-    glPopMatrix();
+/**
+  Whether the water is drawn in a pass of its own, over a copy of the
+  opaque scene it reflects or refracts.
+  **/
+bool DrawEngine::copies_scene() const {
+    return refractionFromScene_ || reflectionMode_ == REFLECTION_SCREEN_SPACE;
+}
+
+/**
+  Builds the depth pyramid from the copy of the scene's depth, one level at
+  a time, each from the level below it.
+  **/
+void DrawEngine::build_depth_pyramid() {
+    GLuint pyramid = frameGraph_.getTexture(TARGET_DEPTH_PYRAMID);
+    int levels = frameGraph_.getTargetLevels(TARGET_DEPTH_PYRAMID);
+    glState_.useProgram(programs_[PROGRAM_HIZ]->programId());
+    const GLint *u = uniforms_[PROGRAM_HIZ];
+    programs_[PROGRAM_HIZ]->setUniformValue(u[UNIFORM_SOURCE], 0);
+    glState_.activeTexture(GL_TEXTURE0);
+    for (int level = 0; level < levels; level++) {
+        frameGraph_.drawToLevel(TARGET_DEPTH_PYRAMID, level);
+        if (level == 0) {
+            glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(TARGET_SCENE_COPY_DEPTH));
+            programs_[PROGRAM_HIZ]->setUniformValue(u[UNIFORM_REDUCE], 0.0f);
+        } else {
+            // Only the level below is visible while this one is drawn
+            glState_.bindTexture(GL_TEXTURE_2D, pyramid);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+            programs_[PROGRAM_HIZ]->setUniformValue(u[UNIFORM_REDUCE], 1.0f);
+            glUniform2i(u[UNIFORM_SOURCE_SIZE],
+                        frameGraph_.getViewWidth(TARGET_DEPTH_PYRAMID, level - 1),
+                        frameGraph_.getViewHeight(TARGET_DEPTH_PYRAMID, level - 1));
+        }
+        fullscreen_triangle();
+    }
+    glState_.bindTexture(GL_TEXTURE_2D, pyramid);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    glState_.useProgram(0);
+}
+
+/**
+  Renders the water's reflection by marching reflected rays through the
+  copy of the opaque scene, into the same target the mirrored reflection
+  pass would draw, so the water samples it the same way.
+  **/
+void DrawEngine::render_screen_space_reflections() {
+    // The part of the target off the water is never drawn, but the bump
+    // map shifts lookups a little past the water's edge
+    if (reflectionUpdate_ == WATER_DRAW_ALL) {
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+    glState_.useProgram(programs_[PROGRAM_SSR]->programId());
+    const GLint *u = uniforms_[PROGRAM_SSR];
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_SCENE], UNIT_SOURCE);
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_DEPTH_PYRAMID], UNIT_DEPTH_PYRAMID);
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_SKYBOX], UNIT_REFLECTED_SKYBOX);
+    glUniformMatrix4fv(u[UNIFORM_SKYBOX_VIEW], 1, GL_TRUE, modelview_.data);
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_PYRAMID_LEVELS],
+                                            frameGraph_.getTargetLevels(TARGET_DEPTH_PYRAMID));
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_VIEW_SIZE], (float) frameGraph_.getViewWidth(TARGET_DEPTH_PYRAMID),
+                                             (float) frameGraph_.getViewHeight(TARGET_DEPTH_PYRAMID));
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_MAX_STEPS], SSR_MAX_STEPS);
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_MAX_DISTANCE], SSR_MAX_DISTANCE);
+    programs_[PROGRAM_SSR]->setUniformValue(u[UNIFORM_THICKNESS], SSR_THICKNESS);
+
+    glState_.activeTexture(GL_TEXTURE0);
+    glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(TARGET_SCENE_COPY));
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_DEPTH_PYRAMID);
+    glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(TARGET_DEPTH_PYRAMID));
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_REFLECTED_SKYBOX);
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, cubeMap_);
+
+    Matrix4x4 view = modelview_;
+    terrain_transform();
+    set_transform();
+    water_quad();
+    modelview_ = view;
+
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_DEPTH_PYRAMID);
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    glState_.activeTexture(GL_TEXTURE0);
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    glState_.useProgram(0);
+}
+
+/**
+  Renders the water with the water shader, in the terrain's transform.
+  **/
+void DrawEngine::render_water_surface() {
+    bool layered = layered_water();
+    RenderTarget reflection = layered ? TARGET_WATER_LAYERS : TARGET_REFLECTION;
+    RenderTarget refraction = layered ? TARGET_WATER_LAYERS
+                                      : refractionFromScene_ ? TARGET_SCENE_COPY : TARGET_REFRACTION;
+    bool interleaved = waterUpdateMode_ == WATER_UPDATE_INTERLEAVED;
+    ShaderProgramId program = layered ? PROGRAM_WATER_LAYERED : PROGRAM_WATER;
+    QGLShaderProgram *water = programs_[program];
+    const GLint *u = uniforms_[program];
+    glState_.useProgram(water->programId());
+    set_transform();
+    if (layered) {
+        water->setUniformValue(u[UNIFORM_WATER_LAYERS], UNIT_SOURCE);
+    } else {
+        water->setUniformValue(u[UNIFORM_REFLECTION], UNIT_SOURCE);
+    }
+    water->setUniformValue(u[UNIFORM_BUMP_MAP], UNIT_BUMP_MAP);
+    water->setUniformValue(u[UNIFORM_REFRACTION], UNIT_REFRACTION);
+    water->setUniformValue(u[UNIFORM_SCENE_DEPTH], UNIT_REFRACTION_DEPTH);
+    // These casts to float are necessary, c'mon GLSL
+    water->setUniformValue(u[UNIFORM_SCENE_DEPTH_TEXEL], 1.0f / frameGraph_.getTargetWidth(TARGET_SCENE_COPY_DEPTH),
+                                              1.0f / frameGraph_.getTargetHeight(TARGET_SCENE_COPY_DEPTH));
+    water->setUniformValue(u[UNIFORM_REFLECTION_SIZE], (float) frameGraph_.getTargetWidth(reflection),
+                                               (float) frameGraph_.getTargetHeight(reflection));
+    water->setUniformValue(u[UNIFORM_REFRACTION_SIZE], (float) frameGraph_.getTargetWidth(refraction),
+                                               (float) frameGraph_.getTargetHeight(refraction));
+    // Only part of them is drawn while the window is resized, and of a
+    // copy of the scene at a lower render scale
+    water->setUniformValue(u[UNIFORM_REFLECTION_VIEW], frameGraph_.getViewScaleX(reflection),
+                           frameGraph_.getViewScaleY(reflection));
+    water->setUniformValue(u[UNIFORM_REFRACTION_VIEW], frameGraph_.getViewScaleX(refraction),
+                           frameGraph_.getViewScaleY(refraction));
+    // A copy of the scene is always from this frame
+    water->setUniformValue(u[UNIFORM_REFLECTION_INTERLEAVED], interleaved ? 1.0f : 0.0f);
+    water->setUniformValue(u[UNIFORM_REFRACTION_INTERLEAVED], interleaved && !refractionFromScene_ ? 1.0f : 0.0f);
+    water->setUniformValue(u[UNIFORM_REFRACTION_FADE], refractionFromScene_ ? REFRACTION_DEPTH_FADE : 0.0f);
+
+    // The reflection and refraction drawn this frame line up with the water
+    // as it is now, older rows are reprojected with the matrices they had
+    Matrix4x4 mvp = (projection_ * modelview_).getTranspose();
+    commit_water_history(reflectionHistory_, reflectionUpdate_, mvp.data);
+    commit_water_history(refractionHistory_, refractionUpdate_, mvp.data);
+    glUniformMatrix4fv(u[UNIFORM_REFLECTION_MATRIX], 2, GL_FALSE,
+                       reflectionHistory_.mvp[0]);
+    glUniformMatrix4fv(u[UNIFORM_REFRACTION_MATRIX], 2, GL_FALSE,
+                       refractionHistory_.mvp[0]);
+    water->setUniformValue(u[UNIFORM_OFFSET_X], offsetX_);
+    water->setUniformValue(u[UNIFORM_OFFSET_Y], offsetY_);
+
+    // Count the water's visible samples to decide about the next frame's
+    // water passes.  Only one query is kept in flight.
+    bool query = waterCulling_ && !waterQueryPending_ && waterVisibility_ != WATER_OFF_SCREEN;
+    if (query) {
+        glBeginQuery(GL_SAMPLES_PASSED, waterQuery_);
+    }
+    render_water();
+    if (query) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        waterQueryPending_ = true;
+    }
+    glState_.useProgram(0);
 
     // Update the water animation offset
     offsetX_ = offsetX_ + 0.001f;
@@ -583,92 +1754,182 @@ void DrawEngine::render_scene(int w, int h) {
         offsetX_ = 0.0f;
         offsetY_ = 0.0f;
     }
+}
 
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_DEPTH_TEST);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-    glDisable(GL_TEXTURE_CUBE_MAP);
+/**
+  Draws the water quad at sea level.
+  **/
+void DrawEngine::water_quad() {
+    glState_.bindVertexArray(waterVertexArray_);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 }
 
 /**
   Renders the water as a large quad.
   **/
 void DrawEngine::render_water() {
-    // Bind the reflection to id 0
-    glActiveTexture(GL_TEXTURE0);
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["reflection"]->texture());
-
-    // Bind the bump map to id 1
-    glActiveTexture(GL_TEXTURE7);
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, bumpMap_);
-
-    // Bind the refraction to id 2
-    glActiveTexture(GL_TEXTURE8);
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, framebuffer_objects_["refraction"]->texture());
-
-    // Draw the water quad
-    glBegin(GL_QUADS);
-        glMultiTexCoord2f(GL_TEXTURE0, 0.0f, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE7, 0.0f, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE8, 0.0f, 0.0f);
-        glNormal3f(0, 0, 1);
-        glVertex3f(-WATER_QUAD_SIZE, -WATER_QUAD_SIZE, SEA_LEVEL);
-
-        glMultiTexCoord2f(GL_TEXTURE0, 1.0f, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE7, 1.0f, 0.0f);
-        glMultiTexCoord2f(GL_TEXTURE8, 1.0f, 0.0f);
-        glNormal3f(0, 0, 1);
-        glVertex3f(WATER_QUAD_SIZE, -WATER_QUAD_SIZE, SEA_LEVEL);
-
-        glMultiTexCoord2f(GL_TEXTURE0, 1.0f, 1.0f);
-        glMultiTexCoord2f(GL_TEXTURE7, 1.0f, 1.0f);
-        glMultiTexCoord2f(GL_TEXTURE8, 1.0f, 1.0f);
-        glNormal3f(0, 0, 1);
-        glVertex3f(WATER_QUAD_SIZE, WATER_QUAD_SIZE, SEA_LEVEL);
-
-        glMultiTexCoord2f(GL_TEXTURE0, 0.0f, 1.0f);
-        glMultiTexCoord2f(GL_TEXTURE7, 0.0f, 1.0f);
-        glMultiTexCoord2f(GL_TEXTURE8, 0.0f, 1.0f);
-        glNormal3f(0, 0, 1);
-        glVertex3f(-WATER_QUAD_SIZE, WATER_QUAD_SIZE, SEA_LEVEL);
-    glEnd();
-
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glDisable(GL_TEXTURE_2D);
-    glActiveTexture(GL_TEXTURE7);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glDisable(GL_TEXTURE_2D);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    // Bind the reflection, or both layers when they share an array.
+    // The water shader samples them, so fixed function texturing stays off.
+    glState_.activeTexture(GL_TEXTURE0);
+    if (layered_water()) {
+        glState_.bindTexture(GL_TEXTURE_2D_ARRAY, frameGraph_.getTexture(TARGET_WATER_LAYERS));
+    } else {
+        glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(TARGET_REFLECTION));
+    }
+
+    // Nothing else is bound to the bump map's unit, so it is left bound
+    // afterwards
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_BUMP_MAP);
+    glState_.bindTexture(GL_TEXTURE_2D, bumpMap_);
+
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_REFRACTION);
+    if (!layered_water()) {
+        glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(refractionFromScene_ ? TARGET_SCENE_COPY : TARGET_REFRACTION));
+    }
+
+    // The depth of the scene copy, for the refraction's fade
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_REFRACTION_DEPTH);
+    glState_.bindTexture(GL_TEXTURE_2D, refractionFromScene_ ? frameGraph_.getTexture(TARGET_SCENE_COPY_DEPTH) : 0);
+
+    water_quad();
+
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_REFRACTION);
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    glState_.activeTexture(GL_TEXTURE0);
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    glState_.bindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+/**
+  Multiplies the modelview matrix by the terrain's model transform.  The
+  water is drawn in the same space.
+  **/
+void DrawEngine::terrain_transform() {
+    modelview_ = modelview_ * getTransMat(Vector4(0.0f, -28.0f, 0.0f, 0.0f)) *
+            getRotXMat(270.0f * PI / 180.0f) * getScaleMat(Vector4(3.5f, 3.5f, 3.5f, 0.0f));
+}
+
+/**
+  Writes the PassUniforms block the following draws use: the modelview
+  matrix with the normal matrix worked out from it, the clip plane of
+  begin_water_clip and the rows of the target begin_water_rows limits
+  drawing to.  Called whenever a pass changes any of them.
+  **/
+void DrawEngine::set_transform() {
+    PassUniforms block;
+    memcpy(block.modelview, modelview_.data, sizeof(block.modelview));
+    // The inverse transpose of the upper 3x3
+    Matrix4x4 inverse = modelview_.getInverse();
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            block.normalMatrix[row][col] = inverse.data[col*4 + row];
+        }
+        block.normalMatrix[row][3] = 0.0f;
+    }
+    memcpy(block.clipPlane, clipPlane_, sizeof(block.clipPlane));
+    block.waterRows = waterRows_;
+    block.pad[0] = block.pad[1] = block.pad[2] = 0;
+    uniformRing_.bind(UNIFORM_BLOCK_PASS, &block, sizeof(block));
+}
+
+/**
+  Writes the FrameUniforms block, the values every pass of a frame shares.
+  The projection is the one perspective_camera sets up for the frame.
+  **/
+void DrawEngine::write_frame_uniforms(int w, int h) {
+    FrameUniforms block;
+    Matrix4x4 projection = camera_.getProjectionMatrix(w / static_cast<float>(h));
+    memcpy(block.projection, projection.data, sizeof(block.projection));
+    block.nearPlane = camera_.near_;
+    block.farPlane = camera_.far_;
+    block.focalDistance = camera_.getFocalDistance();
+    block.focalRange = camera_.getFocalRange();
+    block.seaLevel = SEA_LEVEL;
+    // The size of the frame drawn, not of the reflection and refraction,
+    // which are sampled in normalized coordinates
+    block.screenWidth = frameGraph_.getFrameWidth();
+    block.screenHeight = frameGraph_.getFrameHeight();
+    block.pad = 0.0f;
+    uniformRing_.bind(UNIFORM_BLOCK_FRAME, &block, sizeof(block));
 }
 
 /**
-  Draws a textured quad. The texture most be bound and unbound
-  before and after calling this method - this method assumes that the texture
-  has been bound before hand.
+  Draws the terrain with the program in use and the current transform,
+  culling its chunks against the view.
+  **/
+void DrawEngine::render_terrain(TerrainPass pass) {
+    // Column-major, as the frustum code takes it
+    Matrix4x4 mvp = (projection_ * modelview_).getTranspose();
+    terrain_->render(pass, mvp.data, glState_);
+}
 
-  @param w: the width of the quad to draw
-  @param h: the height of the quad to draw
-  @param flip: flip the texture vertically
+/**
+  Draws the skybox cube map around the current transform's origin.
+  **/
+void DrawEngine::render_skybox() {
+    glState_.useProgram(programs_[PROGRAM_SKYBOX]->programId());
+    set_transform();
+    programs_[PROGRAM_SKYBOX]->setUniformValue(uniforms_[PROGRAM_SKYBOX][UNIFORM_SKYBOX], 0);
+    glState_.activeTexture(GL_TEXTURE0);
+    glState_.bindTexture(GL_TEXTURE_CUBE_MAP, cubeMap_);
+    skybox_cube();
+}
 
-**/
-void DrawEngine::textured_quad(int w, int h, bool flip) {
-    glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE);
-    glTexParameterf(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE);
-    glBegin(GL_QUADS);
-    glTexCoord2f(0.0f, flip ? 1.0f : 0.0f);
-    glVertex2f(0.0f, 0.0f);
-    glTexCoord2f(1.0f, flip ? 1.0f : 0.0f);
-    glVertex2f(w, 0.0f);
-    glTexCoord2f(1.0f, flip ? 0.0f : 1.0f);
-    glVertex2f(w, h);
-    glTexCoord2f(0.0f, flip ? 0.0f : 1.0f);
-    glVertex2f(0.0f, h);
-    glEnd();
+/**
+  Draws the skybox's triangles with the program in use.
+  **/
+void DrawEngine::skybox_cube() {
+    glState_.bindVertexArray(skyboxVertexArray_);
+    glDrawElements(GL_TRIANGLES, 6*6, GL_UNSIGNED_BYTE, 0);
+}
+
+/**
+  Tells a post processing shader how far into a target its lookups may
+  go, the center of the last texel drawn, so linear filtering doesn't
+  blend in texels outside the part drawn.
+  **/
+void DrawEngine::set_view_max(ShaderProgramId id, RenderTarget target) {
+    float tw = frameGraph_.getTargetWidth(target), th = frameGraph_.getTargetHeight(target);
+    programs_[id]->setUniformValue(uniforms_[id][UNIFORM_VIEW_MAX], (frameGraph_.getViewWidth(target) - 0.5f) / tw,
+                                   (frameGraph_.getViewHeight(target) - 0.5f) / th);
+}
+
+/**
+  Sets up a post processing shader to work out the blur of the scene from
+  its depth, which is bound to UNIT_SCENE_DEPTH until end_depth_blur.
+  Levels the blur was already stored in, fromDepth false, are read as
+  they are.
+  **/
+void DrawEngine::set_depth_blur(ShaderProgramId id, bool fromDepth) {
+    QGLShaderProgram *program = programs_[id];
+    const GLint *u = uniforms_[id];
+    program->setUniformValue(u[UNIFORM_SCENE_DEPTH], UNIT_SCENE_DEPTH);
+    program->setUniformValue(u[UNIFORM_DEPTH_BLUR], fromDepth ? 1.0f : 0.0f);
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_SCENE_DEPTH);
+    glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(TARGET_SCENE_DEPTH));
+    glState_.activeTexture(GL_TEXTURE0);
+}
+
+/**
+  Unbinds the depth set_depth_blur bound, so it isn't sampled while the
+  next frame's scene pass draws into it.
+  **/
+void DrawEngine::end_depth_blur() {
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_SCENE_DEPTH);
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    glState_.activeTexture(GL_TEXTURE0);
+}
+
+/**
+  Draws one triangle covering the viewport, for shaders that make it from
+  gl_VertexID (see shaders/post.vert), with the empty vertex array object
+  bound so no attribute array is read.
+  **/
+void DrawEngine::fullscreen_triangle() {
+    glState_.bindVertexArray(emptyVertexArray_);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glState_.bindVertexArray(0);
 }
 
 /**
@@ -682,46 +1943,368 @@ void DrawEngine::textured_quad(int w, int h, bool flip) {
 void DrawEngine::perspective_camera(int w, int h) {
     float ratio = w / static_cast<float>(h);
 
-    // Set up projection matrix
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(camera_.fovy_, ratio, camera_.near_, camera_.far_);
-
-    // Set up modelview matrix
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    camera_.multMatrix();
-
+    projection_ = camera_.getProjectionMatrix(ratio);
+    modelview_ = camera_.getViewMatrix();
 }
 
 /**
-  Called to switch to an orthogonal OpenGL camera.
-  Useful for rending a textured quad across the whole screen.
+  Called when the viewport has been resized.  The frame graph's render
+  targets are reallocated by draw_frame once the size settles.
 
   @param w the viewport width
   @param h the viewport height
 
 **/
-void DrawEngine::orthogonal_camera(int w, int h) {
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(0,static_cast<float>(w),static_cast<float>(h),0.f,-1.f,1.f);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+void DrawEngine::resize_frame(int w, int h) {
+    glViewport(0,0,w,h);
 }
 
 /**
-  Called when the viewport has been resized. Needs to
-  resize the camera perspective and reallocate the framebuffer
-  sizes.
+  A window size rounded up to the size of render targets allocated for it
+  **/
+int DrawEngine::resize_bucket(int size) {
+    return (size + RESIZE_BUCKET - 1) / RESIZE_BUCKET * RESIZE_BUCKET;
+}
 
-  @param w the viewport width
-  @param h the viewport height
+/**
+  Sets the resolution of the reflection pass relative to the window,
+  1 for full resolution, 0.5 for half and so on.
+  **/
+void DrawEngine::setReflectionScale(float scale) {
+    reflectionScale_ = scale;
+    frameGraphDirty_ = true;
+}
 
-**/
-void DrawEngine::resize_frame(int w, int h) {
-    glViewport(0,0,w,h);
-    realloc_framebuffers(w,h);
+/**
+  Sets the resolution of the refraction pass relative to the window.
+  **/
+void DrawEngine::setRefractionScale(float scale) {
+    refractionScale_ = scale;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Sets how often the reflection and refraction are redrawn
+  **/
+void DrawEngine::setWaterUpdateMode(WaterUpdateMode mode) {
+    waterUpdateMode_ = mode;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Chooses between mirroring the scene about sea level and marching rays
+  through the opaque scene for the water's reflection.
+  **/
+void DrawEngine::setReflectionMode(ReflectionMode mode) {
+    reflectionMode_ = mode;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Chooses between refracting a copy of the opaque scene, and rendering the
+  scene below sea level in a refraction pass of its own.
+  **/
+void DrawEngine::setRefractionFromScene(bool fromScene) {
+    refractionFromScene_ = fromScene;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Chooses between blurring the scene at full resolution for the depth of
+  field and blurring a quarter resolution copy, composited by blur amount
+  with a half resolution one.
+  **/
+void DrawEngine::setDofPyramid(bool pyramid) {
+    dofPyramid_ = pyramid;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Changes the internal format a render target is allocated with, from the
+  next frame on.
+  **/
+void DrawEngine::setTargetFormat(RenderTarget target, GLenum format) {
+    targetFormats_[target] = format;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Chooses between blurring for the depth of field in a compute shader and
+  in two fragment shader passes.  The compute shader is only used where
+  the context supports it, and while TARGET_BLUR_Y has a format it can
+  write (see is_image_format).
+  **/
+void DrawEngine::setComputeBlur(bool compute) {
+    computeBlur_ = compute;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Whether the depth of field is blurred in the compute shader: where the
+  context has them, and its target can be written as an image
+  **/
+bool DrawEngine::compute_blur() const {
+    return computeBlur_ && computeBlurProgram_ && is_image_format(targetFormats_[TARGET_BLUR_Y]);
+}
+
+/**
+  Compiles and links a program of a single compute shader, printing the
+  log and returning 0 when it fails.
+  **/
+GLuint DrawEngine::load_compute_shader(const QString &path) {
+    QByteArray source = shader_source(path);
+    const char *text = source.constData();
+
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &text, NULL);
+    glCompileShader(shader);
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader); // freed along with the program
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        cout << "\t  " << path.toStdString() << " failed: " << log << endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+/**
+  Blurs the scene, or its quarter resolution level, for the depth of field
+  in both directions with one compute dispatch.  The radius follows the
+  blur size, in texels of the level blurred, and the Gaussian weights and
+  blur thresholds of the taps are worked out here for it.
+  **/
+void DrawEngine::render_compute_blur(int w) {
+    RenderTarget source = dofPyramid_ ? TARGET_DOF_QUARTER : TARGET_SCENE;
+    int width = frameGraph_.getViewWidth(TARGET_BLUR_Y), height = frameGraph_.getViewHeight(TARGET_BLUR_Y);
+    int radius = (int)ceil(BLUR_EXTENT / blurFactor_ * frameGraph_.getViewWidth(source) / w);
+    radius = MIN(radius, quality_.blurRadius);
+    radius = MAX(radius, 1);
+
+    // Farther taps need more blur to count, as in blurx.frag
+    float kernel[2 * (COMPUTE_BLUR_MAX_RADIUS + 1)];
+    float sigma = 0.5f * radius;
+    for (int i = 0; i <= radius; i++) {
+        kernel[2 * i] = exp(-(i * i) / (2.0f * sigma * sigma));
+        kernel[2 * i + 1] = i == 0 ? -0.01f : 0.9f * i / radius;
+    }
+
+    glState_.useProgram(computeBlurProgram_);
+    glUniform1i(computeBlurUniforms_[UNIFORM_SOURCE], UNIT_SOURCE);
+    glUniform1i(computeBlurUniforms_[UNIFORM_RESULT], 0);
+    glUniform1i(computeBlurUniforms_[UNIFORM_RADIUS], radius);
+    glUniform2i(computeBlurUniforms_[UNIFORM_VIEW_SIZE], width, height);
+    glUniform2fv(computeBlurUniforms_[UNIFORM_KERNEL], radius + 1, kernel);
+    glUniform1i(computeBlurUniforms_[UNIFORM_SCENE_DEPTH], UNIT_SCENE_DEPTH);
+    glUniform1i(computeBlurUniforms_[UNIFORM_DEPTH_BLUR], source == TARGET_SCENE);
+    glState_.activeTexture(GL_TEXTURE0 + UNIT_SCENE_DEPTH);
+    glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(TARGET_SCENE_DEPTH));
+    glState_.activeTexture(GL_TEXTURE0);
+    glState_.bindTexture(GL_TEXTURE_2D, frameGraph_.getTexture(source));
+    glBindImageTexture(0, frameGraph_.getTexture(TARGET_BLUR_Y), 0, GL_FALSE, 0, GL_WRITE_ONLY,
+                       targetFormats_[TARGET_BLUR_Y]);
+    glDispatchCompute((width + COMPUTE_BLUR_TILE - 1) / COMPUTE_BLUR_TILE,
+                      (height + COMPUTE_BLUR_TILE - 1) / COMPUTE_BLUR_TILE, 1);
+    // The composite samples the result
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    glState_.bindTexture(GL_TEXTURE_2D, 0);
+    end_depth_blur();
+    glState_.useProgram(0);
+}
+
+/**
+  Chooses between one layered pass and two separate passes for the
+  reflection and refraction.
+  **/
+void DrawEngine::setLayeredWaterPasses(bool layered) {
+    layeredWater_ = layered;
+    frameGraphDirty_ = true;
+}
+
+/**
+  Whether this frame draws the reflection and refraction in one layered
+  pass.  Only when both are rendered from the scene geometry, and at the
+  same resolution since they share one texture array.
+  **/
+bool DrawEngine::layered_water() const {
+    return layeredWater_ && reflectionMode_ == REFLECTION_MIRRORED && !refractionFromScene_ &&
+           reflectionScale_ == refractionScale_;
+}
+
+/**
+  Reads the quality preset to start with from an INI file and applies it.
+  The file's [general] group names the preset and the skybox, and whether
+  the quality is lowered and the scene's resolution scaled automatically
+  to hold a frame budget in ms.  A
+  group for each preset can override its settings:
+
+    [general]
+    preset=medium
+    skybox=island
+    autoQuality=true
+    frameBudget=16.6
+    dynamicResolution=true
+
+    [medium]
+    terrainDepth=7
+    reflectionMode=screenspace
+
+  The file is read again whenever the preset changes, so edits to it show
+  without a restart.
+  **/
+void DrawEngine::loadQualitySettings(const QString &path) {
+    qualityPath_ = path;
+    QSettings settings(qualityPath_, QSettings::IniFormat);
+    QString preset = settings.value("general/preset").toString();
+    autoQuality_ = settings.value("general/autoQuality", autoQuality_).toBool();
+    frameBudget_ = settings.value("general/frameBudget", frameBudget_).toFloat();
+    dynamicResolution_ = settings.value("general/dynamicResolution", dynamicResolution_).toBool();
+    setQualityPreset((QualityPreset)name_index(preset, QUALITY_PRESET_NAMES, QUALITY_PRESET_COUNT, QUALITY_HIGH));
+}
+
+/**
+  Switches to another quality preset, as read from the quality settings
+  file now.
+  **/
+void DrawEngine::setQualityPreset(QualityPreset preset) {
+    read_quality(preset, presetQuality_);
+    qualityPreset_ = preset;
+    qualityLevel_ = 0;
+    overBudgetFrames_ = underBudgetFrames_ = 0;
+    applyQuality(presetQuality_);
+}
+
+QString DrawEngine::getQualityPresetName() const {
+    return QUALITY_PRESET_NAMES[qualityPreset_];
+}
+
+/**
+  Fills in the settings of a preset: its built-in values, overridden by
+  its group of the quality settings file.  The custom preset starts from
+  the high one.
+  **/
+void DrawEngine::read_quality(QualityPreset preset, QualitySettings &quality) {
+    quality.skybox = SKYBOX_ISLAND;
+    quality.skyboxSize = 2048;
+    quality.terrainDepth = 8;
+    quality.dofEnabled = true;
+    quality.dofPyramid = true;
+    quality.computeBlur = true;
+    quality.blurRadius = COMPUTE_BLUR_MAX_RADIUS;
+    quality.reflectionMode = REFLECTION_MIRRORED;
+    quality.reflectionScale = 1.0f;
+    quality.refractionScale = 1.0f;
+    quality.refractionFromScene = true;
+    quality.layeredWater = true;
+    quality.waterUpdateMode = WATER_UPDATE_EVERY_FRAME;
+    switch (preset) {
+    case QUALITY_LOW:
+        // No second scene pass at all, the reflection is marched through
+        // the scene and redrawn every few frames
+        quality.skyboxSize = 512;
+        quality.terrainDepth = 7;
+        quality.blurRadius = 4;
+        quality.reflectionMode = REFLECTION_SCREEN_SPACE;
+        quality.reflectionScale = 0.5f;
+        quality.refractionScale = 0.5f;
+        quality.waterUpdateMode = WATER_UPDATE_EVERY_N_FRAMES;
+        break;
+    case QUALITY_MEDIUM:
+        quality.skyboxSize = 1024;
+        quality.blurRadius = 8;
+        quality.reflectionScale = 0.5f;
+        quality.refractionScale = 0.5f;
+        break;
+    case QUALITY_ULTRA:
+        // The refraction gets a pass of its own, drawn layered with the
+        // reflection, and the blur runs at full resolution
+        quality.terrainDepth = 9;
+        quality.dofPyramid = false;
+        quality.refractionFromScene = false;
+        break;
+    default:
+        break;
+    }
+
+    QSettings settings(qualityPath_, QSettings::IniFormat);
+    quality.skybox = (SKYBOX_TYPE)name_index(settings.value("general/skybox").toString(),
+                                             SKYBOX_NAMES, 3, quality.skybox);
+    settings.beginGroup(QUALITY_PRESET_NAMES[preset]);
+    quality.skybox = (SKYBOX_TYPE)name_index(settings.value("skybox").toString(),
+                                             SKYBOX_NAMES, 3, quality.skybox);
+    quality.skyboxSize = settings.value("skyboxSize", quality.skyboxSize).toInt();
+    quality.terrainDepth = settings.value("terrainDepth", quality.terrainDepth).toInt();
+    quality.dofEnabled = settings.value("dofEnabled", quality.dofEnabled).toBool();
+    quality.dofPyramid = settings.value("dofPyramid", quality.dofPyramid).toBool();
+    quality.computeBlur = settings.value("computeBlur", quality.computeBlur).toBool();
+    quality.blurRadius = settings.value("blurRadius", quality.blurRadius).toInt();
+    quality.reflectionMode = (ReflectionMode)name_index(settings.value("reflectionMode").toString(),
+                                                        REFLECTION_MODE_NAMES, REFLECTION_MODE_COUNT,
+                                                        quality.reflectionMode);
+    quality.reflectionScale = settings.value("reflectionScale", quality.reflectionScale).toFloat();
+    quality.refractionScale = settings.value("refractionScale", quality.refractionScale).toFloat();
+    quality.refractionFromScene = settings.value("refractionFromScene", quality.refractionFromScene).toBool();
+    quality.layeredWater = settings.value("layeredWater", quality.layeredWater).toBool();
+    quality.waterUpdateMode = (WaterUpdateMode)name_index(settings.value("waterUpdateMode").toString(),
+                                                          WATER_UPDATE_MODE_NAMES, WATER_UPDATE_MODE_COUNT,
+                                                          quality.waterUpdateMode);
+    settings.endGroup();
+
+    // Keep hand edited values in the range the engine handles
+    int skyboxSize = MAX(quality.skyboxSize, 16);
+    int terrainDepth = MAX(quality.terrainDepth, 4);
+    int blurRadius = MAX(quality.blurRadius, 1);
+    float reflectionScale = MAX(quality.reflectionScale, 0.125f);
+    float refractionScale = MAX(quality.refractionScale, 0.125f);
+    quality.skyboxSize = MIN(skyboxSize, 4096);
+    quality.terrainDepth = MIN(terrainDepth, 10);
+    quality.blurRadius = MIN(blurRadius, COMPUTE_BLUR_MAX_RADIUS);
+    quality.reflectionScale = MIN(reflectionScale, 1.0f);
+    quality.refractionScale = MIN(refractionScale, 1.0f);
+}
+
+/**
+  Sets the engine up for new quality settings.  Only what they change is
+  rebuilt: the skybox is reloaded for a new skybox or face width, the
+  terrain generated again for a new depth, and the frame graph compiled
+  again for new passes or target sizes, which keeps the pooled textures
+  that still fit.
+  **/
+void DrawEngine::applyQuality(const QualitySettings &quality) {
+    bool skybox = quality.skybox != quality_.skybox || quality.skyboxSize != quality_.skyboxSize;
+    bool terrain = quality.terrainDepth != quality_.terrainDepth;
+    bool frame = quality.dofEnabled != dofEnabled_ || quality.dofPyramid != dofPyramid_ ||
+                 quality.computeBlur != computeBlur_ || quality.reflectionMode != reflectionMode_ ||
+                 quality.reflectionScale != reflectionScale_ || quality.refractionScale != refractionScale_ ||
+                 quality.refractionFromScene != refractionFromScene_ || quality.layeredWater != layeredWater_ ||
+                 quality.waterUpdateMode != waterUpdateMode_;
+    quality_ = quality;
+
+    if (skybox) {
+        load_skybox();
+    }
+    if (terrain) {
+        create_terrain();
+    }
+    if (frame) {
+        dofEnabled_ = quality.dofEnabled;
+        dofPyramid_ = quality.dofPyramid;
+        computeBlur_ = quality.computeBlur;
+        reflectionMode_ = quality.reflectionMode;
+        reflectionScale_ = quality.reflectionScale;
+        refractionScale_ = quality.refractionScale;
+        refractionFromScene_ = quality.refractionFromScene;
+        layeredWater_ = quality.layeredWater;
+        waterUpdateMode_ = quality.waterUpdateMode;
+        frameGraphDirty_ = true;
+    }
 }
 
 /**
@@ -761,13 +2344,13 @@ GLuint DrawEngine::load_cube_map(QList<QFile *> files) {
         image.load(files[i]->fileName());
         image = image.mirrored(false,true);
         texture = QGLWidget::convertToGLFormat(image);
-        texture = texture.scaledToWidth(2048,Qt::SmoothTransformation);
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,3,3,texture.width(),texture.height(),0,GL_RGBA,GL_UNSIGNED_BYTE,texture.bits());
-        gluBuild2DMipmaps(GL_TEXTURE_CUBE_MAP_POSITIVE_X +i, 3, texture.width(), texture.height(), GL_RGBA, GL_UNSIGNED_BYTE, texture.bits());
+        texture = texture.scaledToWidth(quality_.skyboxSize,Qt::SmoothTransformation);
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,0,GL_RGB8,texture.width(),texture.height(),0,GL_RGBA,GL_UNSIGNED_BYTE,texture.bits());
         cout << "\t  " << files[i]->fileName().toStdString() << " " << endl;
     }
+    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
     glTexParameteri(GL_TEXTURE_CUBE_MAP,GL_TEXTURE_MIN_FILTER,GL_NEAREST_MIPMAP_NEAREST);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP,GL_TEXTURE_MAG_FILTER,GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
     glBindTexture(GL_TEXTURE_CUBE_MAP,0);
     return id;
 }
@@ -798,9 +2381,55 @@ void DrawEngine::key_press_event(QKeyEvent *event) {
         break;
     case Qt::Key_D:
         dofEnabled_ = !dofEnabled_;
+        frameGraphDirty_ = true;
+        break;
+    case Qt::Key_B:
+        setDofPyramid(!dofPyramid_);
+        break;
+    case Qt::Key_X:
+        setComputeBlur(!computeBlur_);
         break;
     case Qt::Key_M:
         depthmapEnabled_ = !depthmapEnabled_;
+        frameGraphDirty_ = true;
+        break;
+    case Qt::Key_C:
+        terrain_->setOcclusionCulling(!terrain_->getOcclusionCulling());
+        break;
+    case Qt::Key_R:
+        // Cycle full, half and quarter resolution
+        setReflectionScale(reflectionScale_ > 0.3f ? reflectionScale_ * 0.5f : 1.0f);
+        break;
+    case Qt::Key_F:
+        setRefractionScale(refractionScale_ > 0.3f ? refractionScale_ * 0.5f : 1.0f);
+        break;
+    case Qt::Key_W:
+        waterCulling_ = !waterCulling_;
+        waterOccluded_ = false;
+        break;
+    case Qt::Key_K:
+        setWaterClipPlanes(!waterClipPlanes_);
+        break;
+    case Qt::Key_G:
+        setLayeredWaterPasses(!layeredWater_);
+        break;
+    case Qt::Key_L:
+        setReflectionMode((ReflectionMode)((reflectionMode_ + 1) % REFLECTION_MODE_COUNT));
+        break;
+    case Qt::Key_T:
+        setRefractionFromScene(!refractionFromScene_);
+        break;
+    case Qt::Key_U:
+        setWaterUpdateMode((WaterUpdateMode)((waterUpdateMode_ + 1) % WATER_UPDATE_MODE_COUNT));
+        break;
+    case Qt::Key_Q:
+        setQualityPreset((QualityPreset)((qualityPreset_ + 1) % QUALITY_PRESET_COUNT));
+        break;
+    case Qt::Key_A:
+        setAutoQuality(!autoQuality_);
+        break;
+    case Qt::Key_V:
+        setDynamicResolution(!dynamicResolution_);
         break;
     case Qt::Key_O:
         if (blurFactor_ <= 10) {
@@ -1,33 +1,187 @@
 #ifndef DRAWENGINE_H
 #define DRAWENGINE_H
 
-#include <QHash>
 #include <QString>
+#include <QByteArray>
+#include <QElapsedTimer>
 #define GL_GLEXT_LEGACY // no glext.h, we have our own
 #include <qgl.h>
 #include "glm.h"
 #include "common.h"
 #include "terrain.h"
 #include "camera.h"
+#include "framegraph.h"
+#include "glstate.h"
+#include "uniformring.h"
+#include "shaderids.h"
 #include <Qt>
 
 class QGLContext;
 class QGLShaderProgram;
 class QFile;
-class QGLFramebufferObject;
 class QKeyEvent;
 
-struct Model {
-    GLMmodel *model;
-    GLuint idx;
-};
-
 
 static const QString TERRAIN_TEX0 = "textures/terrain/dirt.jpg";
 static const QString TERRAIN_TEX1 = "textures/terrain/grass.jpg";
 static const QString TERRAIN_TEX2 = "textures/terrain/rock.jpg";
 static const QString TERRAIN_TEX3 = "textures/terrain/snow.jpg";
 
+enum SKYBOX_TYPE {
+    SKYBOX_ALPINE,
+    SKYBOX_ISLAND,
+    SKYBOX_HOURGLASS
+};
+
+// Passes of the frame graph, see DrawEngine::build_frame_graph
+enum RenderPass {
+    PASS_REFLECTION,
+    PASS_REFRACTION,
+    PASS_WATER_LAYERS,
+    PASS_SCENE,
+    PASS_SCENE_COPY,
+    PASS_DEPTH_PYRAMID,
+    PASS_SCREEN_SPACE_REFLECTION,
+    PASS_WATER,
+    PASS_DOF_HALF,
+    PASS_DOF_QUARTER,
+    PASS_BLUR_X,
+    PASS_BLUR_COMPUTE,
+    PASS_POST,
+    PASS_COUNT
+};
+
+// Render targets of the frame graph
+enum RenderTarget {
+    TARGET_REFLECTION,
+    TARGET_REFLECTION_DEPTH,
+    TARGET_REFRACTION,
+    TARGET_REFRACTION_DEPTH,
+    TARGET_WATER_LAYERS,
+    TARGET_WATER_LAYERS_DEPTH,
+    TARGET_SCENE,
+    TARGET_SCENE_DEPTH,
+    TARGET_SCENE_COPY,
+    TARGET_SCENE_COPY_DEPTH,
+    TARGET_DEPTH_PYRAMID,
+    TARGET_DOF_HALF,
+    TARGET_DOF_QUARTER,
+    TARGET_BLUR_X,
+    TARGET_BLUR_Y,
+    TARGET_COUNT
+};
+
+// Texture units the passes sample from.  A pass binds what it samples to
+// the units named for it here and unbinds them after.  Nothing else uses
+// the units of the water's bump map and of the terrain's region textures,
+// which Terrain::setTextures binds once, so those stay bound.
+enum TextureUnit {
+    UNIT_SOURCE = 0,            // the image a pass reads: scene, blur source, reflection or water
+                                // layers, and the cube map of the skybox and the terrain
+    UNIT_TERRAIN_REGIONS = 1,   // the 4 region textures, UNIT_TERRAIN_REGIONS + i for region i
+    UNIT_BUMP_MAP = 5,          // the water's
+    UNIT_REFRACTION = 6,
+    UNIT_REFRACTION_DEPTH = 7,  // the scene copy's depth, when the water refracts the scene
+    UNIT_BLURRED = 8,           // the depth of field's blurred scene
+    UNIT_HALFRES = 9,           // and its half resolution copy
+    UNIT_SCENE_DEPTH = 10,      // for the depth of field's blur amounts
+    UNIT_DEPTH_PYRAMID = 11,    // the screen space reflection's
+    UNIT_REFLECTED_SKYBOX = 12  // the cube map screen space reflections fall back to
+};
+
+// How the water's reflection is rendered
+enum ReflectionMode {
+    REFLECTION_MIRRORED,     // the scene drawn again, mirrored about sea level
+    REFLECTION_SCREEN_SPACE, // rays marched through the opaque scene's depth
+    REFLECTION_MODE_COUNT
+};
+
+// How often the reflection and refraction are redrawn, see plan_water_update
+enum WaterUpdateMode {
+    WATER_UPDATE_EVERY_FRAME,
+    WATER_UPDATE_EVERY_N_FRAMES, // in full every waterUpdateInterval_ frames
+    WATER_UPDATE_INTERLEAVED,    // even rows one frame, odd rows the next
+    WATER_UPDATE_MODE_COUNT
+};
+
+// What a reflection or refraction pass draws in one frame
+enum WaterUpdate {
+    WATER_DRAW_NOTHING,
+    WATER_DRAW_EVEN_ROWS,
+    WATER_DRAW_ODD_ROWS,
+    WATER_DRAW_ALL
+};
+
+// Whether the water shows this frame, see update_water_visibility
+enum WaterVisibility {
+    WATER_VISIBLE,
+    WATER_OFF_SCREEN,
+    WATER_OCCLUDED
+};
+
+// A reflection or refraction kept from earlier frames.  Holds the camera
+// and the water's projection from when its even and odd rows were drawn,
+// so the water can reproject them to the current camera.
+struct WaterHistory {
+    float mvp[2][16];
+    Vector4 eye[2], look[2];
+    bool valid;
+};
+
+// The uniform blocks of shaders/uniforms.glsl, laid out by std140.  Both
+// are written through the UniformRing and bound to every program.
+enum UniformBlock {
+    UNIFORM_BLOCK_FRAME,
+    UNIFORM_BLOCK_PASS,
+    UNIFORM_BLOCK_COUNT
+};
+
+// FrameUniforms, written once a frame
+struct FrameUniforms {
+    GLfloat projection[16]; // row-major
+    GLfloat nearPlane, farPlane;
+    GLfloat focalDistance, focalRange;
+    GLfloat seaLevel;
+    GLfloat screenWidth, screenHeight;
+    GLfloat pad;
+};
+
+// PassUniforms, written whenever a pass changes the transform it draws with
+struct PassUniforms {
+    GLfloat modelview[16];      // row-major
+    GLfloat normalMatrix[3][4]; // row-major, each row padded to a vec4
+    GLfloat clipPlane[4];
+    GLint waterRows;
+    GLint pad[3];
+};
+
+// Quality presets, see DrawEngine::loadQualitySettings
+enum QualityPreset {
+    QUALITY_LOW,
+    QUALITY_MEDIUM,
+    QUALITY_HIGH,
+    QUALITY_ULTRA,
+    QUALITY_CUSTOM, // the high preset with the config file's [custom] values
+    QUALITY_PRESET_COUNT
+};
+
+// The settings a quality preset chooses.  Each subsystem is only rebuilt
+// when its own settings change, see DrawEngine::applyQuality.
+struct QualitySettings {
+    SKYBOX_TYPE skybox;
+    int skyboxSize;           // cube face width in texels
+    int terrainDepth;         // subdivisions, the terrain is 2^depth + 1 vertices a side
+    bool dofEnabled;
+    bool dofPyramid;
+    bool computeBlur;
+    int blurRadius;           // largest compute blur radius, up to COMPUTE_BLUR_MAX_RADIUS
+    ReflectionMode reflectionMode;
+    float reflectionScale;
+    float refractionScale;
+    bool refractionFromScene;
+    bool layeredWater;
+    WaterUpdateMode waterUpdateMode;
+};
 
 class DrawEngine {
 public:
@@ -38,7 +192,53 @@ public:
 
     //methods
     Camera * getCamera() { return &camera_; }
+    Terrain * getTerrain() { return terrain_; }
+    const FrameGraph & getFrameGraph() const { return frameGraph_; }
     float getBlurSize() const { return 1.0f / blurFactor_; }
+    bool getDofPyramid() const { return dofPyramid_; }
+    void setDofPyramid(bool pyramid);
+    GLenum getTargetFormat(RenderTarget target) const { return targetFormats_[target]; }
+    void setTargetFormat(RenderTarget target, GLenum format);
+    bool getComputeBlur() const { return computeBlur_; }
+    void setComputeBlur(bool compute);
+    bool isBlurComputed() const { return compute_blur(); }
+    float getReflectionScale() const { return reflectionScale_; }
+    float getRefractionScale() const { return refractionScale_; }
+    void setReflectionScale(float scale);
+    void setRefractionScale(float scale);
+    WaterUpdateMode getWaterUpdateMode() const { return waterUpdateMode_; }
+    int getWaterUpdateInterval() const { return waterUpdateInterval_; }
+    WaterVisibility getWaterVisibility() const { return waterVisibility_; }
+    bool getWaterCulling() const { return waterCulling_; }
+    void setWaterUpdateMode(WaterUpdateMode mode);
+    ReflectionMode getReflectionMode() const { return reflectionMode_; }
+    void setReflectionMode(ReflectionMode mode);
+    bool getRefractionFromScene() const { return refractionFromScene_; }
+    void setRefractionFromScene(bool fromScene);
+    bool getLayeredWaterPasses() const { return layeredWater_; }
+    void setLayeredWaterPasses(bool layered);
+    bool isWaterLayered() const { return layered_water(); }
+    bool getWaterClipPlanes() const { return waterClipPlanes_; }
+    void setWaterClipPlanes(bool clip) { waterClipPlanes_ = clip; }
+    GLuint getWaterPassSamples() const { return waterPassSamples_[0] + waterPassSamples_[1]; }
+    QualityPreset getQualityPreset() const { return qualityPreset_; }
+    QString getQualityPresetName() const;
+    const QualitySettings & getQuality() const { return quality_; }
+    void loadQualitySettings(const QString &path);
+    void setQualityPreset(QualityPreset preset);
+    void applyQuality(const QualitySettings &quality);
+    bool getAutoQuality() const { return autoQuality_; }
+    void setAutoQuality(bool enabled);
+    int getQualityLevel() const { return qualityLevel_; }
+    float getFrameBudget() const { return frameBudget_; }
+    void setFrameBudget(float ms) { frameBudget_ = ms; }
+    float getGpuFrameTime() const { return gpuFrameTime_; }
+    bool getDynamicResolution() const { return dynamicResolution_; }
+    void setDynamicResolution(bool enabled);
+    int getStateChanges(RenderPass pass) const;
+    int getSkippedStateChanges(RenderPass pass) const;
+    float getRenderScale() const { return frameGraph_.getRenderScale(); }
+    float getCpuFrameTime() const { return cpuFrameTime_; }
     void draw_frame(float time, int w, int h);
     void resize_frame(int w, int h);
     void mouse_wheel_event(int dx);
@@ -48,37 +248,140 @@ public:
     float fps() const { return fps_; }
 
 protected:
+    // Frames the GPU timing can lag behind without stalling
+    static const int FRAME_QUERIES = 4;
+    // Attributes of the skybox and water vertex arrays
+    static const GLuint ATTRIB_VERTEX = 0;
+    static const GLuint ATTRIB_TEX_COORD = 1;
 
     //methods
     void perspective_camera(int w, int h);
-    void orthogonal_camera(int w, int h);
-    void textured_quad(int w, int h, bool flip);
+    void set_transform();
+    void write_frame_uniforms(int w, int h);
+    void fullscreen_triangle();
+    void skybox_cube();
+    void render_skybox();
+    void render_terrain(TerrainPass pass);
+    void set_view_max(ShaderProgramId program, RenderTarget target);
+    void set_depth_blur(ShaderProgramId program, bool fromDepth);
+    void end_depth_blur();
     void render_scene(int w, int h);
-    void realloc_framebuffers(int w, int h);
     void load_models();
     void load_textures();
+    void load_skybox();
     GLuint load_texture(const QFile &file);
+    void create_terrain();
+    void read_quality(QualityPreset preset, QualitySettings &quality);
+    bool lower_quality(QualitySettings &quality, int steps);
+    void begin_frame_timing();
+    void end_frame_timing();
+    void tune_quality();
+    void tune_render_scale();
+    static int resize_bucket(int size);
     void load_shaders();
+    static void get_uniform_locations(GLuint program, GLint *locations);
+    static void bind_uniform_blocks(GLuint program);
+    static QByteArray shader_source(const QString &path, const QByteArray &defines = QByteArray());
     GLuint load_cube_map(QList<QFile *> files);
-    void create_fbos(int w, int h);
+    void build_frame_graph(int w, int h);
     void render_water();
+    void render_water_surface();
+    void render_water_pass();
+    void water_quad();
+    void build_depth_pyramid();
+    void render_screen_space_reflections();
+    bool copies_scene() const;
+    bool layered_water() const;
+    bool compute_blur() const;
+    GLuint load_compute_shader(const QString &path);
+    void render_compute_blur(int w);
     void render_reflections();
     void render_refraction();
+    void render_water_layers();
+    void mirror_transform();
+    WaterUpdate plan_water_update(const WaterHistory &history, int phase);
+    void commit_water_history(WaterHistory &history, WaterUpdate update, const float *mvp);
+    void begin_water_rows(WaterUpdate update);
+    void end_water_rows();
+    void update_water_visibility(int w, int h);
+    void begin_water_scissor(RenderTarget target);
+    void begin_water_clip(float side);
+    void end_water_clip();
+    void begin_fill_query(int pass);
+    void end_fill_query(int pass);
+    void read_fill_queries();
+    void terrain_transform();
 
     // Member variables
-    QHash<QString, QGLShaderProgram *> shader_programs_; // hash map of all shader programs
-    QHash<QString, QGLFramebufferObject *> framebuffer_objects_; // hash map of all framebuffer objects
-    QHash<QString, Model> models_; // hashmap of all models
-    QHash<QString, GLuint> textures_; // hashmap of all textures
+    QGLShaderProgram *programs_[PROGRAM_COUNT]; // NULL for post combinations never used
+    GLint uniforms_[PROGRAM_COUNT][UNIFORM_COUNT]; // locations, -1 where a program lacks one
+    GLint terrainUniforms_[Terrain::UNIFORM_COUNT], terrainLayeredUniforms_[Terrain::UNIFORM_COUNT];
+    FrameGraph frameGraph_; // passes and render targets of a frame
+    GLState glState_;       // what the passes last set, see GLState
+    int stateChanges_[PASS_COUNT], skippedStateChanges_[PASS_COUNT]; // per pass, last frame
+    GLenum targetFormats_[TARGET_COUNT];
+    bool frameGraphDirty_;  // rebuild the frame graph before the next frame
+    GLuint skyboxVertexArray_, skyboxBuffers_[2]; // the skybox cube's vertices and indices
+    GLuint waterVertexArray_, waterBuffer_;       // the water quad's vertices
+    Matrix4x4 projection_, modelview_; // what drawing transforms by, see set_transform
+    UniformRing uniformRing_;  // the FrameUniforms and PassUniforms blocks drawn with
+    float clipPlane_[4];       // see begin_water_clip
+    GLuint cubeMap_;    // the skybox's texture, 0 until loaded
     const QGLContext *context_; // the current OpenGL context to render to
     float previous_time_, fps_; // the previous time and the fps counter
     Camera camera_; // a simple camera struct
     Terrain *terrain_;
+    GLuint terrainTextures_[4];
+    QString qualityPath_;   // INI file the presets are read from
+    QualityPreset qualityPreset_;
+    QualitySettings quality_; // what the engine was last set up with
+    QualitySettings presetQuality_; // the preset's settings, before tuning
+    bool autoQuality_;      // lower the quality to hold the frame budget
+    int qualityLevel_;      // steps the quality is lowered by, see lower_quality
+    float frameBudget_;     // ms a frame may take on the GPU and the CPU
+    float gpuFrameTime_, cpuFrameTime_; // smoothed ms
+    int overBudgetFrames_, underBudgetFrames_; // in a row
+    int qualitySettleFrames_; // frames left before measuring again after a change
+    bool dynamicResolution_;  // draw the scene at a render scale that holds the frame budget
+    float renderScale_;
+    int renderScaleFrames_;   // frames left until the render scale is tuned again
+    int windowWidth_, windowHeight_; // of the last frame
+    float resizeTime_;        // ms, when the window last changed size
+    GLuint frameQueries_[FRAME_QUERIES]; // GL_TIME_ELAPSED of the last frames, read once ready
+    int frameQueryNext_, frameQueriesPending_;
+    QElapsedTimer cpuTimer_;
     bool dofEnabled_;       // Enable depth of field
     bool depthmapEnabled_;  // Enable depth map
+    bool dofPyramid_;       // blur a quarter resolution copy of the scene for the depth of field
+    bool computeBlur_;      // blur with a compute shader, where the context has them
+    GLuint computeBlurProgram_; // 0 without GL 4.3
+    GLint computeBlurUniforms_[UNIFORM_COUNT];
+    int postSteps_;         // PostStep flags of the pass drawing to the screen
+    GLuint emptyVertexArray_; // for fullscreen_triangle
     float offsetX_, offsetY_;
     GLuint bumpMap_;
     float blurFactor_;
+    float reflectionScale_; // resolution of the reflection relative to the window
+    float refractionScale_; // resolution of the refraction relative to the window
+    ReflectionMode reflectionMode_;
+    bool refractionFromScene_; // refract a copy of the opaque scene instead of a pass of its own
+    bool layeredWater_;        // draw the reflection and refraction in one layered pass
+    WaterUpdateMode waterUpdateMode_;
+    int waterUpdateInterval_; // frames between full updates in WATER_UPDATE_EVERY_N_FRAMES
+    int frameCount_;
+    WaterHistory reflectionHistory_, refractionHistory_;
+    WaterUpdate reflectionUpdate_, refractionUpdate_; // what this frame redraws
+    int waterRows_;            // rows the water passes draw, see begin_water_rows
+    bool waterCulling_;        // skip or scissor the water passes when little water shows
+    GLuint waterQuery_;        // samples of the water that passed the depth test
+    bool waterQueryPending_;
+    bool waterOccluded_;       // the last query result was zero
+    WaterVisibility waterVisibility_;
+    float waterBounds_[4];     // water's screen bounds, x0 y0 x1 y1 in NDC
+    bool waterClipPlanes_;     // clip the water passes' terrain at sea level rather than flatten it there
+    GLuint fillQueries_[2];    // terrain samples drawn by the reflection and refraction passes
+    bool fillQueryPending_[2];
+    GLuint waterPassSamples_[2]; // their last results
 };
 
 #endif // DRAWENGINE_H
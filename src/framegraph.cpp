@@ -0,0 +1,462 @@
+#define GL_GLEXT_LEGACY // no glext.h, we have our own
+#include <GL/gl.h>
+#define GL_GLEXT_PROTOTYPES
+#include "glext.h"
+
+#include "framegraph.h"
+#include "common.h"
+#include <assert.h>
+using std::cout;
+using std::endl;
+
+FrameGraph::FrameGraph() {
+    width_ = height_ = 0;
+    frameWidth_ = frameHeight_ = 0;
+    renderScale_ = 1.0f;
+    numPasses_ = numScheduled_ = numPool_ = 0;
+    readFramebuffer_ = 0;
+    levelTarget_ = -1;
+    for (int i = 0; i < MAX_PASSES; i++) {
+        framebuffers_[i] = 0;
+    }
+    for (int i = 0; i < MAX_TARGETS; i++) {
+        targets_[i].declared = false;
+        targets_[i].texture = 0;
+    }
+}
+
+FrameGraph::~FrameGraph() {
+    for (int i = 0; i < MAX_PASSES; i++) {
+        if (framebuffers_[i]) {
+            glDeleteFramebuffers(1, &framebuffers_[i]);
+        }
+    }
+    if (readFramebuffer_) {
+        glDeleteFramebuffers(1, &readFramebuffer_);
+    }
+    for (int i = 0; i < numPool_; i++) {
+        glDeleteTextures(1, &pool_[i].texture);
+    }
+}
+
+/**
+  Starts declaring a new graph for frames of up to the given size.  The
+  pooled textures are kept until the next compile() so they can be reused.
+  **/
+void FrameGraph::reset(int w, int h) {
+    width_ = frameWidth_ = w;
+    height_ = frameHeight_ = h;
+    numPasses_ = 0;
+    for (int i = 0; i < MAX_TARGETS; i++) {
+        targets_[i].declared = false;
+    }
+}
+
+/**
+  Declares a render target with the given internal format, scale times the
+  frame size.  Depth formats are attached as the depth buffer of the passes
+  that write them.
+  **/
+void FrameGraph::setTarget(int target, GLenum format, float scale) {
+    Target &t = targets_[target];
+    t.format = format;
+    t.width = (int)(width_ * scale + 0.5f);
+    t.height = (int)(height_ * scale + 0.5f);
+    t.width = MAX(t.width, 1);
+    t.height = MAX(t.height, 1);
+    t.levels = 1;
+    t.layers = 1;
+    t.declared = true;
+    t.persistent = false;
+    t.dynamic = false;
+}
+
+/**
+  Gives a color target mipmap levels, each half the size of the one
+  before.  The levels are never generated, the pass writing the target
+  draws each of them.
+  **/
+void FrameGraph::setLevels(int target, int levels) {
+    targets_[target].levels = levels;
+}
+
+/**
+  Makes a target a texture array of the given number of layers.
+  **/
+void FrameGraph::setLayers(int target, int layers) {
+    targets_[target].layers = layers;
+}
+
+/**
+  Keeps a target's contents from frame to frame.  Its texture is never
+  shared with other targets, so passes can skip redrawing it.
+  **/
+void FrameGraph::setPersistent(int target) {
+    targets_[target].persistent = true;
+}
+
+/**
+  Sets the size of the frames drawn from now on, at most the size the
+  graph was compiled for.  The screen is drawn at this size, and the
+  targets in the same part of them.
+  **/
+void FrameGraph::setFrameSize(int w, int h) {
+    frameWidth_ = MIN(w, width_);
+    frameHeight_ = MIN(h, height_);
+}
+
+/**
+  Has the passes writing a target draw only the render scale's part of
+  it, see setRenderScale.
+  **/
+void FrameGraph::setDynamic(int target) {
+    targets_[target].dynamic = true;
+}
+
+/**
+  Adds a pass after the ones declared so far.  Following read() and write()
+  calls apply to it.
+  **/
+void FrameGraph::addPass(int pass) {
+    Pass &p = passes_[numPasses_++];
+    p.id = pass;
+    p.numReads = p.numWrites = 0;
+    p.live = p.screen = false;
+}
+
+void FrameGraph::read(int target) {
+    Pass &p = passes_[numPasses_ - 1];
+    p.reads[p.numReads++] = target;
+}
+
+void FrameGraph::write(int target) {
+    Pass &p = passes_[numPasses_ - 1];
+    p.writes[p.numWrites++] = target;
+}
+
+bool FrameGraph::isDepthFormat(GLenum format) {
+    return format == GL_DEPTH_COMPONENT || format == GL_DEPTH_COMPONENT16 ||
+           format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32;
+}
+
+static int bytesPerPixel(GLenum format) {
+    switch (format) {
+    case GL_RGBA32F_ARB:
+        return 16;
+    case GL_RGBA16F_ARB:
+        return 8;
+    case GL_DEPTH_COMPONENT16:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+/**
+  Culls the unused passes, works out the target lifetimes and assigns the
+  targets to pooled textures, then builds a framebuffer for each pass.
+  **/
+void FrameGraph::compile() {
+    // Walk back from the passes that write the screen, a pass is live if
+    // a live pass after it reads something it writes
+    bool needed[MAX_TARGETS] = { false };
+    for (int i = numPasses_ - 1; i >= 0; i--) {
+        Pass &p = passes_[i];
+        p.live = p.screen = false;
+        for (int w = 0; w < p.numWrites; w++) {
+            if (p.writes[w] == BACKBUFFER) {
+                p.live = p.screen = true;
+            } else if (needed[p.writes[w]]) {
+                p.live = true;
+            }
+        }
+        if (p.live) {
+            for (int r = 0; r < p.numReads; r++) {
+                needed[p.reads[r]] = true;
+            }
+        }
+    }
+    numScheduled_ = 0;
+    for (int i = 0; i < numPasses_; i++) {
+        if (passes_[i].live) {
+            schedule_[numScheduled_++] = i;
+        }
+    }
+
+    // Lifetimes in scheduled pass indices
+    for (int t = 0; t < MAX_TARGETS; t++) {
+        targets_[t].firstUse = targets_[t].lastUse = -1;
+        targets_[t].texture = 0;
+    }
+    for (int s = 0; s < numScheduled_; s++) {
+        const Pass &p = passes_[schedule_[s]];
+        for (int w = 0; w < p.numWrites; w++) {
+            if (p.writes[w] != BACKBUFFER) {
+                Target &t = targets_[p.writes[w]];
+                if (t.firstUse == -1) {
+                    t.firstUse = s;
+                }
+                t.lastUse = s;
+            }
+        }
+        for (int r = 0; r < p.numReads; r++) {
+            Target &t = targets_[p.reads[r]];
+            if (t.firstUse == -1) {
+                cout << "Frame graph: pass " << p.id << " reads target " << p.reads[r]
+                     << " before anything writes it" << endl;
+                t.firstUse = s;
+            }
+            t.lastUse = s;
+        }
+    }
+
+    // Hand out pooled textures in pass order.  A texture is free again
+    // after the last pass using its current target, so targets with
+    // disjoint lifetimes alias the same memory.  Persistent targets take a
+    // texture nothing else touches during the frame.
+    for (int i = 0; i < numPool_; i++) {
+        pool_[i].busyUntil = -1;
+    }
+    for (int s = 0; s < numScheduled_; s++) {
+        for (int t = 0; t < MAX_TARGETS; t++) {
+            const Target &target = targets_[t];
+            if (target.declared && target.firstUse == s) {
+                int i = acquireTexture(target, target.persistent ? 0 : s);
+                pool_[i].busyUntil = target.persistent ? numScheduled_ : target.lastUse;
+                targets_[t].texture = pool_[i].texture;
+            }
+        }
+    }
+
+    // Free whatever the new schedule doesn't use
+    int kept = 0;
+    for (int i = 0; i < numPool_; i++) {
+        if (pool_[i].busyUntil == -1) {
+            glDeleteTextures(1, &pool_[i].texture);
+        } else {
+            pool_[kept++] = pool_[i];
+        }
+    }
+    numPool_ = kept;
+
+    for (int s = 0; s < numScheduled_; s++) {
+        buildFramebuffer(s);
+    }
+}
+
+/**
+  Returns the index of a pooled texture matching the target's format and
+  size that is free by scheduled pass s, creating one if needed.  A new
+  texture goes in a slot the schedule being compiled hasn't claimed before
+  the pool grows.
+  **/
+int FrameGraph::acquireTexture(const Target &target, int s) {
+    for (int i = 0; i < numPool_; i++) {
+        const PooledTexture &tex = pool_[i];
+        if (tex.format == target.format && tex.width == target.width && tex.height == target.height &&
+            tex.levels == target.levels && tex.layers == target.layers && tex.busyUntil < s) {
+            return i;
+        }
+    }
+
+    int i = 0;
+    while (i < numPool_ && pool_[i].busyUntil != -1) {
+        i++;
+    }
+    if (i < numPool_) {
+        glDeleteTextures(1, &pool_[i].texture);
+    } else {
+        // Each target claims one slot at most, so this never runs out
+        assert(numPool_ < MAX_TARGETS);
+        numPool_++;
+    }
+
+    PooledTexture &tex = pool_[i];
+    tex.format = target.format;
+    tex.width = target.width;
+    tex.height = target.height;
+    tex.levels = target.levels;
+    tex.layers = target.layers;
+    // Linear so smaller targets upsample smoothly, depth and mipmapped
+    // targets are never filtered
+    GLint filter = isDepthFormat(tex.format) || tex.levels > 1 ? GL_NEAREST : GL_LINEAR;
+    GLenum type = tex.layers > 1 ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    GLenum pixelFormat = isDepthFormat(tex.format) ? GL_DEPTH_COMPONENT : GL_RGBA;
+    GLenum pixelType = isDepthFormat(tex.format) ? GL_UNSIGNED_INT : GL_FLOAT;
+    glGenTextures(1, &tex.texture);
+    glBindTexture(type, tex.texture);
+    glTexParameteri(type, GL_TEXTURE_MIN_FILTER, tex.levels > 1 ? GL_NEAREST_MIPMAP_NEAREST : filter);
+    glTexParameteri(type, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(type, GL_TEXTURE_MAX_LEVEL, tex.levels - 1);
+    for (int level = 0; level < tex.levels; level++) {
+        int w = tex.width >> level, h = tex.height >> level;
+        w = MAX(w, 1);
+        h = MAX(h, 1);
+        if (tex.layers > 1) {
+            glTexImage3D(type, level, tex.format, w, h, tex.layers, 0, pixelFormat, pixelType, NULL);
+        } else {
+            glTexImage2D(type, level, tex.format, w, h, 0, pixelFormat, pixelType, NULL);
+        }
+    }
+    glBindTexture(type, 0);
+    return i;
+}
+
+/**
+  Attaches the targets written by scheduled pass s to its framebuffer.
+  Passes writing the screen draw to the window's framebuffer instead.
+  **/
+void FrameGraph::buildFramebuffer(int s) {
+    Pass &p = passes_[schedule_[s]];
+    p.width = width_;
+    p.height = height_;
+    p.target = -1;
+    if (p.screen) {
+        return;
+    }
+
+    if (!framebuffers_[s]) {
+        glGenFramebuffers(1, &framebuffers_[s]);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffers_[s]);
+    // The framebuffer may have been used by another pass before
+    for (int c = 0; c < MAX_PASS_TARGETS; c++) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + c, GL_TEXTURE_2D, 0, 0);
+    }
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+
+    GLenum drawBuffers[MAX_PASS_TARGETS];
+    int numColors = 0;
+    for (int w = 0; w < p.numWrites; w++) {
+        const Target &t = targets_[p.writes[w]];
+        p.width = t.width;
+        p.height = t.height;
+        p.target = p.writes[w];
+        GLenum attachment = GL_DEPTH_ATTACHMENT;
+        if (!isDepthFormat(t.format)) {
+            attachment = drawBuffers[numColors] = GL_COLOR_ATTACHMENT0 + numColors;
+            numColors++;
+        }
+        if (t.layers > 1) {
+            glFramebufferTexture(GL_FRAMEBUFFER, attachment, t.texture, 0);
+        } else {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, t.texture, 0);
+        }
+    }
+    if (numColors > 0) {
+        glDrawBuffers(numColors, drawBuffers);
+    } else {
+        glDrawBuffer(GL_NONE);
+    }
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cout << "Frame graph: framebuffer for pass " << p.id << " is incomplete" << endl;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/**
+  Binds the framebuffer of scheduled pass i and sets the viewport to the
+  part of its targets drawn this frame.  Returns the id the pass was
+  declared with.
+  **/
+int FrameGraph::beginPass(int i) {
+    const Pass &p = passes_[schedule_[i]];
+    glBindFramebuffer(GL_FRAMEBUFFER, p.screen ? 0 : framebuffers_[i]);
+    if (p.screen) {
+        glViewport(0, 0, frameWidth_, frameHeight_);
+    } else if (p.target == -1) {
+        glViewport(0, 0, p.width, p.height);
+    } else {
+        glViewport(0, 0, getViewWidth(p.target), getViewHeight(p.target));
+    }
+    return p.id;
+}
+
+void FrameGraph::endPass() {
+    if (levelTarget_ != -1) {
+        // Leave the framebuffer as compile() built it
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               targets_[levelTarget_].texture, 0);
+        levelTarget_ = -1;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+/**
+  Points the current pass at a mipmap level of a target it writes, and
+  sets the viewport to the part of the level drawn this frame.  The target has to be the pass's
+  only color target.  To read the level below while drawing, limit the
+  texture's base and max level to it, sampling the level being drawn is
+  undefined.
+  **/
+void FrameGraph::drawToLevel(int target, int level) {
+    const Target &t = targets_[target];
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.texture, level);
+    glViewport(0, 0, getViewWidth(target, level), getViewHeight(target, level));
+    levelTarget_ = level == 0 ? -1 : target;
+}
+
+/**
+  Binds a color and a depth target as the read framebuffer, so the current
+  pass can glBlitFramebuffer them into the targets it writes.  Either may be
+  -1.  The pass has to declare reading them, and stays bound for drawing.
+  **/
+void FrameGraph::bindReadTargets(int color, int depth) {
+    if (!readFramebuffer_) {
+        glGenFramebuffers(1, &readFramebuffer_);
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, readFramebuffer_);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           color == -1 ? 0 : targets_[color].texture, 0);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
+                           depth == -1 ? 0 : targets_[depth].texture, 0);
+    glReadBuffer(color == -1 ? GL_NONE : GL_COLOR_ATTACHMENT0);
+}
+
+/**
+  The size of the part of a target's mipmap level that passes draw this
+  frame: the frame's part of it, and the render scale's part of that for
+  dynamic targets, rounded up.  Each level is half the one before, rounded
+  down, as the levels of the texture are.
+  **/
+int FrameGraph::getViewWidth(int target, int level) const {
+    const Target &t = targets_[target];
+    float scale = (float)frameWidth_ / width_ * (t.dynamic ? renderScale_ : 1.0f);
+    int w = (int)ceil(t.width * scale);
+    w = MIN(w, t.width);
+    w >>= level;
+    return MAX(w, 1);
+}
+
+int FrameGraph::getViewHeight(int target, int level) const {
+    const Target &t = targets_[target];
+    float scale = (float)frameHeight_ / height_ * (t.dynamic ? renderScale_ : 1.0f);
+    int h = (int)ceil(t.height * scale);
+    h = MIN(h, t.height);
+    h >>= level;
+    return MAX(h, 1);
+}
+
+/**
+  The texture a target was assigned by the last compile, 0 if the target
+  isn't used by any live pass.
+  **/
+GLuint FrameGraph::getTexture(int target) const {
+    return targets_[target].texture;
+}
+
+long FrameGraph::getAllocatedBytes() const {
+    long bytes = 0;
+    for (int i = 0; i < numPool_; i++) {
+        for (int level = 0; level < pool_[i].levels; level++) {
+            long w = pool_[i].width >> level, h = pool_[i].height >> level;
+            w = MAX(w, 1L);
+            h = MAX(h, 1L);
+            bytes += w * h * pool_[i].layers * bytesPerPixel(pool_[i].format);
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,152 @@
+#ifndef FRAMEGRAPH_H
+#define FRAMEGRAPH_H
+
+#define GL_GLEXT_LEGACY // no glext.h, we have our own
+#include <qgl.h>
+
+/**
+  A small frame graph.  The passes of a frame are declared in order, each
+  with the render targets it reads and writes, and compile() works out the
+  rest:
+
+    - passes whose outputs nothing reads are culled, all the way back
+      from the passes that write to the screen
+    - each target lives from the pass that first writes it to the pass
+      that last reads it, and targets whose lifetimes don't overlap share
+      one texture from a pool (depth targets included, so passes that
+      only need depth while they draw share a single depth texture)
+    - each live pass gets a framebuffer with its targets attached
+
+  A target can be made persistent, it then gets a texture of its own that
+  keeps its contents from one frame to the next (until the next compile).
+
+  A pass writing a target an earlier pass wrote draws over its contents,
+  which stay valid until the target's last use.
+
+  Targets can be smaller than the frame by a scale factor, a pass writing
+  them draws with the viewport set to their size.  Color targets are
+  filtered linearly so they can be sampled at any resolution.  Targets with
+  mipmap levels are point sampled instead, their pass fills the levels one
+  at a time with drawToLevel().
+
+  The frame drawn can be smaller than the size the graph was compiled
+  for, so it needn't be compiled again for every size a window passes
+  through while it is resized.  Every target is then drawn in its bottom
+  left corner only, the viewport of the passes writing them is set to
+  that part.  Dynamic targets are drawn smaller still, by the render
+  scale.  Neither needs compiling again or reallocates anything, and can
+  change every frame, readers scale their lookups to the part drawn.
+
+  Targets with layers are GL_TEXTURE_2D_ARRAY textures, attached whole so a
+  geometry shader picks the layer each primitive goes to with gl_Layer.
+  Every target a layered pass writes needs the same number of layers.
+
+  Passes and targets are named by ids the caller picks, small integers
+  below MAX_PASSES and MAX_TARGETS.  The graph only has to be compiled
+  again when the passes, target formats or frame size change, then the
+  schedule is run every frame with beginPass() and endPass().
+  **/
+class FrameGraph
+{
+public:
+    static const int MAX_PASSES = 16;
+    static const int MAX_TARGETS = 16;
+    static const int MAX_PASS_TARGETS = 4;
+    // The window's framebuffer, a pass writing it is always kept
+    static const int BACKBUFFER = -1;
+
+    FrameGraph();
+    ~FrameGraph();
+
+    // declaring the graph, between reset() and compile()
+    void reset(int w, int h);
+    void setTarget(int target, GLenum format, float scale = 1.0f);
+    void setPersistent(int target);
+    void setLevels(int target, int levels);
+    void setLayers(int target, int layers);
+    void setDynamic(int target);
+    void addPass(int pass);
+    void read(int target);
+    void write(int target);
+    void compile();
+
+    // running the compiled schedule
+    int getPassCount() const { return numScheduled_; }
+    int beginPass(int i);
+    void endPass();
+    void bindReadTargets(int color, int depth);
+    void drawToLevel(int target, int level);
+    GLuint getTexture(int target) const;
+    int getTargetWidth(int target) const { return targets_[target].width; }
+    int getTargetHeight(int target) const { return targets_[target].height; }
+    int getTargetLevels(int target) const { return targets_[target].levels; }
+    int getTargetLayers(int target) const { return targets_[target].layers; }
+    void setFrameSize(int w, int h);
+    int getFrameWidth() const { return frameWidth_; }
+    int getFrameHeight() const { return frameHeight_; }
+    int getViewWidth(int target, int level = 0) const;
+    int getViewHeight(int target, int level = 0) const;
+    float getViewScaleX(int target) const { return (float)getViewWidth(target) / targets_[target].width; }
+    float getViewScaleY(int target) const { return (float)getViewHeight(target) / targets_[target].height; }
+    float getRenderScale() const { return renderScale_; }
+    void setRenderScale(float scale) { renderScale_ = scale; }
+    int getWidth() const { return width_; }
+    int getHeight() const { return height_; }
+
+    // stats of the last compile
+    int getCulledPasses() const { return numPasses_ - numScheduled_; }
+    int getPooledTextures() const { return numPool_; }
+    long getAllocatedBytes() const;
+
+private:
+    struct Target {
+        GLenum format;
+        int width, height;
+        int levels;            // mipmap levels, see drawToLevel
+        int layers;            // layers of a texture array, 1 for a 2D texture
+        bool declared;
+        bool persistent;       // keeps its contents from frame to frame
+        bool dynamic;          // drawn at the render scale
+        int firstUse, lastUse; // scheduled pass indices, -1 when unused
+        GLuint texture;        // from the pool, 0 when unused
+    };
+
+    struct Pass {
+        int id;
+        int reads[MAX_PASS_TARGETS], numReads;
+        int writes[MAX_PASS_TARGETS], numWrites;
+        bool live;
+        bool screen; // writes the window's framebuffer
+        int target;  // a target it writes, the viewport is its view size
+        int width, height; // viewport, the size of the targets it writes
+    };
+
+    struct PooledTexture {
+        GLuint texture;
+        GLenum format;
+        int width, height;
+        int levels;
+        int layers;
+        int busyUntil; // last scheduled pass using it, -1 when free
+    };
+
+    static bool isDepthFormat(GLenum format);
+    int acquireTexture(const Target &target, int pass);
+    void buildFramebuffer(int i);
+
+    int width_, height_;
+    int frameWidth_, frameHeight_; // drawn this frame, at most width_ and height_
+    float renderScale_;
+    Target targets_[MAX_TARGETS];
+    Pass passes_[MAX_PASSES];
+    int numPasses_;
+    int schedule_[MAX_PASSES]; // indices into passes_ of the live passes
+    int numScheduled_;
+    GLuint framebuffers_[MAX_PASSES];
+    GLuint readFramebuffer_; // for copying out of targets, see bindReadTargets
+    int levelTarget_;        // target drawToLevel moved off level 0, or -1
+    PooledTexture pool_[MAX_TARGETS];
+    int numPool_;
+};
+
+#endif // FRAMEGRAPH_H
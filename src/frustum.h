@@ -0,0 +1,45 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include "common.h"
+
+/**
+  The six planes of a view frustum, extracted from a column-major
+  projection * modelview matrix.  The planes are in the space that matrix
+  maps from, so boxes can be tested in object space directly.
+  **/
+struct Frustum {
+    float planes[6][4];
+
+    Frustum() {}
+    Frustum(const float *m) { extract(m); }
+
+    inline void extract(const float *m) {
+        // Row i of the matrix is m[i], m[4+i], m[8+i], m[12+i]
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                planes[2*i][j]     = m[j*4 + 3] + m[j*4 + i];
+                planes[2*i + 1][j] = m[j*4 + 3] - m[j*4 + i];
+            }
+        }
+    }
+
+    /**
+      Returns false only if the box is entirely outside one of the planes.
+      **/
+    inline bool intersectsBox(const float3 &mn, const float3 &mx) const {
+        for (int i = 0; i < 6; i++) {
+            const float *p = planes[i];
+            // the box corner furthest along the plane normal
+            float x = p[0] >= 0 ? mx.x : mn.x;
+            float y = p[1] >= 0 ? mx.y : mn.y;
+            float z = p[2] >= 0 ? mx.z : mn.z;
+            if (p[0]*x + p[1]*y + p[2]*z + p[3] < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif // FRUSTUM_H
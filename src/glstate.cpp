@@ -0,0 +1,149 @@
+#define GL_GLEXT_LEGACY // no glext.h, we have our own
+#include <GL/gl.h>
+#define GL_GLEXT_PROTOTYPES
+#include "glext.h"
+
+#include "glstate.h"
+
+GLState::GLState() {
+    changes_ = skipped_ = 0;
+    invalidate();
+}
+
+/**
+  Forgets the state, the next call for each piece of it goes to GL.
+  Needed whenever something other than this cache may have changed it.
+  **/
+void GLState::invalidate() {
+    for (int i = 0; i < CAP_COUNT; i++) {
+        caps_[i] = UNKNOWN;
+    }
+    for (int unit = 0; unit < MAX_TEXTURE_UNITS; unit++) {
+        for (int i = 0; i < TEXTURE_TARGET_COUNT; i++) {
+            textures_[unit][i] = UNKNOWN;
+        }
+    }
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+        buffers_[i] = UNKNOWN;
+    }
+    activeUnit_ = cullFace_ = program_ = vertexArray_ = UNKNOWN;
+}
+
+int GLState::capIndex(GLenum cap) {
+    switch (cap) {
+    case GL_DEPTH_TEST: return CAP_DEPTH_TEST;
+    case GL_CULL_FACE: return CAP_CULL_FACE;
+    case GL_SCISSOR_TEST: return CAP_SCISSOR_TEST;
+    case GL_CLIP_DISTANCE0: return CAP_CLIP_DISTANCE0;
+    default: return -1;
+    }
+}
+
+int GLState::textureTargetIndex(GLenum target) {
+    switch (target) {
+    case GL_TEXTURE_2D: return TEXTURE_TARGET_2D;
+    case GL_TEXTURE_2D_ARRAY: return TEXTURE_TARGET_2D_ARRAY;
+    case GL_TEXTURE_CUBE_MAP: return TEXTURE_TARGET_CUBE_MAP;
+    default: return -1;
+    }
+}
+
+int GLState::bufferIndex(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER: return BUFFER_ARRAY;
+    case GL_ELEMENT_ARRAY_BUFFER: return BUFFER_ELEMENT_ARRAY;
+    case GL_DRAW_INDIRECT_BUFFER: return BUFFER_DRAW_INDIRECT;
+    default: return -1;
+    }
+}
+
+/**
+  Counts a call that sets current to value, returns whether it has to be
+  made
+  **/
+bool GLState::changed(int &current, int value) {
+    if (current == value) {
+        skipped_++;
+        return false;
+    }
+    current = value;
+    changes_++;
+    return true;
+}
+
+void GLState::setEnabled(GLenum cap, bool enabled) {
+    int i = capIndex(cap);
+    if (i == -1) {
+        changes_++;
+    } else if (!changed(caps_[i], enabled)) {
+        return;
+    }
+    if (enabled) {
+        glEnable(cap);
+    } else {
+        glDisable(cap);
+    }
+}
+
+void GLState::enable(GLenum cap) {
+    setEnabled(cap, true);
+}
+
+void GLState::disable(GLenum cap) {
+    setEnabled(cap, false);
+}
+
+void GLState::activeTexture(GLenum unit) {
+    int index = unit - GL_TEXTURE0;
+    if (index >= MAX_TEXTURE_UNITS) {
+        // Beyond the units cached, nothing is cached for it
+        activeUnit_ = UNKNOWN;
+        changes_++;
+        glActiveTexture(unit);
+    } else if (changed(activeUnit_, index)) {
+        glActiveTexture(unit);
+    }
+}
+
+void GLState::bindTexture(GLenum target, GLuint texture) {
+    int i = textureTargetIndex(target);
+    if (i == -1 || activeUnit_ == UNKNOWN) {
+        changes_++;
+        glBindTexture(target, texture);
+    } else if (changed(textures_[activeUnit_][i], texture)) {
+        glBindTexture(target, texture);
+    }
+}
+
+void GLState::cullFace(GLenum face) {
+    if (changed(cullFace_, face)) {
+        glCullFace(face);
+    }
+}
+
+void GLState::useProgram(GLuint program) {
+    if (changed(program_, program)) {
+        glUseProgram(program);
+    }
+}
+
+void GLState::bindBuffer(GLenum target, GLuint buffer) {
+    int i = bufferIndex(target);
+    if (i == -1) {
+        changes_++;
+        glBindBuffer(target, buffer);
+    } else if (changed(buffers_[i], buffer)) {
+        glBindBuffer(target, buffer);
+    }
+}
+
+/**
+  The element array binding belongs to the vertex array, so it isn't
+  known after switching to another one.
+  **/
+void GLState::bindVertexArray(GLuint array) {
+    if (changed(vertexArray_, array)) {
+        glBindVertexArray(array);
+        buffers_[BUFFER_ELEMENT_ARRAY] = UNKNOWN;
+    }
+}
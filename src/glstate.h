@@ -0,0 +1,84 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#define GL_GLEXT_LEGACY // no glext.h, we have our own
+#include <qgl.h>
+
+/**
+  A cache of the OpenGL state the passes change most: the capabilities
+  they enable and disable, the active texture unit and the textures bound
+  to each unit, the face culled, the program in use and the buffers
+  bound.  Setting any of these to what it already is makes no GL call.
+
+  Everything the engine and the terrain change while drawing goes through
+  one GLState, so it always knows the current state.  Whatever changes it
+  behind its back (Qt's text rendering, loading textures, compiling the
+  frame graph) has to be followed by invalidate(), after which the next
+  call for each piece of state is made whatever its value.
+
+  Capabilities and texture targets the cache doesn't know are passed
+  straight to GL, none of the fixed function state is cached.  The calls
+  made and those skipped are counted until resetCounts().
+  **/
+class GLState
+{
+public:
+    static const int MAX_TEXTURE_UNITS = 16;
+
+    GLState();
+
+    void invalidate();
+    void enable(GLenum cap);
+    void disable(GLenum cap);
+    void activeTexture(GLenum unit);
+    void bindTexture(GLenum target, GLuint texture);
+    void cullFace(GLenum face);
+    void useProgram(GLuint program);
+    void bindBuffer(GLenum target, GLuint buffer);
+    void bindVertexArray(GLuint array);
+
+    int getChanges() const { return changes_; }
+    int getSkipped() const { return skipped_; }
+    void resetCounts() { changes_ = skipped_ = 0; }
+
+private:
+    // Capabilities cached
+    enum Cap {
+        CAP_DEPTH_TEST,
+        CAP_CULL_FACE,
+        CAP_SCISSOR_TEST,
+        CAP_CLIP_DISTANCE0,
+        CAP_COUNT
+    };
+    enum TextureTarget {
+        TEXTURE_TARGET_2D,
+        TEXTURE_TARGET_2D_ARRAY,
+        TEXTURE_TARGET_CUBE_MAP,
+        TEXTURE_TARGET_COUNT
+    };
+    enum Buffer {
+        BUFFER_ARRAY,
+        BUFFER_ELEMENT_ARRAY, // the bound vertex array's
+        BUFFER_DRAW_INDIRECT,
+        BUFFER_COUNT
+    };
+    // An enable flag or binding that isn't known
+    static const int UNKNOWN = -1;
+
+    static int capIndex(GLenum cap);
+    static int textureTargetIndex(GLenum target);
+    static int bufferIndex(GLenum target);
+    void setEnabled(GLenum cap, bool enabled);
+    bool changed(int &current, int value);
+
+    int caps_[CAP_COUNT];
+    int textures_[MAX_TEXTURE_UNITS][TEXTURE_TARGET_COUNT];
+    int activeUnit_; // index, not GL_TEXTUREi
+    int cullFace_;
+    int program_;
+    int buffers_[BUFFER_COUNT];
+    int vertexArray_;
+    int changes_, skipped_;
+};
+
+#endif // GLSTATE_H
@@ -84,6 +84,50 @@ void GLWidget::render_text() {
     this->renderText(10.0, 20.0, "FPS: " + QString::number((int)(prev_fps_)), f);
     this->renderText(10.0, 30.0, "Focal Distance: " + QString::number((int)(draw_engine_->getCamera()->getFocalDistance())), f);
     this->renderText(10.0, 40.0, "Focal Range: " + QString::number((int)(draw_engine_->getCamera()->getFocalRange())), f);
-    this->renderText(10.0, 50.0, "Blur Size: " + QString::number((float) draw_engine_->getBlurSize(), 'g', 3), f);
+    this->renderText(10.0, 50.0, "Blur Size: " + QString::number((float) draw_engine_->getBlurSize(), 'g', 3) +
+                     (draw_engine_->getDofPyramid() ? ", quarter resolution" : ", full resolution") +
+                     (draw_engine_->isBlurComputed() ? ", compute" : ""), f);
+    this->renderText(10.0, 60.0, "Chunks: " + QString::number(draw_engine_->getTerrain()->getVisibleChunks()) +
+                     " drawn, " + QString::number(draw_engine_->getTerrain()->getOccludedChunks()) + " occluded", f);
+    const FrameGraph &graph = draw_engine_->getFrameGraph();
+    this->renderText(10.0, 70.0, "Targets: " + QString::number(graph.getPooledTextures()) + " textures, " +
+                     QString::number(graph.getAllocatedBytes() / (1024.0 * 1024.0), 'f', 1) + " MB, " +
+                     QString::number(graph.getCulledPasses()) + " passes culled", f);
+    QString updates = "every frame";
+    if (draw_engine_->getWaterUpdateMode() == WATER_UPDATE_EVERY_N_FRAMES) {
+        updates = "every " + QString::number(draw_engine_->getWaterUpdateInterval()) + " frames";
+    } else if (draw_engine_->getWaterUpdateMode() == WATER_UPDATE_INTERLEAVED) {
+        updates = "by interleaved rows";
+    }
+    QString reflection = (draw_engine_->getReflectionMode() == REFLECTION_SCREEN_SPACE ? "screen space " : "") +
+                         QString::number(draw_engine_->getReflectionScale()) + "x";
+    QString refraction = draw_engine_->getRefractionFromScene() ? QString("scene copy") :
+                         QString::number(draw_engine_->getRefractionScale()) + "x";
+    this->renderText(10.0, 80.0, "Reflection: " + reflection + ", Refraction: " + refraction +
+                     ", updated " + updates, f);
+    static const char *visibility[] = { "drawn", "skipped, off screen", "skipped, occluded" };
+    this->renderText(10.0, 90.0, QString("Water passes: ") + (draw_engine_->getWaterCulling() ?
+                     visibility[draw_engine_->getWaterVisibility()] : "always drawn") +
+                     (draw_engine_->isWaterLayered() ? ", layered" : ""), f);
+    this->renderText(10.0, 100.0, "Water pass fill: " +
+                     QString::number(draw_engine_->getWaterPassSamples() / 1000.0, 'f', 1) + "k samples, " +
+                     (draw_engine_->getWaterClipPlanes() ? "clipped" : "flattened") + " at sea level", f);
+    this->renderText(10.0, 110.0, "Quality: " + draw_engine_->getQualityPresetName() + ", terrain depth " +
+                     QString::number(draw_engine_->getQuality().terrainDepth) + ", skybox " +
+                     QString::number(draw_engine_->getQuality().skyboxSize), f);
+    this->renderText(10.0, 120.0, "Frame: " + QString::number(draw_engine_->getGpuFrameTime(), 'f', 1) + " ms GPU, " +
+                     QString::number(draw_engine_->getCpuFrameTime(), 'f', 1) + " ms CPU, " +
+                     (draw_engine_->getAutoQuality() ? "auto quality " + QString::number(draw_engine_->getQualityLevel()) +
+                      " steps down for " + QString::number(draw_engine_->getFrameBudget(), 'f', 1) + " ms" :
+                      QString("auto quality off")), f);
+    this->renderText(10.0, 130.0, "Render scale: " + QString::number(draw_engine_->getRenderScale(), 'f', 2) +
+                     (draw_engine_->getDynamicResolution() ? ", dynamic" : ", fixed"), f);
+    int stateChanges = 0, skippedStateChanges = 0;
+    for (int pass = 0; pass < PASS_COUNT; pass++) {
+        stateChanges += draw_engine_->getStateChanges((RenderPass)pass);
+        skippedStateChanges += draw_engine_->getSkippedStateChanges((RenderPass)pass);
+    }
+    this->renderText(10.0, 140.0, "GL state changes: " + QString::number(stateChanges) + ", " +
+                     QString::number(skippedStateChanges) + " redundant skipped", f);
     glColor3f(1.0f, 1.0f, 1.0f);
 }
@@ -0,0 +1,218 @@
+#include "occlusionculler.h"
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+OcclusionCuller::OcclusionCuller() {
+    // posix_memalign so the SSE loads and stores below can be aligned
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, 16, WIDTH * HEIGHT * sizeof(float)) != 0) {
+        buffer = NULL;
+    }
+    depth_ = (float *)buffer;
+    for (int i = 0; i < 16; i++) {
+        mvp_[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+    }
+}
+
+OcclusionCuller::~OcclusionCuller() {
+    free(depth_);
+}
+
+/**
+  Starts a new frame of occlusion culling with the given column-major
+  projection * modelview matrix.  Clears the depth buffer to far.
+  **/
+void OcclusionCuller::begin(const float *mvp) {
+    for (int i = 0; i < 16; i++) {
+        mvp_[i] = mvp[i];
+    }
+#ifdef __SSE2__
+    __m128 far = _mm_set1_ps(1.0f);
+    for (int i = 0; i < WIDTH * HEIGHT; i += 4) {
+        _mm_store_ps(depth_ + i, far);
+    }
+#else
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        depth_[i] = 1.0f;
+    }
+#endif
+}
+
+void OcclusionCuller::toClip(const float3 &p, float *out) const {
+    for (int row = 0; row < 4; row++) {
+        out[row] = mvp_[row] * p.x + mvp_[4 + row] * p.y + mvp_[8 + row] * p.z + mvp_[12 + row];
+    }
+}
+
+/**
+  Rasterizes a planar quad occluder.  The quad is clipped against the near
+  plane and split into triangles, either winding is accepted.
+  **/
+void OcclusionCuller::rasterizeQuad(const float3 &a, const float3 &b, const float3 &c, const float3 &d) {
+    float in[4][4];
+    toClip(a, in[0]);
+    toClip(b, in[1]);
+    toClip(c, in[2]);
+    toClip(d, in[3]);
+
+    // Sutherland-Hodgman against the near plane, z + w >= 0
+    float out[5][4];
+    int count = 0;
+    for (int i = 0; i < 4; i++) {
+        const float *p = in[i];
+        const float *q = in[(i + 1) % 4];
+        float dp = p[2] + p[3];
+        float dq = q[2] + q[3];
+        if (dp >= 0) {
+            for (int k = 0; k < 4; k++) out[count][k] = p[k];
+            count++;
+        }
+        if ((dp >= 0) != (dq >= 0)) {
+            float t = dp / (dp - dq);
+            for (int k = 0; k < 4; k++) out[count][k] = p[k] + (q[k] - p[k]) * t;
+            count++;
+        }
+    }
+    if (count < 3) {
+        return;
+    }
+
+    ScreenVertex screen[5];
+    for (int i = 0; i < count; i++) {
+        float w = MAX(out[i][3], 1e-6f);
+        float invW = 1.0f / w;
+        screen[i].x = (out[i][0] * invW * 0.5f + 0.5f) * WIDTH;
+        screen[i].y = (out[i][1] * invW * 0.5f + 0.5f) * HEIGHT;
+        screen[i].z = out[i][2] * invW * 0.5f + 0.5f;
+    }
+    for (int i = 1; i < count - 1; i++) {
+        rasterizeTriangle(screen[0], screen[i], screen[i + 1]);
+    }
+}
+
+void OcclusionCuller::rasterizeTriangle(const ScreenVertex &v0, const ScreenVertex &v1, const ScreenVertex &v2) {
+    float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+    if (fabs(area) < 1e-8f) {
+        return;
+    }
+    // Flip back-facing triangles so the edge functions are positive inside
+    const ScreenVertex &a = v0;
+    const ScreenVertex &b = area > 0 ? v1 : v2;
+    const ScreenVertex &c = area > 0 ? v2 : v1;
+    area = fabs(area);
+
+    int minX = MAX(0, (int)floor(MIN(a.x, MIN(b.x, c.x))));
+    int maxX = MIN(WIDTH - 1, (int)ceil(MAX(a.x, MAX(b.x, c.x))));
+    int minY = MAX(0, (int)floor(MIN(a.y, MIN(b.y, c.y))));
+    int maxY = MIN(HEIGHT - 1, (int)ceil(MAX(a.y, MAX(b.y, c.y))));
+    if (minX > maxX || minY > maxY) {
+        return;
+    }
+
+    // Edge function e_i(x, y) = A_i x + B_i y + C_i, opposite vertex i
+    float A0 = b.y - c.y, B0 = c.x - b.x, C0 = b.x * c.y - b.y * c.x;
+    float A1 = c.y - a.y, B1 = a.x - c.x, C1 = c.x * a.y - c.y * a.x;
+    float A2 = a.y - b.y, B2 = b.x - a.x, C2 = a.x * b.y - a.y * b.x;
+    // Depth interpolated in screen space from normalized barycentrics
+    float invArea = 1.0f / area;
+    float z0 = a.z * invArea, z1 = b.z * invArea, z2 = c.z * invArea;
+
+    minX &= ~3;
+#ifdef __SSE2__
+    __m128 zero = _mm_setzero_ps();
+    __m128 lane = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    for (int y = minY; y <= maxY; y++) {
+        float py = y + 0.5f;
+        float *row = depth_ + y * WIDTH;
+        for (int x = minX; x <= maxX; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane);
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A0), px), _mm_set1_ps(B0 * py + C0));
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A1), px), _mm_set1_ps(B1 * py + C1));
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A2), px), _mm_set1_ps(B2 * py + C2));
+            __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero),
+                                       _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+            if (_mm_movemask_ps(inside) == 0) {
+                continue;
+            }
+            __m128 z = _mm_add_ps(_mm_mul_ps(e0, _mm_set1_ps(z0)),
+                                  _mm_add_ps(_mm_mul_ps(e1, _mm_set1_ps(z1)), _mm_mul_ps(e2, _mm_set1_ps(z2))));
+            __m128 old = _mm_load_ps(row + x);
+            __m128 nearer = _mm_min_ps(old, z);
+            _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+        }
+    }
+#else
+    for (int y = minY; y <= maxY; y++) {
+        float py = y + 0.5f;
+        float *row = depth_ + y * WIDTH;
+        for (int x = minX; x <= maxX; x++) {
+            float px = x + 0.5f;
+            float e0 = A0 * px + B0 * py + C0;
+            float e1 = A1 * px + B1 * py + C1;
+            float e2 = A2 * px + B2 * py + C2;
+            if (e0 >= 0 && e1 >= 0 && e2 >= 0) {
+                float z = e0 * z0 + e1 * z1 + e2 * z2;
+                row[x] = MIN(row[x], z);
+            }
+        }
+    }
+#endif
+}
+
+/**
+  Returns true if any part of the box may be in front of the occluders
+  drawn so far.  Boxes reaching behind the near plane count as visible.
+  **/
+bool OcclusionCuller::isBoxVisible(const float3 &mn, const float3 &mx) const {
+    float minX = WIDTH, maxX = -1, minY = HEIGHT, maxY = -1, minZ = 1.0f;
+    for (int i = 0; i < 8; i++) {
+        float3 corner((i & 1) ? mx.x : mn.x, (i & 2) ? mx.y : mn.y, (i & 4) ? mx.z : mn.z);
+        float clip[4];
+        toClip(corner, clip);
+        if (clip[2] + clip[3] <= 0 || clip[3] <= 1e-6f) {
+            return true;
+        }
+        float invW = 1.0f / clip[3];
+        float x = (clip[0] * invW * 0.5f + 0.5f) * WIDTH;
+        float y = (clip[1] * invW * 0.5f + 0.5f) * HEIGHT;
+        minX = MIN(minX, x);
+        maxX = MAX(maxX, x);
+        minY = MIN(minY, y);
+        maxY = MAX(maxY, y);
+        minZ = MIN(minZ, clip[2] * invW * 0.5f + 0.5f);
+    }
+
+    // Grow the rectangle by a pixel to cover partially covered pixels
+    int x0 = MAX(0, (int)floor(minX) - 1);
+    int x1 = MIN(WIDTH - 1, (int)ceil(maxX) + 1);
+    int y0 = MAX(0, (int)floor(minY) - 1);
+    int y1 = MIN(HEIGHT - 1, (int)ceil(maxY) + 1);
+    if (x0 > x1 || y0 > y1) {
+        return false;
+    }
+
+    x0 &= ~3;
+#ifdef __SSE2__
+    __m128 boxZ = _mm_set1_ps(minZ);
+    for (int y = y0; y <= y1; y++) {
+        const float *row = depth_ + y * WIDTH;
+        for (int x = x0; x <= x1; x += 4) {
+            if (_mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(row + x), boxZ)) != 0) {
+                return true;
+            }
+        }
+    }
+#else
+    for (int y = y0; y <= y1; y++) {
+        const float *row = depth_ + y * WIDTH;
+        for (int x = x0; x <= x1; x++) {
+            if (row[x] > minZ) {
+                return true;
+            }
+        }
+    }
+#endif
+    return false;
+}
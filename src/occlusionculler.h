@@ -0,0 +1,41 @@
+#ifndef OCCLUSIONCULLER_H
+#define OCCLUSIONCULLER_H
+
+#include "common.h"
+
+/**
+  A small software depth buffer for culling on the CPU.  Occluders are
+  rasterized with their real depth, which must lie inside solid geometry
+  so that anything behind them is really hidden.  Boxes are then tested
+  against the buffer using the nearest depth of their corners.
+
+  Geometry is given in object space and transformed by the column-major
+  projection * modelview matrix passed to begin().
+  **/
+class OcclusionCuller
+{
+public:
+    // Multiples of 4 so rows can be walked four pixels at a time
+    static const int WIDTH = 256;
+    static const int HEIGHT = 128;
+
+    OcclusionCuller();
+    ~OcclusionCuller();
+
+    void begin(const float *mvp);
+    void rasterizeQuad(const float3 &a, const float3 &b, const float3 &c, const float3 &d);
+    bool isBoxVisible(const float3 &mn, const float3 &mx) const;
+
+private:
+    struct ScreenVertex {
+        float x, y, z;
+    };
+
+    void toClip(const float3 &p, float *out) const;
+    void rasterizeTriangle(const ScreenVertex &v0, const ScreenVertex &v1, const ScreenVertex &v2);
+
+    float mvp_[16];
+    float *depth_; // WIDTH * HEIGHT, 16-byte aligned, 0 = near, 1 = far
+};
+
+#endif // OCCLUSIONCULLER_H
@@ -0,0 +1,128 @@
+#ifndef SHADERIDS_H
+#define SHADERIDS_H
+
+// The ids DrawEngine looks its shader programs and their uniforms up by,
+// and the tables the ids index.  Nothing here needs Qt or GL, so
+// tools/uniformcheck checks the tables against the shaders offline.
+
+#include <stddef.h>
+
+// Post processing steps fused into the pass that draws to the screen
+enum PostStep {
+    POST_BLUR_Y = 1,    // blur the X-blurred scene along Y
+    POST_COMPOSITE = 2, // blend the scene with its blurred copy by its blur
+    POST_DEPTHMAP = 4,  // show the blur amounts instead
+    POST_STEP_COMBINATIONS = 8
+};
+
+// Shader programs, see DrawEngine::load_shaders
+enum ShaderProgramId {
+    PROGRAM_TERRAIN,
+    PROGRAM_TERRAIN_LAYERED,
+    PROGRAM_SKYBOX,
+    PROGRAM_SKYBOX_LAYERED,
+    PROGRAM_WATER,
+    PROGRAM_WATER_LAYERED,
+    PROGRAM_HIZ,
+    PROGRAM_SSR,
+    PROGRAM_DOF_DOWN,
+    PROGRAM_BLUR_X,
+    PROGRAM_POST, // PROGRAM_POST + PostStep flags, for the combinations used
+    PROGRAM_COUNT = PROGRAM_POST + POST_STEP_COMBINATIONS
+};
+
+// Uniforms the engine sets, their locations are looked up in every
+// program once it is linked.  Terrain sets its own, see
+// Terrain::getUniformLocations.
+enum ShaderUniform {
+    UNIFORM_IS_REFLECTION,
+    UNIFORM_LAYER_MODELVIEW,
+    UNIFORM_SKYBOX,
+    UNIFORM_SKYBOX_VIEW,
+    UNIFORM_SOURCE,
+    UNIFORM_SOURCE_SIZE,
+    UNIFORM_REDUCE,
+    UNIFORM_SCENE,
+    UNIFORM_DEPTH_PYRAMID,
+    UNIFORM_PYRAMID_LEVELS,
+    UNIFORM_VIEW_SIZE,
+    UNIFORM_MAX_STEPS,
+    UNIFORM_MAX_DISTANCE,
+    UNIFORM_THICKNESS,
+    UNIFORM_WATER_LAYERS,
+    UNIFORM_REFLECTION,
+    UNIFORM_REFRACTION,
+    UNIFORM_BUMP_MAP,
+    UNIFORM_SCENE_DEPTH,
+    UNIFORM_SCENE_DEPTH_TEXEL,
+    UNIFORM_REFLECTION_SIZE,
+    UNIFORM_REFRACTION_SIZE,
+    UNIFORM_REFLECTION_VIEW,
+    UNIFORM_REFRACTION_VIEW,
+    UNIFORM_REFLECTION_INTERLEAVED,
+    UNIFORM_REFRACTION_INTERLEAVED,
+    UNIFORM_REFRACTION_FADE,
+    UNIFORM_REFLECTION_MATRIX,
+    UNIFORM_REFRACTION_MATRIX,
+    UNIFORM_OFFSET_X,
+    UNIFORM_OFFSET_Y,
+    UNIFORM_TEX0,
+    UNIFORM_TEXEL_SIZE,
+    UNIFORM_WIDTH,
+    UNIFORM_VIEW_MAX,
+    UNIFORM_DEPTH_BLUR,
+    UNIFORM_BLURRED,
+    UNIFORM_HALFRES,
+    UNIFORM_PYRAMID,
+    UNIFORM_BLUR_HEIGHT,
+    UNIFORM_VIEW_SCALE,
+    UNIFORM_RESULT,
+    UNIFORM_RADIUS,
+    UNIFORM_KERNEL,
+    UNIFORM_COUNT
+};
+
+// Names of the ShaderUniform uniforms in the shaders, in enum order
+static const char *const UNIFORM_NAMES[] = {
+    "isReflection", "layerModelview", "skybox", "skyboxView", "source", "sourceSize", "reduce",
+    "scene", "depthPyramid", "pyramidLevels", "viewSize", "maxSteps", "maxDistance", "thickness",
+    "waterLayers", "reflection", "refraction", "bumpMap", "sceneDepth",
+    "sceneDepthTexel", "reflectionSize", "refractionSize",
+    "reflectionView", "refractionView", "reflectionInterleaved", "refractionInterleaved",
+    "refractionFade", "reflectionMatrix", "refractionMatrix", "offsetX", "offsetY",
+    "Tex0", "TexelSize", "Width", "ViewMax", "depthBlur",
+    "blurred", "halfres", "pyramid", "blurHeight", "viewScale", "result", "radius", "kernel"
+};
+
+// Source files of each program's stages, relative to the working
+// directory, NULL for the stages it hasn't got.  Every post processing
+// combination is built from PROGRAM_POST's, and the layered water from
+// the water's with LAYERED_WATER defined.
+struct ShaderSources {
+    const char *vertex;
+    const char *geometry;
+    const char *fragment;
+};
+
+static const ShaderSources PROGRAM_SOURCES[] = {
+    { "shaders/terrain.vert", NULL, "shaders/terrain.frag" },
+    { "shaders/terrain_layered.vert", "shaders/terrain_layered.geom", "shaders/terrain.frag" },
+    { "shaders/skybox.vert", NULL, "shaders/skybox.frag" },
+    { "shaders/skybox_layered.vert", "shaders/skybox_layered.geom", "shaders/skybox_layered.frag" },
+    { "shaders/water.vert", NULL, "shaders/water.frag" },
+    { "shaders/water.vert", NULL, "shaders/water.frag" },
+    { "shaders/hiz.vert", NULL, "shaders/hiz.frag" },
+    { "shaders/ssr.vert", NULL, "shaders/ssr.frag" },
+    { "shaders/dofdown.vert", NULL, "shaders/dofdown.frag" },
+    { "shaders/blurx.vert", NULL, "shaders/blurx.frag" },
+    { "shaders/post.vert", NULL, "shaders/post.frag" }
+};
+
+// The combinations of post processing steps a program is built for
+static const int POST_PROGRAM_STEPS[] = { 0, POST_DEPTHMAP, POST_COMPOSITE, POST_BLUR_Y | POST_COMPOSITE };
+
+// The depth of field blur's compute shader, looked up with the same
+// ShaderUniform ids
+static const char *const COMPUTE_BLUR_SOURCE = "shaders/blur.comp";
+
+#endif // SHADERIDS_H
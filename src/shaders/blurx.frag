@@ -1,6 +1,31 @@
-varying vec2 Tap[4], TapNeg[3];
+#version 150
+in vec2 Tap[4], TapNeg[3];
+out vec4 fragColor;
 uniform sampler2D Tex0;
 uniform float Width;
+uniform vec2 ViewMax; // last texel center drawn in Tex0
+
+// The scene has no blur stored in alpha, it comes from its depth
+uniform sampler2D sceneDepth;
+uniform float depthBlur; // 1.0 when Tex0 is the scene
+
+// The blur of the scene at uv, from its depth: how far its clip space
+// depth is from the focal plane, over the focal range
+float blurAt(vec2 uv){
+	float d = texture(sceneDepth, uv).r;
+	float ndc = d * 2.0 - 1.0;
+	float eyeDepth = 2.0 * nearPlane * farPlane / (farPlane + nearPlane - ndc * (farPlane - nearPlane));
+	return clamp(abs(-ndc * eyeDepth - focalDistance) / focalRange, 0.0, 1.0);
+}
+
+vec4 tap(vec2 uv){
+	uv = min(uv, ViewMax);
+	vec4 s = texture(Tex0, uv);
+	if (depthBlur == 1.0) {
+		s.a = blurAt(uv);
+	}
+	return s;
+}
 
 void main (void)
 {
@@ -27,13 +52,13 @@ void main (void)
 
 
 	// Sample taps with coordinates from VS
-	s[0] = texture2D(Tex0, Tap[0]);
-	s[1] = texture2D(Tex0, Tap[1]);
-	s[2] = texture2D(Tex0, Tap[2]);
-	s[3] = texture2D(Tex0, Tap[3]);
-	s[4] = texture2D(Tex0, TapNeg[0]);
-	s[5] = texture2D(Tex0, TapNeg[1]);
-	s[6] = texture2D(Tex0, TapNeg[2]);
+	s[0] = tap(Tap[0]);
+	s[1] = tap(Tap[1]);
+	s[2] = tap(Tap[2]);
+	s[3] = tap(Tap[3]);
+	s[4] = tap(TapNeg[0]);
+	s[5] = tap(TapNeg[1]);
+	s[6] = tap(TapNeg[2]);
 
 	// Compute weights for 4 first samples (including center tap)
 	// by thresholding blurriness (in sample alpha)
@@ -68,12 +93,12 @@ void main (void)
 	TapNeg4[2] = Tap[0] - horzTapOffs[6];
 
 	// Sample the taps
-	s[0] = texture2D(Tex0, Tap4[0]);
-	s[1] = texture2D(Tex0, Tap4[1]);
-	s[2] = texture2D(Tex0, Tap4[2]);
-	s[3] = texture2D(Tex0, TapNeg4[0]);
-	s[4] = texture2D(Tex0, TapNeg4[1]);
-	s[5] = texture2D(Tex0, TapNeg4[2]);
+	s[0] = tap(Tap4[0]);
+	s[1] = tap(Tap4[1]);
+	s[2] = tap(Tap4[2]);
+	s[3] = tap(TapNeg4[0]);
+	s[4] = tap(TapNeg4[1]);
+	s[5] = tap(TapNeg4[2]);
 
 	// Compute weights for 3 samples
 	Weights3.x = clamp(s[0].a - Thresh1.x, 0.0, 1.0);
@@ -101,5 +126,5 @@ void main (void)
 	ColorSum /= WeightSum;
 
 	// Color and weights sum output
-	gl_FragData[0] = vec4(ColorSum, WeightSum);
+	fragColor = vec4(ColorSum, WeightSum);
 }
@@ -1,10 +1,15 @@
-varying vec2 Tap[4], TapNeg[3];
+#version 150
+// A triangle covering the viewport, see post.vert, its texture coordinates
+// scaled to the part of the level read that was drawn
+out vec2 Tap[4], TapNeg[3];
 uniform float Width;
+uniform vec2 viewScale;
 
 void main(void)
 {
 	vec2 horzTapOffs[7];
-	vec2 TexCoord = gl_MultiTexCoord0.st;
+	vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	vec2 TexCoord = corner * viewScale;
 
         float dx = 1.0 / Width;
 	horzTapOffs[0] = vec2(0.0, 0.0);
@@ -24,6 +29,5 @@ void main(void)
 	TapNeg[1] = TexCoord - horzTapOffs[2];
 	TapNeg[2] = TexCoord - horzTapOffs[3];
 
-	gl_Position = ftransform();
-	gl_TexCoord[0] = gl_MultiTexCoord0;
+	gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
 }
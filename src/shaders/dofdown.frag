@@ -0,0 +1,50 @@
+#version 150
+// Halves the scene for the depth of field pyramid.  The four texels under
+// each output texel are averaged weighted by their blur (in alpha), so
+// sharp pixels don't bleed into the blurred levels around them.  The
+// scene itself has no blur stored, it comes from the scene's depth.
+uniform sampler2D Tex0;
+uniform vec2 TexelSize; // of the level read
+uniform vec2 ViewMax;   // last texel center drawn in the level read
+uniform sampler2D sceneDepth;
+uniform float depthBlur; // 1.0 when Tex0 is the scene
+
+in vec2 texCoord;
+out vec4 fragColor;
+
+// The blur of the scene at uv, from its depth: how far its clip space
+// depth is from the focal plane, over the focal range
+float blurAt(vec2 uv){
+    float d = texture(sceneDepth, uv).r;
+    float ndc = d * 2.0 - 1.0;
+    float eyeDepth = 2.0 * nearPlane * farPlane / (farPlane + nearPlane - ndc * (farPlane - nearPlane));
+    return clamp(abs(-ndc * eyeDepth - focalDistance) / focalRange, 0.0, 1.0);
+}
+
+vec4 tap(vec2 uv){
+    uv = min(uv, ViewMax);
+    vec4 s = texture(Tex0, uv);
+    if (depthBlur == 1.0) {
+        s.a = blurAt(uv);
+    }
+    return s;
+}
+
+void main (void)
+{
+	vec2 TexCoord = texCoord;
+	vec2 d = 0.5 * TexelSize;
+
+	// Each tap lands on one texel's center
+	vec4 s0 = tap(TexCoord + vec2(-d.x, -d.y));
+	vec4 s1 = tap(TexCoord + vec2( d.x, -d.y));
+	vec4 s2 = tap(TexCoord + vec2(-d.x,  d.y));
+	vec4 s3 = tap(TexCoord + vec2( d.x,  d.y));
+
+	// A little weight for everything so fully sharp blocks still average
+	vec4 Weights = vec4(s0.a, s1.a, s2.a, s3.a) + 0.01;
+	vec3 ColorSum = s0.rgb * Weights.x + s1.rgb * Weights.y + s2.rgb * Weights.z + s3.rgb * Weights.w;
+	float WeightSum = dot(Weights, vec4(1.0));
+
+	fragColor = vec4(ColorSum / WeightSum, dot(vec4(s0.a, s1.a, s2.a, s3.a), vec4(0.25)));
+}
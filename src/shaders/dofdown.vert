@@ -0,0 +1,12 @@
+#version 150
+// A triangle covering the viewport, see post.vert, its texture coordinates
+// scaled to the part of the level read that was drawn
+uniform vec2 viewScale;
+out vec2 texCoord;
+
+void main(void)
+{
+	vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+	texCoord = corner * viewScale;
+}
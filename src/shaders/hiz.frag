@@ -0,0 +1,40 @@
+#version 150
+// Builds one level of the depth pyramid: level 0 copies the scene's depth,
+// every other level keeps the nearest depth of the 2x2 texels below it.
+// The level below is the only one visible in source when reducing.
+uniform sampler2D source;
+uniform float reduce;
+uniform ivec2 sourceSize; // part of the level below drawn this frame
+out vec4 fragColor;
+
+// a texel below, clamped for levels already a single texel across
+float fetch(ivec2 q){
+    return texelFetch(source, min(q, sourceSize - 1), 0).r;
+}
+
+void main(){
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    if (reduce < 0.5) {
+        fragColor = vec4(texelFetch(source, p, 0).r);
+        return;
+    }
+    ivec2 size = sourceSize;
+    ivec2 q = p * 2;
+    float z = min(min(fetch(q), fetch(q + ivec2(1, 0))),
+                  min(fetch(q + ivec2(0, 1)), fetch(q + ivec2(1, 1))));
+
+    // An odd row or column below has no level of its own, the last texel
+    // takes it in so nothing is missed
+    bool oddX = q.x + 2 == size.x - 1;
+    bool oddY = q.y + 2 == size.y - 1;
+    if (oddX) {
+        z = min(z, min(fetch(q + ivec2(2, 0)), fetch(q + ivec2(2, 1))));
+    }
+    if (oddY) {
+        z = min(z, min(fetch(q + ivec2(0, 2)), fetch(q + ivec2(1, 2))));
+    }
+    if (oddX && oddY) {
+        z = min(z, fetch(q + ivec2(2, 2)));
+    }
+    fragColor = vec4(z);
+}
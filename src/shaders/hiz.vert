@@ -0,0 +1,6 @@
+#version 150
+// Draws a triangle over the pyramid level being built, see post.vert
+void main(){
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,79 @@
+#version 150
+// The pass that draws the frame to the screen, with the post processing
+// steps it is built with fused into it.  DrawEngine::load_shaders defines
+// a combination of:
+//   BLUR_Y     blur the X-blurred scene along Y here, as blury.frag did
+//   COMPOSITE  blend the scene with its blurred copy by its blur, as
+//              lerp.frag did
+//   DEPTHMAP   show the blur amounts instead
+// With none of them the scene is just copied.
+in vec2 texCoord;
+out vec4 fragColor;
+
+uniform sampler2D scene;
+uniform sampler2D blurred;   // along X only with BLUR_Y
+uniform sampler2D halfres;   // half level of the blur pyramid
+uniform float pyramid;       // 1.0 when blurred is the quarter level
+uniform float blurHeight;    // texels per screen height of the blur's taps
+uniform vec2 viewScale;      // part of the targets drawn, the render scale
+uniform sampler2D sceneDepth;
+
+// uv scaled to the part of a target drawn, and kept half a texel inside
+// it so filtering doesn't reach what wasn't
+vec2 viewUv(sampler2D image, vec2 uv) {
+    return min(uv * viewScale, viewScale - 0.5 / vec2(textureSize(image, 0)));
+}
+
+// The blur of the scene at uv, from its depth: how far its clip space
+// depth is from the focal plane, over the focal range
+float blurAt(vec2 uv) {
+    float ndc = texture(sceneDepth, uv).r * 2.0 - 1.0;
+    float eyeDepth = 2.0 * nearPlane * farPlane / (farPlane + nearPlane - ndc * (farPlane - nearPlane));
+    return clamp(abs(-ndc * eyeDepth - focalDistance) / focalRange, 0.0, 1.0);
+}
+
+#ifdef BLUR_Y
+// Tap offsets in texels, and their weights, the center's first
+const float tapOffsets[7] = float[7](0.0, 1.3366, 3.4295, 5.4264, 7.4359, 9.4436, 11.4401);
+const float tapWeights[7] = float[7](0.100, 0.080, 0.075, 0.070, 0.065, 0.060, 0.055);
+
+// Each sample is weighted by the weight the X blur left in its alpha
+vec4 blurY(vec2 uv) {
+    vec2 uvMax = viewUv(blurred, vec2(1.0));
+    vec4 s = texture(blurred, uv);
+    vec4 sum = vec4(s.rgb * s.a, s.a) * tapWeights[0];
+    for (int i = 1; i < 7; i++) {
+        vec2 offset = vec2(0.0, tapOffsets[i] / blurHeight);
+        vec4 a = texture(blurred, min(uv + offset, uvMax)), b = texture(blurred, uv - offset);
+        sum += (vec4(a.rgb * a.a, a.a) + vec4(b.rgb * b.a, b.a)) * tapWeights[i];
+    }
+    return vec4(sum.rgb / sum.a, sum.a);
+}
+#endif
+
+void main(){
+    vec2 uv = viewUv(scene, texCoord);
+    vec4 fullres = texture(scene, uv);
+#if defined(DEPTHMAP) || defined(COMPOSITE)
+    fullres.a = blurAt(uv);
+#endif
+#if defined(DEPTHMAP)
+    fragColor = vec4(vec3(fullres.a), 1.0);
+#elif defined(COMPOSITE)
+#ifdef BLUR_Y
+    vec4 blur = blurY(viewUv(blurred, texCoord));
+#else
+    vec4 blur = texture(blurred, viewUv(blurred, texCoord));
+#endif
+    if (pyramid == 1.0) {
+        // Little blur comes from the half level, more from the blurred
+        // quarter one
+        vec4 sharp = mix(fullres, texture(halfres, viewUv(halfres, texCoord)), clamp(fullres.a * 2.0, 0.0, 1.0));
+        fragColor = mix(sharp, blur, clamp(fullres.a * 2.0 - 1.0, 0.0, 1.0));
+    } else {
+        fragColor = mix(fullres, blur, fullres.a);
+    }
+#else
+    fragColor = fullres;
+#endif
+}
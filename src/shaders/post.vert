@@ -0,0 +1,9 @@
+#version 150
+// A triangle covering the whole screen, made from gl_VertexID alone so it
+// is drawn without any vertex arrays
+out vec2 texCoord;
+
+void main(){
+    texCoord = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(texCoord * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,11 @@
+#version 150
+uniform samplerCube skybox;
+in vec3 cubeCoord;
+out vec4 fragColor;
+
+void main(){
+    if (waterRows != 0 && int(gl_FragCoord.y) % 2 != waterRows - 1) {
+        discard;
+    }
+    fragColor = texture(skybox, cubeCoord);
+}
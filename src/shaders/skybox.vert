@@ -0,0 +1,10 @@
+#version 150
+// The skybox cube, its vertices are also the directions the cube map is
+// looked up in
+in vec4 vertex;
+out vec3 cubeCoord;
+
+void main(){
+    cubeCoord = vertex.xyz;
+    gl_Position = projection * (modelview * vertex);
+}
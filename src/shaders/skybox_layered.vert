@@ -0,0 +1,9 @@
+#version 150
+// The skybox for the layered water pass, transformed by the geometry shader
+in vec4 vertex;
+out vec3 vertexCubeCoord;
+
+void main(){
+    vertexCubeCoord = vertex.xyz;
+    gl_Position = vertex;
+}
@@ -0,0 +1,109 @@
+#version 150
+// Screen space reflection of the water.  The reflected eye ray is marched
+// through a pyramid of the opaque scene's nearest depths, taking big steps
+// across empty space and small ones near geometry.  Where it hits, the
+// scene copy is reflected, where it misses or leaves the screen, the
+// skybox is.
+uniform sampler2D scene;        // copy of the opaque scene
+uniform sampler2D depthPyramid; // nearest depth of the scene, level 0 at full size
+uniform vec2 viewSize;          // part of level 0 and of the scene drawn this frame
+uniform samplerCube skybox;
+uniform mat4 skyboxView;        // the camera's modelview, which the skybox is drawn with
+uniform int pyramidLevels;
+uniform int maxSteps;
+uniform float maxDistance;      // eye space length of the marched ray
+uniform float thickness;        // eye space depth behind the scene still counted as a hit
+
+in vec3 position;
+in vec3 normal;
+out vec4 fragColor;
+
+// eye space distance of a depth buffer value
+float linearDepth(float z){
+    float ndc = z * 2.0 - 1.0;
+    return 2.0 * nearPlane * farPlane / (farPlane + nearPlane - ndc * (farPlane - nearPlane));
+}
+
+// window position in level 0 texels, and depth buffer value
+vec3 toWindow(vec3 p, vec2 size){
+    vec4 clip = projection * vec4(p, 1.0);
+    vec3 ndc = clip.xyz / clip.w;
+    return vec3((ndc.xy * 0.5 + 0.5) * size, ndc.z * 0.5 + 0.5);
+}
+
+void main(){
+    if (waterRows != 0 && int(gl_FragCoord.y) % 2 != waterRows - 1) {
+        discard;
+    }
+    vec3 R = reflect(normalize(position), normalize(normal));
+    vec4 sky = texture(skybox, transpose(mat3(skyboxView)) * R);
+
+    // Stop the ray before it goes behind the camera
+    float rayLength = maxDistance;
+    if (R.z > 0.0) {
+        rayLength = min(rayLength, 0.99 * (-nearPlane - position.z) / R.z);
+    }
+    vec2 size = viewSize;
+    vec3 start = toWindow(position, size);
+    vec3 d = toWindow(position + R * rayLength, size) - start;
+    float span = max(abs(d.x), abs(d.y));
+    if (span < 1.0) {
+        fragColor = sky;
+        return;
+    }
+    // keep the cell boundary math finite for axis aligned rays
+    d.x = abs(d.x) < 1e-4 ? 1e-4 : d.x;
+    d.y = abs(d.y) < 1e-4 ? 1e-4 : d.y;
+    float nudge = 0.01 / span;
+
+    // Start a texel away so the water's own pixel isn't hit
+    float t = 1.0 / span;
+    int level = 0;
+    bool hit = false;
+    vec3 p = start;
+    for (int i = 0; i < maxSteps && t <= 1.0; i++) {
+        p = start + d * t;
+        if (p.x < 0.0 || p.y < 0.0 || p.x >= size.x || p.y >= size.y) {
+            break;
+        }
+        float cellSize = exp2(float(level));
+        vec2 cell = min(floor(p.xy / cellSize), vec2(max(ivec2(viewSize) >> level, 1) - 1));
+        float nearest = texelFetch(depthPyramid, ivec2(cell), level).r;
+
+        // where the ray leaves the cell
+        vec2 boundary = (cell + step(0.0, d.xy)) * cellSize;
+        vec2 tCell = (boundary - start.xy) / d.xy;
+        float tExit = min(tCell.x, tCell.y) + nudge;
+
+        if (p.z < nearest) {
+            // In front of everything in the cell, skip to where the ray
+            // reaches the nearest depth or leaves the cell
+            float tDepth = d.z > 0.0 ? (nearest - start.z) / d.z : 2.0;
+            if (tDepth < tExit) {
+                t = max(t, tDepth);
+                level = max(level - 1, 0);
+            } else {
+                t = tExit;
+                level = min(level + 1, pyramidLevels - 1);
+            }
+        } else if (level > 0) {
+            level--;
+        } else if (linearDepth(p.z) - linearDepth(nearest) < thickness) {
+            hit = true;
+            break;
+        } else {
+            // passed behind something thin, keep going past it
+            t = tExit;
+        }
+    }
+    if (!hit) {
+        fragColor = sky;
+        return;
+    }
+
+    // Fade to the skybox near the screen's edges and the ray's end, where
+    // the march gives out
+    vec2 edge = min(p.xy, size - p.xy) / (0.1 * size);
+    float fade = clamp(min(edge.x, edge.y), 0.0, 1.0) * (1.0 - t * t);
+    fragColor = mix(sky, texelFetch(scene, ivec2(p.xy), 0), fade);
+}
@@ -0,0 +1,13 @@
+#version 150
+// the water in eye space, its reflection is marched from here
+in vec4 vertex;
+out vec3 position;
+out vec3 normal;
+
+void main(){
+    vec4 eye = modelview * vertex;
+    position = eye.xyz;
+    // the water is flat
+    normal = normalMatrix * vec3(0.0, 0.0, 1.0);
+    gl_Position = projection * eye;
+}
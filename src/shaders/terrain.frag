@@ -1,3 +1,4 @@
+#version 150
 //uniform variables
 uniform samplerCube CubeMap;
 
@@ -16,20 +17,22 @@ uniform float region3Min;
 uniform float region4Min;
 
 //varying variables
-varying float intensity;
-varying float height;
-varying float blur;
+in float intensity;
+in float height;
+in vec2 texCoord;
 
-varying vec4 V; //vertex
-varying vec4 E; //eye
-varying vec3 N; //surface normal
+out vec4 fragColor;
 
 void main(){
+    if (waterRows != 0 && int(gl_FragCoord.y) % 2 != waterRows - 1) {
+        discard;
+    }
+
     //get the colors
-    vec4 color_1 = texture2D(region1ColorMap, gl_TexCoord[0].st);
-    vec4 color_2 = texture2D(region2ColorMap, gl_TexCoord[0].st);
-    vec4 color_3 = texture2D(region3ColorMap, gl_TexCoord[0].st);
-    vec4 color_4 = texture2D(region4ColorMap, gl_TexCoord[0].st);
+    vec4 color_1 = texture(region1ColorMap, texCoord);
+    vec4 color_2 = texture(region2ColorMap, texCoord);
+    vec4 color_3 = texture(region3ColorMap, texCoord);
+    vec4 color_4 = texture(region4ColorMap, texCoord);
     
     //get the region weights
     float region1Range = region1Max - region1Min;
@@ -44,6 +47,5 @@ void main(){
     
     vec4 totalColor = (color_1 * region1Weight) + (color_2 * region2Weight) + (color_3 * region3Weight) + (color_4 * region4Weight);
     
-    gl_FragColor = totalColor * intensity;
-    gl_FragColor.a = blur;
+    fragColor = totalColor * intensity;
 }
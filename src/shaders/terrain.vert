@@ -1,3 +1,6 @@
+#version 150
+// The terrain, decoded from its packed vertices
+
 //uniform variables
 uniform samplerCube CubeMap;
 
@@ -14,55 +17,66 @@ uniform float region2Min;
 uniform float region3Min;
 uniform float region4Min;
 
-uniform float seaLevel;
 uniform float isReflection;
 
-//varying variables
-varying float intensity;
-varying float height;
-varying float blur;
-uniform float focalDistance, focalRange;
+// packed vertex decoding
+uniform vec2 gridOrigin;
+uniform vec2 gridSpacing;
+uniform vec2 heightRange; // min height, height per quantization step
+uniform vec2 texCoordScale; // texture repeats per world unit
 
-varying vec4 V; //vertex
-varying vec4 E; //eye
-varying vec3 N; //surface normal
+//attributes
+in vec4 gridPosition; // column, row, quantized height, unused
+in vec2 packedNormal; // octahedral-encoded normal
+
+//varying variables
+out float intensity;
+out float height;
+out vec2 texCoord;
 
 //constant
 const vec4 L = vec4(1.0, 1.0, 1.0, 0.0); //light direction
 
+vec3 decodeNormal(vec2 e){
+        vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+        if (n.z < 0.0) {
+            n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        }
+        return normalize(n);
+}
+
 void main(){
-        // get the tex coord
-	gl_TexCoord[0] = gl_MultiTexCoord0;
+        // rebuild the vertex from the grid
+        vec4 vertex = vec4(gridOrigin + gridPosition.xy * gridSpacing,
+                           heightRange.x + gridPosition.z * heightRange.y, 1.0);
+
+        // get the tex coord from the world position, tiled with GL_REPEAT
+        texCoord = (vertex.xy - gridOrigin) * texCoordScale;
 	
         // get the norm of the vertex
-	vec3 vertexNorm = gl_NormalMatrix * gl_Normal;
-        vec4 vertCopy = gl_Vertex;
+	vec3 vertexNorm = normalMatrix * decodeNormal(packedNormal);
+        vec4 vertCopy = vertex;
 
         // if a reflection, don't render below the sea level height
-        // this clips the reflection for us
+        // this clips the reflection for us, unless a clip plane does
         if (isReflection == 1.0) {
-            vertCopy.z = max(gl_Vertex.z, seaLevel);
+            vertCopy.z = max(vertex.z, seaLevel);
         } else if (isReflection == 2.0) {
             // if refraction, don't render about sea level
-            vertCopy.z = min(gl_Vertex.z, seaLevel);
+            vertCopy.z = min(vertex.z, seaLevel);
         }
 
-        V = gl_ModelViewMatrix * vertCopy;
-	E = gl_ProjectionMatrixInverse * vec4(0.0, 0.0, 0.0, 1.0);
-	N = normalize(vertexNorm);
-	
-        gl_Position = gl_ModelViewProjectionMatrix * vertCopy;
-	
-	blur = clamp(abs(-gl_Position.z - focalDistance) / focalRange, 0.0, 1.0);
+        gl_ClipDistance[0] = dot(clipPlane, vertCopy);
+        gl_Position = projection * (modelview * vertCopy);
 	
 	vec3 normalizedNorm = normalize(vertexNorm);
 	
 	//get the light direction
-	vec4 lightDirection = gl_ModelViewMatrix * L;
+	vec4 lightDirection = modelview * L;
 	vec4 normalizedLight = normalize(lightDirection);
 	
 	intensity = dot(normalizedNorm, normalizedLight.xyz);
 	
 	//get the height
-	height = gl_Vertex.z;
+	height = vertex.z;
 }
@@ -0,0 +1,33 @@
+#version 150
+// The terrain for the layered water pass.  Only decodes the vertex, the
+// geometry shader transforms it once for each layer.
+
+// packed vertex decoding
+uniform vec2 gridOrigin;
+uniform vec2 gridSpacing;
+uniform vec2 heightRange; // min height, height per quantization step
+uniform vec2 texCoordScale; // texture repeats per world unit
+
+//attributes
+in vec4 gridPosition; // column, row, quantized height, unused
+in vec2 packedNormal; // octahedral-encoded normal
+
+out vec4 vertex;
+out vec3 normal;
+out vec2 vertexTexCoord;
+
+vec3 decodeNormal(vec2 e){
+        vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+        if (n.z < 0.0) {
+            n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        }
+        return normalize(n);
+}
+
+void main(){
+        vertex = vec4(gridOrigin + gridPosition.xy * gridSpacing,
+                      heightRange.x + gridPosition.z * heightRange.y, 1.0);
+        vertexTexCoord = (vertex.xy - gridOrigin) * texCoordScale;
+        normal = decodeNormal(packedNormal);
+        gl_Position = vertex;
+}
@@ -0,0 +1,20 @@
+// The uniform blocks all the programs share, inserted after the #version
+// line of every shader (see DrawEngine::shader_source).  Matrices are
+// row-major, as the engine keeps them.
+
+// The same for every pass of a frame, see DrawEngine::write_frame_uniforms
+layout(std140, row_major) uniform FrameUniforms {
+    mat4 projection;
+    float nearPlane, farPlane;
+    float focalDistance, focalRange;
+    float seaLevel;
+    float screenWidth, screenHeight; // the frame drawn, in pixels
+};
+
+// The transform a pass draws with, see DrawEngine::set_transform
+layout(std140, row_major) uniform PassUniforms {
+    mat4 modelview;
+    mat3 normalMatrix;
+    vec4 clipPlane; // where the water passes clip the terrain, in its own coordinates
+    int waterRows;  // 1 or 2 to draw only the even or the odd rows of the target, 0 for all
+};
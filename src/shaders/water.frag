@@ -1,44 +1,108 @@
+#version 150
 //uniform variables
+#ifdef LAYERED_WATER
+// the reflection and refraction are layers 0 and 1 of one texture array,
+// drawn by the layered water pass
+uniform sampler2DArray waterLayers;
+#define WaterImage float
+#define sampleWater(image, uv) texture(waterLayers, vec3(uv, image))
+#define reflection 0.0
+#define refraction 1.0
+#else
 uniform sampler2D reflection;
 uniform sampler2D refraction;
+#define WaterImage sampler2D
+#define sampleWater(image, uv) texture(image, uv)
+#endif
 uniform sampler2D bumpMap;
+uniform sampler2D sceneDepth;
 
 uniform float offsetX;
 uniform float offsetY;
 
 //varying variables
-varying float intensity;
-varying float height;
-varying float blur;
-uniform float screenWidth;
-uniform float screenHeight;
+in float intensity;
+in float height;
+in vec2 bumpCoord;
 
-varying vec4 V; //vertex
-varying vec4 E; //eye
-varying vec3 N; //surface normal
+// one over the size of the scene's depth copy, it may be larger than the frame
+uniform vec2 sceneDepthTexel;
+
+// sizes of the reflection and refraction in texels
+uniform vec2 reflectionSize;
+uniform vec2 refractionSize;
+// the part of the reflection and refraction drawn, in normalized
+// coordinates, less than 1 while the window is resized or for a copy of a
+// scene drawn at a lower render scale
+uniform vec2 reflectionView;
+uniform vec2 refractionView;
+// whether the even and odd rows of the reflection and refraction were
+// drawn in different frames
+uniform float reflectionInterleaved;
+uniform float refractionInterleaved;
+
+// when refracting a copy of the opaque scene, how fast it fades to the
+// water's color with the depth of water in front of it, 0 for no fade
+uniform float refractionFade;
+
+in vec4 V; //vertex
+in vec4 E; //eye
+in vec3 N; //surface normal
+in vec4 reflectionPos[2];
+in vec4 refractionPos[2];
+
+out vec4 fragColor;
 
 const vec4 L = vec4(1.0, 1.0, 1.0, 0.0); //light direction
 
+// Looks up a reflection or refraction drawn from an earlier camera.
+// evenPos and oddPos are this fragment projected the way the even and odd
+// rows were drawn, size is the image's size in texels, offset shifts the
+// lookup in normalized coordinates, and view scales it to the part of the
+// image drawn.  When the rows are from different frames (interleaved is
+// 1), each lookup is snapped to a row of its own parity and the two are
+// averaged.
+vec4 reproject(WaterImage image, vec4 evenPos, vec4 oddPos, vec2 size, vec2 view, vec2 offset, float interleaved){
+    vec2 even = evenPos.xy / evenPos.w * 0.5 + 0.5 + offset;
+    even.x = max(0.0, min(1.0, even.x));
+    even *= view;
+    if (interleaved < 0.5) {
+        return sampleWater(image, even);
+    }
+    vec2 odd = oddPos.xy / oddPos.w * 0.5 + 0.5 + offset;
+    odd.x = max(0.0, min(1.0, odd.x));
+    odd *= view;
+    even.y = (2.0 * floor((even.y * size.y - 0.5) * 0.5 + 0.5) + 0.5) / size.y;
+    odd.y = (2.0 * floor((odd.y * size.y - 1.5) * 0.5 + 0.5) + 1.5) / size.y;
+    return 0.5 * (sampleWater(image, even) + sampleWater(image, odd));
+}
+
+// eye space distance of a depth buffer value
+float linearDepth(float z){
+    float ndc = z * 2.0 - 1.0;
+    return 2.0 * nearPlane * farPlane / (farPlane + nearPlane - ndc * (farPlane - nearPlane));
+}
+
 void main(){
-    vec2 tempVec2 = gl_TexCoord[7].st + vec2(offsetX, offsetY);
+    vec2 tempVec2 = bumpCoord + vec2(offsetX, offsetY);
     if(tempVec2.x > 1.0){
         tempVec2.x -= 1.0;
     }
     if(tempVec2.y > 1.0){
         tempVec2.y -= 1.0;
     }
-    vec4 tempVec = texture2D(bumpMap, tempVec2);
+    vec4 tempVec = texture(bumpMap, tempVec2);
     tempVec.w = 0.0;
     
 
     //normalize the normal
-    vec3 Nn = normalize(N + (gl_NormalMatrix * tempVec.xyz));
+    vec3 Nn = normalize(N + (normalMatrix * tempVec.xyz));
     
     //get the incoming vector
     vec3 I = normalize(V.xyz - E.xyz);
     
     //get light intensity
-    vec4 normalizedLight = normalize(gl_ModelViewMatrix * L);
+    vec4 normalizedLight = normalize(modelview * L);
     float intensity2 = dot(Nn, normalizedLight.xyz);
     
     float angle = 1.0 - max(0.0, dot(Nn, -I));
@@ -55,25 +119,31 @@ void main(){
     }
     
     //get the normal in camera space
-    vec4 camNorm = angle * 15.0 * (gl_ModelViewProjectionMatrix * tempVec);
-    //vec4 camNorm = 10.0 * (gl_ModelViewProjectionMatrix * tempVec);
+    vec4 camNorm = angle * 15.0 * (projection * (modelview * tempVec));
+    //vec4 camNorm = 10.0 * (projection * (modelview * tempVec));
 
-    vec2 reflectLocation = ((gl_FragCoord.xy - vec2(camNorm.x, 0.0)) / vec2(screenWidth, screenHeight));
-    //vec2 reflectLocation = ((gl_FragCoord.xy) / vec2(screenWidth, screenHeight));
-    reflectLocation.x = max(0.0, min(1.0, reflectLocation.x));
-    
-    // get the reflected vector around the surface normal
-    //vec4 R = texture2D(reflection, gl_FragCoord.xy / vec2(screenWidth, screenHeight));
-    vec4 R = texture2D(reflection, reflectLocation);
+    // get the reflected vector around the surface normal, shifted by the
+    // bump map.  The shift is in the pixels of the frame, screenWidth, and
+    // the reflection, which may be rendered smaller, is looked up in
+    // normalized coordinates.
+    vec4 R = reproject(reflection, reflectionPos[0], reflectionPos[1], reflectionSize, reflectionView,
+                       vec2(-camNorm.x / screenWidth, 0.0), reflectionInterleaved);
 
     //get the refracted vector
-    vec4 vRefract = texture2D(refraction, gl_FragCoord.xy / vec2(screenWidth, screenHeight));
+    vec4 vRefract = reproject(refraction, refractionPos[0], refractionPos[1], refractionSize, refractionView,
+                              vec2(0.0), refractionInterleaved);
+
+    //fade it with the depth of water between the surface and the scene behind
+    if (refractionFade > 0.0) {
+        float behind = texture(sceneDepth, gl_FragCoord.xy * sceneDepthTexel).r;
+        float thickness = max(0.0, linearDepth(behind) - linearDepth(gl_FragCoord.z));
+        vRefract = mix(vec4(0.2, 0.2, 0.5, 1.0), vRefract, exp(-thickness * refractionFade));
+    }
 
     //get the environment color for the refraction
     //vec4 env_color = textureCube(cubeMap, R2);
 
     //mix the reflection with the blue of the water
-    //gl_FragColor = mix(R, vec4(0.2, 0.2, 0.5, 1.0), 0.2) * intensity;
-    gl_FragColor = mix(vRefract, mix(R, vec4(0.2, 0.2, 0.5, 1.0), 0.2), 0.6) * intensity2;
-    gl_FragColor.a = R.a;
+    //fragColor = mix(R, vec4(0.2, 0.2, 0.5, 1.0), 0.2) * intensity;
+    fragColor = mix(vRefract, mix(R, vec4(0.2, 0.2, 0.5, 1.0), 0.2), 0.6) * intensity2;
 }
@@ -1,47 +1,54 @@
+#version 150
 //uniform variables
-uniform sampler2D reflection;
-uniform sampler2D refraction;
-
-uniform float offsetX;
-uniform float offsetY;
+// the water's modelview-projection when the even and the odd rows of the
+// reflection and refraction were last drawn, to reproject them
+uniform mat4 reflectionMatrix[2];
+uniform mat4 refractionMatrix[2];
 
+//attributes
+in vec4 vertex;
+in vec2 vertexTexCoord; // the bump map's
 
 //varying variables
-varying float intensity;
-varying float height;
-varying float blur;
-uniform float focalDistance, focalRange;
+out float intensity;
+out float height;
+out vec2 bumpCoord;
 
-varying vec4 V; //vertex
-varying vec4 E; //eye
-varying vec3 N; //surface normal
+out vec4 V; //vertex
+out vec4 E; //eye
+out vec3 N; //surface normal
+out vec4 reflectionPos[2];
+out vec4 refractionPos[2];
 
 //constant
 const vec4 L = vec4(1.0, 1.0, 1.0, 0.0); //light direction
+const vec3 UP = vec3(0.0, 0.0, 1.0); //the water is flat
 
 void main(){
         // normal map tex coord
-        gl_TexCoord[7] = gl_MultiTexCoord7;
+        bumpCoord = vertexTexCoord;
 	
 	//get the norm of the vertex
-	vec3 vertexNorm = gl_NormalMatrix * gl_Normal;
+	vec3 vertexNorm = normalMatrix * UP;
 
-	V = gl_ModelViewMatrix * gl_Vertex;
-	E = gl_ProjectionMatrixInverse * vec4(0.0, 0.0, 0.0, 1.0);
+	V = modelview * vertex;
+	E = inverse(projection) * vec4(0.0, 0.0, 0.0, 1.0);
 	N = normalize(vertexNorm);
 
-        gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
-	
-	blur = clamp(abs(-gl_Position.z - focalDistance) / focalRange, 0.0, 1.0);
+        gl_Position = projection * V;
+        reflectionPos[0] = reflectionMatrix[0] * vertex;
+        reflectionPos[1] = reflectionMatrix[1] * vertex;
+        refractionPos[0] = refractionMatrix[0] * vertex;
+        refractionPos[1] = refractionMatrix[1] * vertex;
 	
 	vec3 normalizedNorm = normalize(vertexNorm);
 	
 	//get the light direction
-	vec4 lightDirection = gl_ModelViewMatrix * L;
+	vec4 lightDirection = modelview * L;
 	vec4 normalizedLight = normalize(lightDirection);
 	
 	intensity = dot(normalizedNorm, normalizedLight.xyz);
 	
 	//get the height
-	height = gl_Vertex.z;
+	height = vertex.z;
 }
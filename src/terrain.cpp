@@ -1,47 +1,126 @@
+#define GL_GLEXT_LEGACY // no glext.h, we have our own
+#include <GL/gl.h>
+#define GL_GLEXT_PROTOTYPES
+#include "glext.h"
 #include "terrain.h"
+#include "frustum.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
 using std::string;
 using std::cout;
 using std::endl;
 
+// Orders chunk indices front to back by their view depth
+struct ChunkDepthLess {
+    const float *depth;
+    ChunkDepthLess(const float *d) : depth(d) {}
+    bool operator()(int a, int b) const { return depth[a] < depth[b]; }
+};
+
 // Change this to change the level at which terrain changes from grass to rock, rock to ice
 #define TERRAIN_HEIGHT 1.8f
 
-Terrain::Terrain() {
+Terrain::Terrain(GLint depth) {
     roughness_ = 5;
     decay_ = 3;
     scale_ = 0;
-    depth_ = 8;
+    depth_ = depth;
     increasing_ = true;
+    textureUnit_ = 0;
     size_ = pow(2, depth_) + 1;
     int terrain_size = size_ * size_;
     terrain_ = new float3[terrain_size];
     normalmap_ = new float3[terrain_size];
+    vertexBuffer_ = 0;
+    indexBuffer_ = 0;
+    vertexArray_ = 0;
+    chunkQuads_ = MIN(CHUNK_QUADS, size_ - 1);
+    chunksPerSide_ = (size_ - 1) / chunkQuads_;
+    verticesPerChunk_ = (chunkQuads_ + 1) * (chunkQuads_ + 1);
+    indicesPerChunk_ = chunkQuads_ * chunkQuads_ * 6;
+    minHeight_ = maxHeight_ = 0;
+    int numChunks = chunksPerSide_ * chunksPerSide_;
+    chunkMin_ = new float3[numChunks];
+    chunkMax_ = new float3[numChunks];
+    indirectBuffer_ = 0;
+    commands_ = new DrawElementsIndirectCommand[numChunks];
+    multiDrawIndirect_ = false;
+    seaLevel_ = 0;
+    visibleChunks_ = 0;
+    occlusionCulling_ = true;
+    cellQuads_ = MIN(OCCLUSION_CELL_QUADS, chunkQuads_);
+    cellsPerSide_ = (size_ - 1) / cellQuads_;
+    cellMin_ = new float[cellsPerSide_ * cellsPerSide_];
+    candidates_ = new GLint[numChunks];
+    candidateDepth_ = new float[numChunks];
+    occludedChunks_ = 0;
+    setSeed(1);
 }
 
 
 Terrain::~Terrain() {
     delete[] terrain_;
     delete[] normalmap_;
+    delete[] chunkMin_;
+    delete[] chunkMax_;
+    delete[] commands_;
+    delete[] cellMin_;
+    delete[] candidates_;
+    delete[] candidateDepth_;
+    if (vertexBuffer_) {
+        glDeleteBuffers(1, &vertexBuffer_);
+        glDeleteBuffers(1, &indexBuffer_);
+        glDeleteBuffers(1, &indirectBuffer_);
+        glDeleteVertexArrays(1, &vertexArray_);
+    }
 }
 
 
 /**
-  Adds uniform variables for the terrain shader
+  Looks up the locations of the terrain shader's uniforms in a linked
+  program, indexed by Uniform, -1 for those it doesn't use
+  **/
+void Terrain::getUniformLocations(GLuint program, GLint *locations) {
+    char name[32];
+    for (int i = 0; i < TERRAIN_REGIONS_COUNT; i++) {
+        sprintf(name, "region%dColorMap", i + 1);
+        locations[UNIFORM_REGION_COLOR_MAP + i] = glGetUniformLocation(program, name);
+        sprintf(name, "region%dMin", i + 1);
+        locations[UNIFORM_REGION_MIN + i] = glGetUniformLocation(program, name);
+        sprintf(name, "region%dMax", i + 1);
+        locations[UNIFORM_REGION_MAX + i] = glGetUniformLocation(program, name);
+    }
+    locations[UNIFORM_CUBE_MAP] = glGetUniformLocation(program, "cubeMap");
+    locations[UNIFORM_GRID_ORIGIN] = glGetUniformLocation(program, "gridOrigin");
+    locations[UNIFORM_GRID_SPACING] = glGetUniformLocation(program, "gridSpacing");
+    locations[UNIFORM_HEIGHT_RANGE] = glGetUniformLocation(program, "heightRange");
+    locations[UNIFORM_TEX_COORD_SCALE] = glGetUniformLocation(program, "texCoordScale");
+}
+
+/**
+  Adds uniform variables for the terrain shader, at the locations
+  getUniformLocations found in it
   **/
-void Terrain::updateTerrainShaderParameters(QGLShaderProgram *shader) {
-    shader->setUniformValue("region1ColorMap", regions_[0].texture);
-    shader->setUniformValue("region2ColorMap", regions_[1].texture);
-    shader->setUniformValue("region3ColorMap", regions_[2].texture);
-    shader->setUniformValue("region4ColorMap", regions_[3].texture);
-    shader->setUniformValue("region1Min", regions_[0].min);
-    shader->setUniformValue("region2Min", regions_[1].min);
-    shader->setUniformValue("region3Min", regions_[2].min);
-    shader->setUniformValue("region4Min", regions_[3].min);
-    shader->setUniformValue("region1Max", regions_[0].max);
-    shader->setUniformValue("region2Max", regions_[1].max);
-    shader->setUniformValue("region3Max", regions_[2].max);
-    shader->setUniformValue("region4Max", regions_[3].max);
-    shader->setUniformValue("cubeMap", 0);
+void Terrain::updateTerrainShaderParameters(QGLShaderProgram *shader, const GLint *locations) {
+    for (int i = 0; i < TERRAIN_REGIONS_COUNT; i++) {
+        shader->setUniformValue(locations[UNIFORM_REGION_COLOR_MAP + i], textureUnit_ + i);
+        shader->setUniformValue(locations[UNIFORM_REGION_MIN + i], regions_[i].min);
+        shader->setUniformValue(locations[UNIFORM_REGION_MAX + i], regions_[i].max);
+    }
+    shader->setUniformValue(locations[UNIFORM_CUBE_MAP], 0);
+
+    // Decoding parameters for the packed vertices
+    float3 tl = terrain_[0];
+    float3 br = terrain_[size_*size_-1];
+    shader->setUniformValue(locations[UNIFORM_GRID_ORIGIN], tl.x, tl.y);
+    shader->setUniformValue(locations[UNIFORM_GRID_SPACING], (br.x - tl.x) / (size_-1), (br.y - tl.y) / (size_-1));
+    shader->setUniformValue(locations[UNIFORM_HEIGHT_RANGE], minHeight_, (maxHeight_ - minHeight_) / 65535.0f);
+    // Tile the region textures HEIGHTMAP_TILING_FACTOR times across the terrain
+    shader->setUniformValue(locations[UNIFORM_TEX_COORD_SCALE], HEIGHTMAP_TILING_FACTOR / (br.x - tl.x),
+                            HEIGHTMAP_TILING_FACTOR / (br.y - tl.y));
 }
 
 
@@ -57,89 +136,351 @@ float3 * Terrain::getNormalMap() {
     return normalmap_;
 }
 
-void Terrain::setTextures(GLuint textures[4]) {
+/**
+  Binds the region textures to firstUnit and the 3 units after it, where
+  they stay for the terrain shader.  Leaves unit 0 active, the GLState
+  drawing has to be invalidated after.
+  **/
+void Terrain::setTextures(GLuint textures[4], int firstUnit) {
     regions_[0].texture = textures[0];
     regions_[1].texture = textures[1];
     regions_[2].texture = textures[2];
     regions_[3].texture = textures[3];
+    textureUnit_ = firstUnit;
+
+    // Texture coordinates come unwrapped from the shader, so tile with GL_REPEAT
+    for (int i = 0; i < TERRAIN_REGIONS_COUNT; i++){
+        glActiveTexture(GL_TEXTURE0 + textureUnit_ + i);
+        glBindTexture(GL_TEXTURE_2D, regions_[i].texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    }
+    glActiveTexture(GL_TEXTURE0);
 }
 
 
-//stuff for tiling of textures, ignore it
-bool Terrain::isMultiple(int index) {
-    float val = (float)index/((size_-1)/HEIGHTMAP_TILING_FACTOR);
-    if (val - (int)val == 0){
-        return true;
+/**
+  Octahedral-encodes a unit normal into two snorm16 values.
+  **/
+void Terrain::packNormal(const float3 &n, GLshort *out) {
+    float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    float x = n.x / l1;
+    float y = n.y / l1;
+    if (n.z < 0) {
+        // fold the lower hemisphere over the diagonals
+        float fx = (1.0f - fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+        float fy = (1.0f - fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = fx;
+        y = fy;
     }
-    return false;
+    x = x < -1.0f ? -1.0f : (x > 1.0f ? 1.0f : x);
+    y = y < -1.0f ? -1.0f : (y > 1.0f ? 1.0f : y);
+    out[0] = (GLshort)floor(x * 32767.0f + 0.5f);
+    out[1] = (GLshort)floor(y * 32767.0f + 0.5f);
 }
 
-float2 Terrain::wrap(float2 val){
-    return float2(val.row - (int)val.row, val.col - (int)val.col);
+/**
+  Packs the height and normal maps into chunked vertex and index buffers.
+  Must be called with a current GL context after populateNormals().
+  **/
+void Terrain::createBuffers() {
+    minHeight_ = maxHeight_ = terrain_[0].z;
+    for (int i = 1; i < size_*size_; i++) {
+        minHeight_ = MIN(minHeight_, terrain_[i].z);
+        maxHeight_ = MAX(maxHeight_, terrain_[i].z);
+    }
+    float heightScale = (maxHeight_ > minHeight_) ? 65535.0f / (maxHeight_ - minHeight_) : 0.0f;
+
+    // Every chunk owns its own border vertices so all chunks can share
+    // one index buffer of chunk-relative 16-bit indices
+    int numChunks = chunksPerSide_ * chunksPerSide_;
+    TerrainVertex *vertices = new TerrainVertex[numChunks * verticesPerChunk_];
+    TerrainVertex *v = vertices;
+    for (int chunkRow = 0; chunkRow < chunksPerSide_; chunkRow++){
+        for (int chunkCol = 0; chunkCol < chunksPerSide_; chunkCol++){
+            int chunk = chunkRow * chunksPerSide_ + chunkCol;
+            chunkMin_[chunk] = chunkMax_[chunk] = terrain_[(chunkRow * chunkQuads_)*size_ + chunkCol * chunkQuads_];
+            for (int r = 0; r <= chunkQuads_; r++){
+                for (int c = 0; c <= chunkQuads_; c++){
+                    int row = chunkRow * chunkQuads_ + r;
+                    int column = chunkCol * chunkQuads_ + c;
+                    int index = row*size_ + column;
+                    float3 p = terrain_[index];
+                    chunkMin_[chunk] = float3(MIN(chunkMin_[chunk].x, p.x), MIN(chunkMin_[chunk].y, p.y), MIN(chunkMin_[chunk].z, p.z));
+                    chunkMax_[chunk] = float3(MAX(chunkMax_[chunk].x, p.x), MAX(chunkMax_[chunk].y, p.y), MAX(chunkMax_[chunk].z, p.z));
+                    v->col = column;
+                    v->row = row;
+                    v->height = (GLushort)floor((terrain_[index].z - minHeight_) * heightScale + 0.5f);
+                    v->pad = 0;
+                    packNormal(normalmap_[index], v->normal);
+                    v++;
+                }
+            }
+        }
+    }
+
+    // Lowest height of each occluder cell, everything under it is solid ground
+    for (int cellRow = 0; cellRow < cellsPerSide_; cellRow++){
+        for (int cellCol = 0; cellCol < cellsPerSide_; cellCol++){
+            float lowest = terrain_[(cellRow * cellQuads_)*size_ + cellCol * cellQuads_].z;
+            for (int r = 0; r <= cellQuads_; r++){
+                for (int c = 0; c <= cellQuads_; c++){
+                    lowest = MIN(lowest, terrain_[(cellRow * cellQuads_ + r)*size_ + cellCol * cellQuads_ + c].z);
+                }
+            }
+            cellMin_[cellRow * cellsPerSide_ + cellCol] = lowest;
+        }
+    }
+
+    // Same winding as the old quads: tl, bl, br, tr
+    GLushort *indices = new GLushort[indicesPerChunk_];
+    GLushort *i = indices;
+    int stride = chunkQuads_ + 1;
+    for (int r = 0; r < chunkQuads_; r++){
+        for (int c = 0; c < chunkQuads_; c++){
+            GLushort tl = r*stride + c;
+            GLushort tr = tl + 1;
+            GLushort bl = tl + stride;
+            GLushort br = bl + 1;
+            *i++ = tl; *i++ = bl; *i++ = br;
+            *i++ = tl; *i++ = br; *i++ = tr;
+        }
+    }
+
+    if (!vertexBuffer_) {
+        glGenBuffers(1, &vertexBuffer_);
+        glGenBuffers(1, &indexBuffer_);
+        glGenBuffers(1, &indirectBuffer_);
+        glGenVertexArrays(1, &vertexArray_);
+    }
+    // The vertex array keeps the attribute layout and the index buffer
+    glBindVertexArray(vertexArray_);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer_);
+    glBufferData(GL_ARRAY_BUFFER, numChunks * verticesPerChunk_ * sizeof(TerrainVertex), vertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(ATTRIB_GRID_POSITION);
+    glVertexAttribPointer(ATTRIB_GRID_POSITION, 4, GL_UNSIGNED_SHORT, GL_FALSE,
+                          sizeof(TerrainVertex), (GLvoid *)offsetof(TerrainVertex, col));
+    glEnableVertexAttribArray(ATTRIB_NORMAL);
+    glVertexAttribPointer(ATTRIB_NORMAL, 2, GL_SHORT, GL_TRUE,
+                          sizeof(TerrainVertex), (GLvoid *)offsetof(TerrainVertex, normal));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer_);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesPerChunk_ * sizeof(GLushort), indices, GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // One region of draw commands per pass, rewritten every frame
+    int major = 0, minor = 0;
+    sscanf((const char *)glGetString(GL_VERSION), "%d.%d", &major, &minor);
+    multiDrawIndirect_ = major > 4 || (major == 4 && minor >= 3);
+    if (multiDrawIndirect_) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer_);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, TERRAIN_PASS_COUNT * numChunks * sizeof(DrawElementsIndirectCommand),
+                     NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+
+    delete[] vertices;
+    delete[] indices;
 }
 
 
 /**
-  The main drawing method which will be called 30 frames per second.
-**/
-void Terrain::render() {
-    //float time = mIncrement++ / (float)mFPS;
-
-    // Clear the color and depth buffers to the current glClearColor
-    glMatrixMode(GL_MODELVIEW);
-
-    // Push a new matrix onto the stack for modelling transformations
-    glPushMatrix();
-
-    float unitIncrement = HEIGHTMAP_TILING_FACTOR/(size_-1);
-    glBegin(GL_QUADS);
-    for (int row = 0; row < size_-1;row++){
-        for (int column= 0; column < size_-1;column++){
-            float3 tlv = terrain_[row*size_ + column];
-            float3 tln = normalmap_[row*size_ + column];
-            float3 blv = terrain_[(row+1)*size_ + column];
-            float3 bln = normalmap_[(row+1)*size_ + column];
-            float3 brv = terrain_[(row+1)*size_ + column+1];
-            float3 brn = normalmap_[(row+1)*size_ + column+1];
-            float3 trv = terrain_[row*size_ + column+1];
-            float3 trn = normalmap_[row*size_ + column+1];
-
-            float2 tlc = wrap(float2(row*unitIncrement,column*unitIncrement));
-            float2 blc = wrap(float2((row+1)*unitIncrement,column*unitIncrement));
-            float2 brc = wrap(float2((row+1)*unitIncrement,(column+1)*unitIncrement));
-            float2 trc = wrap(float2(row*unitIncrement,(column+1)*unitIncrement));
-
-            if (isMultiple(column+1)){
-                trc = float2(trc.row,1.0);
-                brc = float2(brc.row,1.0);
+  Bounds of a chunk as drawn in the given pass.  The water passes clamp
+  vertices to sea level, so their boxes have to reach it too.
+  **/
+void Terrain::getChunkBounds(int chunk, TerrainPass pass, float3 &mn, float3 &mx) {
+    mn = chunkMin_[chunk];
+    mx = chunkMax_[chunk];
+    if (pass == TERRAIN_PASS_REFLECTION) {
+        mn.z = MAX(mn.z, seaLevel_);
+        mx.z = MAX(mx.z, seaLevel_);
+    } else if (pass == TERRAIN_PASS_REFRACTION) {
+        mn.z = MIN(mn.z, seaLevel_);
+        mx.z = MIN(mx.z, seaLevel_);
+    }
+}
+
+/**
+  Height of the solid block under an occluder cell as drawn in the given
+  pass, the refraction pass flattens everything above sea level.
+  **/
+float Terrain::occluderHeight(int cellRow, int cellCol, TerrainPass pass) {
+    float height = cellMin_[cellRow * cellsPerSide_ + cellCol];
+    if (pass == TERRAIN_PASS_REFRACTION) {
+        height = MIN(height, seaLevel_);
+    }
+    return height;
+}
+
+/**
+  Rasterizes a chunk's occluder: a flat top over every cell at its lowest
+  height, plus walls down to lower neighbouring cells so ridges still hide
+  what is behind them when seen edge-on.  All of it lies under the real
+  surface, so it never hides anything the terrain wouldn't.
+  **/
+void Terrain::rasterizeOccluder(int chunk, TerrainPass pass) {
+    int cellsPerChunk = chunkQuads_ / cellQuads_;
+    int firstRow = (chunk / chunksPerSide_) * cellsPerChunk;
+    int firstCol = (chunk % chunksPerSide_) * cellsPerChunk;
+    for (int cellRow = firstRow; cellRow < firstRow + cellsPerChunk; cellRow++){
+        for (int cellCol = firstCol; cellCol < firstCol + cellsPerChunk; cellCol++){
+            float h = occluderHeight(cellRow, cellCol, pass);
+            float3 tl = terrain_[(cellRow * cellQuads_)*size_ + cellCol * cellQuads_];
+            float3 br = terrain_[((cellRow + 1) * cellQuads_)*size_ + (cellCol + 1) * cellQuads_];
+            float x0 = tl.x, y0 = tl.y, x1 = br.x, y1 = br.y;
+            occlusionCuller_.rasterizeQuad(float3(x0, y0, h), float3(x0, y1, h),
+                                           float3(x1, y1, h), float3(x1, y0, h));
+
+            // walls along the edges shared with lower neighbours
+            if (cellRow > 0) {
+                float hn = occluderHeight(cellRow - 1, cellCol, pass);
+                if (hn < h) {
+                    occlusionCuller_.rasterizeQuad(float3(x0, y0, hn), float3(x1, y0, hn),
+                                                   float3(x1, y0, h), float3(x0, y0, h));
+                }
+            }
+            if (cellRow < cellsPerSide_ - 1) {
+                float hn = occluderHeight(cellRow + 1, cellCol, pass);
+                if (hn < h) {
+                    occlusionCuller_.rasterizeQuad(float3(x0, y1, hn), float3(x1, y1, hn),
+                                                   float3(x1, y1, h), float3(x0, y1, h));
+                }
+            }
+            if (cellCol > 0) {
+                float hn = occluderHeight(cellRow, cellCol - 1, pass);
+                if (hn < h) {
+                    occlusionCuller_.rasterizeQuad(float3(x0, y0, hn), float3(x0, y1, hn),
+                                                   float3(x0, y1, h), float3(x0, y0, h));
+                }
             }
-            if (isMultiple(row+1)){
-                blc = float2(1.0,blc.col);
-                brc = float2(1.0,brc.col);
+            if (cellCol < cellsPerSide_ - 1) {
+                float hn = occluderHeight(cellRow, cellCol + 1, pass);
+                if (hn < h) {
+                    occlusionCuller_.rasterizeQuad(float3(x1, y0, hn), float3(x1, y1, hn),
+                                                   float3(x1, y1, h), float3(x1, y0, h));
+                }
             }
+        }
+    }
+}
 
-            glTexCoord2d(tlc.col, tlc.row);
-            glNormal3f(tln.x, tln.y, tln.z);
-            glVertex3f(tlv.x, tlv.y, tlv.z);
 
-            glTexCoord2d(blc.col, blc.row);
-            glNormal3f(bln.x, bln.y, bln.z);
-            glVertex3f(blv.x, blv.y, blv.z);
+/**
+  Draws the terrain chunks inside the view frustum and, for the main and
+  refraction passes, not hidden behind nearer chunks.  Culling uses mvp,
+  the column-major projection * modelview the terrain is drawn with, the
+  visible chunks are then submitted with a single multi-draw-indirect
+  call from the pass's region of the indirect buffer.  Bindings go
+  through the renderer's state cache.
+**/
+void Terrain::render(TerrainPass pass, const float *mvp, GLState &state) {
+    Frustum frustum(mvp);
+
+    int numChunks = chunksPerSide_ * chunksPerSide_;
+    int numCandidates = 0;
+    for (int chunk = 0; chunk < numChunks; chunk++){
+        float3 mn, mx;
+        getChunkBounds(chunk, pass, mn, mx);
+        if (!frustum.intersectsBox(mn, mx)) {
+            continue;
+        }
+        // distance along the view direction is the clip w of the center
+        float3 c = (mn + mx) * 0.5f;
+        candidateDepth_[chunk] = mvp[3] * c.x + mvp[7] * c.y + mvp[11] * c.z + mvp[15];
+        candidates_[numCandidates++] = chunk;
+    }
 
-            glTexCoord2d(brc.col, brc.row);
-            glNormal3f(brn.x, brn.y, brn.z);
-            glVertex3f(brv.x, brv.y, brv.z);
+    // Rasterize the nearest chunks as occluders and test the rest against
+    // them.  The reflection pass sees the terrain mirrored from below, so
+    // it only gets frustum culling.
+    occludedChunks_ = 0;
+    bool occlusion = occlusionCulling_ && pass != TERRAIN_PASS_REFLECTION;
+    if (occlusion) {
+        std::sort(candidates_, candidates_ + numCandidates, ChunkDepthLess(candidateDepth_));
+        occlusionCuller_.begin(mvp);
+        int numOccluders = MIN(OCCLUDER_CHUNKS, numCandidates);
+        for (int i = 0; i < numOccluders; i++){
+            rasterizeOccluder(candidates_[i], pass);
+        }
+    }
 
+    visibleChunks_ = 0;
+    for (int i = 0; i < numCandidates; i++){
+        int chunk = candidates_[i];
+        if (occlusion && i >= OCCLUDER_CHUNKS) {
+            float3 mn, mx;
+            getChunkBounds(chunk, pass, mn, mx);
+            if (!occlusionCuller_.isBoxVisible(mn, mx)) {
+                occludedChunks_++;
+                continue;
+            }
+        }
+        DrawElementsIndirectCommand &cmd = commands_[visibleChunks_++];
+        cmd.count = indicesPerChunk_;
+        cmd.instanceCount = 1;
+        cmd.firstIndex = 0;
+        cmd.baseVertex = chunk * verticesPerChunk_;
+        cmd.baseInstance = 0;
+    }
+    drawChunks(pass, state);
+}
 
-            glTexCoord2d(trc.col, trc.row);
-            glNormal3f(trn.x, trn.y, trn.z);
-            glVertex3f(trv.x, trv.y, trv.z);
+/**
+  Draws the terrain once for the layered reflection and refraction pass.
+  mvp is the refraction's projection * modelview, reflectionMvp the
+  mirrored one, both column-major.  A chunk is drawn if either layer sees
+  it, occlusion culling is left out since the reflection can't use it.
+  **/
+void Terrain::renderWaterLayers(const float *mvp, const float *reflectionMvp, GLState &state) {
+    Frustum refraction(mvp), reflection(reflectionMvp);
+
+    occludedChunks_ = 0;
+    visibleChunks_ = 0;
+    int numChunks = chunksPerSide_ * chunksPerSide_;
+    for (int chunk = 0; chunk < numChunks; chunk++){
+        float3 reflectionMin, reflectionMax, refractionMin, refractionMax;
+        getChunkBounds(chunk, TERRAIN_PASS_REFLECTION, reflectionMin, reflectionMax);
+        getChunkBounds(chunk, TERRAIN_PASS_REFRACTION, refractionMin, refractionMax);
+        if (!reflection.intersectsBox(reflectionMin, reflectionMax) &&
+            !refraction.intersectsBox(refractionMin, refractionMax)) {
+            continue;
         }
+        DrawElementsIndirectCommand &cmd = commands_[visibleChunks_++];
+        cmd.count = indicesPerChunk_;
+        cmd.instanceCount = 1;
+        cmd.firstIndex = 0;
+        cmd.baseVertex = chunk * verticesPerChunk_;
+        cmd.baseInstance = 0;
+    }
+    drawChunks(TERRAIN_PASS_WATER_LAYERS, state);
+}
 
+/**
+  Submits the visibleChunks_ commands built for a pass, into the pass's
+  own slice of the indirect buffer.  The vertex array is left bound, the
+  next pass drawing the terrain binds the same one.
+  **/
+void Terrain::drawChunks(TerrainPass pass, GLState &state) {
+    if (visibleChunks_ == 0) {
+        return;
+    }
+    int numChunks = chunksPerSide_ * chunksPerSide_;
+
+    state.bindVertexArray(vertexArray_);
+
+    if (multiDrawIndirect_) {
+        GLintptr offset = pass * numChunks * sizeof(DrawElementsIndirectCommand);
+        state.bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer_);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, offset,
+                        visibleChunks_ * sizeof(DrawElementsIndirectCommand), commands_);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (const void *)offset, visibleChunks_, 0);
+    } else {
+        // Pre-4.3 contexts walk the same command list
+        for (int i = 0; i < visibleChunks_; i++){
+            glDrawElementsBaseVertex(GL_TRIANGLES, commands_[i].count, GL_UNSIGNED_SHORT, 0,
+                                     commands_[i].baseVertex);
+        }
     }
-    glEnd();
-    // Discard the modelling transformations (leaving only camera settings)
-    glPopMatrix();
 }
 
 
@@ -294,11 +635,49 @@ float3 Terrain::averageNormal (float3 * n, int numNorm){
     return toreturn;
 }
 
+/**
+  Seeds the generator used by populateTerrain, like srand() does for rand()
+  **/
+void Terrain::setSeed(unsigned int seed) {
+    // The first 31 values come from a Lehmer generator, as glibc fills its
+    // state, and the first 310 values after them are thrown away
+    int32_t word = seed == 0 ? 1 : (int32_t)seed;
+    randomState_[0] = word;
+    for (int i = 1; i < 31; i++) {
+        long hi = word / 127773, lo = word % 127773;
+        word = 16807 * lo - 2836 * hi;
+        if (word < 0) {
+            word += 2147483647;
+        }
+        randomState_[i] = word;
+    }
+    for (int i = 31; i < 34; i++) {
+        randomState_[i] = randomState_[i - 31];
+    }
+    randomIndex_ = 0;
+    for (int i = 0; i < 310; i++) {
+        nextRandom();
+    }
+}
+
+/**
+  Returns the next value of the generator setSeed seeded, between 0 and
+  RAND_MAX as rand() does.  Each value is the sum of the ones 31 and 3
+  before it.
+  **/
+int Terrain::nextRandom() {
+    unsigned int r = randomState_[(randomIndex_ + 3) % 34] + randomState_[(randomIndex_ + 31) % 34];
+    randomState_[randomIndex_] = r;
+    randomIndex_ = (randomIndex_ + 1) % 34;
+    return r >> 1;
+}
+
 /**
   Returns a random value to perturb a vertex by based on an inputed level of depth
   **/
 double Terrain::getPerturb(int cur_depth) {
-    double toreturn = roughness_*pow(((double)cur_depth/depth_), decay_)*((rand()%200-100)/100.0);
+    int random = nextRandom();
+    double toreturn = roughness_*pow(((double)cur_depth/depth_), decay_)*((random%200-100)/100.0);
     return toreturn;
 }
 
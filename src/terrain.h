@@ -2,6 +2,8 @@
 #define TERRAIN_H
 
 #include "common.h"
+#include "occlusionculler.h"
+#include "glstate.h"
 #include <string>
 #include <QGLWidget>
 #include <QGLShader>
@@ -29,19 +31,70 @@ struct TerrainRegion
     }
 };
 
+// Packed terrain vertex, 12 bytes.  Positions are stored as grid coordinates
+// and a quantized height, the shader rebuilds x/y from the grid and the
+// texture coordinates from the world position.
+struct TerrainVertex
+{
+    GLushort col;       // grid column
+    GLushort row;       // grid row
+    GLushort height;    // unorm16 height between the terrain's min and max
+    GLushort pad;
+    GLshort normal[2];  // octahedral-encoded normal, snorm16
+};
+
+// Layout of one GL_DRAW_INDIRECT_BUFFER entry for glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// The scene passes that draw the terrain, each gets its own culling
+// results in the shared indirect buffer
+enum TerrainPass {
+    TERRAIN_PASS_REFLECTION,
+    TERRAIN_PASS_REFRACTION,
+    TERRAIN_PASS_SCENE,
+    TERRAIN_PASS_WATER_LAYERS, // reflection and refraction in one layered draw
+    TERRAIN_PASS_COUNT
+};
+
 class Terrain
 {
 public:
-    Terrain();
+    // Vertex attribute locations, bound by whoever links the terrain shader
+    static const GLuint ATTRIB_GRID_POSITION = 0;
+    static const GLuint ATTRIB_NORMAL = 1;
+
+    // Uniforms updateTerrainShaderParameters sets, their locations are
+    // looked up once for each program with getUniformLocations
+    enum Uniform {
+        UNIFORM_REGION_COLOR_MAP,      // one for each of the 4 regions
+        UNIFORM_REGION_MIN = UNIFORM_REGION_COLOR_MAP + 4,
+        UNIFORM_REGION_MAX = UNIFORM_REGION_MIN + 4,
+        UNIFORM_CUBE_MAP = UNIFORM_REGION_MAX + 4,
+        UNIFORM_GRID_ORIGIN,
+        UNIFORM_GRID_SPACING,
+        UNIFORM_HEIGHT_RANGE,
+        UNIFORM_TEX_COORD_SCALE,
+        UNIFORM_COUNT
+    };
+
+    Terrain(GLint depth = 8);
     ~Terrain();
 
     float3 * getTerrain();
     GLint getTerrainSize();
+    GLint getSideLength() const { return size_; }
     float3 * getNormalMap();
 
     //for texturing
     GLuint loadTexture(const QFile &file);
-    void setTextures(GLuint textures[4]);
+    void setTextures(GLuint textures[4], int firstUnit);
 
     //for terrain and normals
     GLint coordinateToIndex(float2 c);
@@ -52,19 +105,39 @@ public:
     void fillDiamond(float2 ptof, int dist,float2 xy, int depth);
     void fillAllDiamonds(float2 tl, float2 br, int depth);
     void fillSquare(float2 tlg, float2 brg, int depth);
+    void setSeed(unsigned int seed);
     double getPerturb(int cur_depth);
+    int nextRandom();
     void populateNormals();
-    void updateTerrainShaderParameters(QGLShaderProgram *shader);
-    void render();
+    void createBuffers();
+    static void getUniformLocations(GLuint program, GLint *locations);
+    void updateTerrainShaderParameters(QGLShaderProgram *shader, const GLint *locations);
+    void setSeaLevel(float seaLevel) { seaLevel_ = seaLevel; }
+    void render(TerrainPass pass, const float *mvp, GLState &state);
+    void renderWaterLayers(const float *mvp, const float *reflectionMvp, GLState &state);
+    GLint getVisibleChunks() const { return visibleChunks_; }
+    GLint getOccludedChunks() const { return occludedChunks_; }
+    void setOcclusionCulling(bool enabled) { occlusionCulling_ = enabled; }
+    bool getOcclusionCulling() const { return occlusionCulling_; }
 
-    float2 wrap(float2 val);
-    bool isMultiple(int val);
+    static void packNormal(const float3 &n, GLshort *out);
 
     GLuint getTextureInt(int i);
 
 private:
     static const int TERRAIN_REGIONS_COUNT = 4;
     static const float HEIGHTMAP_TILING_FACTOR = 4;
+    // Quads along one side of a chunk, keeps chunk vertices below 2^16
+    static const int CHUNK_QUADS = 16;
+    // Quads along one side of an occluder cell, and how many of the
+    // nearest chunks are rasterized as occluders
+    static const int OCCLUSION_CELL_QUADS = 4;
+    static const int OCCLUDER_CHUNKS = 16;
+
+    void getChunkBounds(int chunk, TerrainPass pass, float3 &mn, float3 &mx);
+    float occluderHeight(int cellRow, int cellCol, TerrainPass pass);
+    void rasterizeOccluder(int chunk, TerrainPass pass);
+    void drawChunks(TerrainPass pass, GLState &state);
 
     float3 * terrain_;
     float3 * normalmap_;
@@ -75,6 +148,44 @@ private:
     GLfloat scale_;
     bool increasing_;
     TerrainRegion regions_[TERRAIN_REGIONS_COUNT];
+    GLint textureUnit_; // the first region's, the others follow it
+
+    // per-terrain random state, so terrains can be generated on several
+    // threads at once.  The last 34 values of glibc's additive feedback
+    // generator, which gives the same sequence as srand()/rand() for a
+    // given seed on any platform.
+    unsigned int randomState_[34];
+    int randomIndex_; // of the oldest value, overwritten next
+
+    // packed vertex and 16-bit index buffers, and the vertex array
+    // object drawing from them
+    GLuint vertexBuffer_;
+    GLuint indexBuffer_;
+    GLuint vertexArray_;
+    GLint chunkQuads_;
+    GLint chunksPerSide_;
+    GLint verticesPerChunk_;
+    GLint indicesPerChunk_;
+    float minHeight_, maxHeight_;
+
+    // per-chunk bounds and the indirect draw commands built from them
+    float3 *chunkMin_;
+    float3 *chunkMax_;
+    GLuint indirectBuffer_;
+    DrawElementsIndirectCommand *commands_;
+    bool multiDrawIndirect_;
+    float seaLevel_;
+    GLint visibleChunks_;
+
+    // CPU occlusion culling against the nearest chunks' min-height cells
+    OcclusionCuller occlusionCuller_;
+    bool occlusionCulling_;
+    float *cellMin_;
+    GLint cellQuads_;
+    GLint cellsPerSide_;
+    GLint *candidates_;
+    float *candidateDepth_;
+    GLint occludedChunks_;
 };
 
 #endif // TERRAIN_H
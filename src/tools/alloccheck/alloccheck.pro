@@ -0,0 +1,49 @@
+#-------------------------------------------------
+#
+# Check that drawing a frame doesn't allocate once
+# it has settled, needs a display
+#
+#-------------------------------------------------
+
+QT += core gui opengl
+
+TARGET = alloccheck
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += main.cpp \
+    ../../drawengine.cpp \
+    ../../targa.cpp \
+    ../../glm.cpp \
+    ../../terrain.cpp \
+    ../../camera.cpp \
+    ../../occlusionculler.cpp \
+    ../../framegraph.cpp \
+    ../../glstate.cpp \
+    ../../uniformring.cpp \
+    ../../CS123Matrix.cpp
+
+HEADERS += ../../drawengine.h \
+    ../../targa.h \
+    ../../glm.h \
+    ../../common.h \
+    ../../terrain.h \
+    ../../glext.h \
+    ../../camera.h \
+    ../../frustum.h \
+    ../../occlusionculler.h \
+    ../../framegraph.h \
+    ../../glstate.h \
+    ../../uniformring.h \
+    ../../shaderids.h \
+    ../../CS123Vector.h \
+    ../../CS123Matrix.h \
+    ../../CS123Algebra.h \
+    ../../CS123Common.h
+
+INCLUDEPATH += ../..
+DEPENDPATH += ../..
+
+QMAKE_CXXFLAGS_RELEASE -= -O2
+QMAKE_CXXFLAGS_RELEASE += -O3
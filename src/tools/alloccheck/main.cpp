@@ -0,0 +1,173 @@
+/**
+  alloccheck: draws frames with DrawEngine in a window of its own and
+  fails if draw_frame allocates memory once they have settled.
+
+  usage: alloccheck [frames]
+
+  Run from src, where the shaders, textures and quality settings are.
+  Needs a display.  Automatic quality and dynamic resolution are turned
+  off whatever the quality settings say, since changing the quality
+  rebuilds the terrain and the frame graph.  The frame is checked as the
+  settings leave it and then with each of its options toggled in turn:
+  every time WARMUP_FRAMES frames are drawn first, which compiles the frame
+  graph and fills the water's history, then the given number of frames
+  (FRAMES by default) are drawn counting allocations.  Only draw_frame is
+  counted, not swapping the buffers.
+
+  On glibc malloc, calloc and realloc are replaced, so Qt's allocations
+  and the GL driver's are counted along with operator new's.  Elsewhere
+  only operator new and new[] are.  A driver allocating while it draws
+  fails the check too, break on counted_allocation to see who allocated.
+**/
+
+#include "drawengine.h"
+#include <QApplication>
+#include <QGLWidget>
+#include <stdlib.h>
+#include <new>
+#include <iostream>
+using std::cout;
+using std::cerr;
+using std::endl;
+
+#define WARMUP_FRAMES 30
+#define FRAMES 200
+#define FRAME_WIDTH 800
+#define FRAME_HEIGHT 600
+// ms between frames, as the window's timer draws them
+#define FRAME_TIME 30.0f
+
+static volatile bool counting = false;
+static volatile int allocations = 0;
+
+/**
+  Called for every allocation while counting, worth a breakpoint
+  **/
+extern "C" __attribute__((noinline)) void counted_allocation() {
+    __sync_fetch_and_add(&allocations, 1);
+}
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+
+extern "C" void *malloc(size_t size) {
+    if (counting) {
+        counted_allocation();
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    if (counting) {
+        counted_allocation();
+    }
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size) {
+    if (counting) {
+        counted_allocation();
+    }
+    return __libc_realloc(pointer, size);
+}
+#endif
+
+/**
+  operator new and new[] on malloc, counted here where malloc isn't
+  **/
+static void *allocate(size_t size) {
+#ifndef __GLIBC__
+    if (counting) {
+        counted_allocation();
+    }
+#endif
+    void *pointer = malloc(size ? size : 1);
+    if (!pointer) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void *operator new(size_t size) { return allocate(size); }
+void *operator new[](size_t size) { return allocate(size); }
+void operator delete(void *pointer) throw() { free(pointer); }
+void operator delete[](void *pointer) throw() { free(pointer); }
+
+/**
+  Draws a settled run of frames and prints how many allocations drawing
+  them made, false when there were any
+  **/
+static bool check(DrawEngine &engine, QGLWidget &widget, const char *frame, int frames, float &time) {
+    for (int i = 0; i < WARMUP_FRAMES + frames; i++) {
+        time += FRAME_TIME;
+        counting = i >= WARMUP_FRAMES;
+        engine.draw_frame(time, FRAME_WIDTH, FRAME_HEIGHT);
+        counting = false;
+        widget.swapBuffers();
+    }
+    int count = allocations;
+    allocations = 0;
+    cout << frame << ": " << count << " allocations in " << frames << " frames" << endl;
+    return count == 0;
+}
+
+int main(int argc, char *argv[]) {
+    QApplication app(argc, argv);
+    int frames = argc == 2 ? atoi(argv[1]) : FRAMES;
+    if (argc > 2 || frames <= 0) {
+        cerr << "usage: alloccheck [frames]" << endl;
+        return 1;
+    }
+
+    QGLWidget widget(QGLFormat(QGL::DoubleBuffer));
+    widget.setAutoBufferSwap(false);
+    widget.resize(FRAME_WIDTH, FRAME_HEIGHT);
+    widget.show();
+    app.processEvents();
+    widget.makeCurrent();
+
+    DrawEngine engine(widget.context(), FRAME_WIDTH, FRAME_HEIGHT);
+    engine.resize_frame(FRAME_WIDTH, FRAME_HEIGHT);
+    engine.setAutoQuality(false);
+    engine.setDynamicResolution(false);
+    float time = 0.0f;
+    bool ok = check(engine, widget, "quality settings", frames, time);
+
+    engine.setReflectionMode(engine.getReflectionMode() == REFLECTION_MIRRORED ?
+                             REFLECTION_SCREEN_SPACE : REFLECTION_MIRRORED);
+    ok = check(engine, widget, "other reflection mode", frames, time) && ok;
+    engine.setReflectionMode(engine.getReflectionMode() == REFLECTION_MIRRORED ?
+                             REFLECTION_SCREEN_SPACE : REFLECTION_MIRRORED);
+
+    WaterUpdateMode mode = engine.getWaterUpdateMode();
+    for (int i = 0; i < WATER_UPDATE_MODE_COUNT; i++) {
+        if (i != mode) {
+            engine.setWaterUpdateMode((WaterUpdateMode) i);
+            ok = check(engine, widget, i == WATER_UPDATE_INTERLEAVED ? "interleaved water updates" :
+                       i == WATER_UPDATE_EVERY_N_FRAMES ? "water updated every n frames" :
+                       "water updated every frame", frames, time) && ok;
+        }
+    }
+    engine.setWaterUpdateMode(mode);
+
+    engine.setRefractionFromScene(!engine.getRefractionFromScene());
+    ok = check(engine, widget, "other refraction source", frames, time) && ok;
+    engine.setRefractionFromScene(!engine.getRefractionFromScene());
+
+    engine.setLayeredWaterPasses(!engine.getLayeredWaterPasses());
+    ok = check(engine, widget, "other water layering", frames, time) && ok;
+    engine.setLayeredWaterPasses(!engine.getLayeredWaterPasses());
+
+    engine.setDofPyramid(!engine.getDofPyramid());
+    ok = check(engine, widget, "other depth of field resolution", frames, time) && ok;
+    engine.setDofPyramid(!engine.getDofPyramid());
+
+    engine.setComputeBlur(!engine.getComputeBlur());
+    ok = check(engine, widget, "other depth of field blur", frames, time) && ok;
+    engine.setComputeBlur(!engine.getComputeBlur());
+
+    cout << (ok ? "draw_frame doesn't allocate" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+#ifndef BAKEFORMAT_H
+#define BAKEFORMAT_H
+
+#include <QtGlobal>
+
+/**
+  Layout of the files written by terrainbake.  Everything is little-endian
+  and tightly packed:
+
+      BakeFileHeader
+      jobCount records, in job list order, each:
+          BakeRecordHeader
+          quint16 heights[sideLength * sideLength]     unorm16 over min..max
+          qint16  normals[sideLength * sideLength][2]  octahedral snorm16
+
+  Every record has the same size, so record i starts at
+  sizeof(BakeFileHeader) + i * bakeRecordSize(sideLength).
+  Heights and normals are row-major, the same packing the renderer uses
+  for its terrain vertices.
+  **/
+
+#define BAKE_MAGIC "TBAK"
+#define BAKE_VERSION 1
+// Slope histogram bins, each covers 90 / BAKE_SLOPE_BINS degrees from flat
+#define BAKE_SLOPE_BINS 18
+
+#pragma pack(push, 1)
+struct BakeFileHeader {
+    char magic[4];
+    quint32 version;
+    quint32 jobCount;
+    quint32 sideLength;
+    quint32 slopeBins;
+};
+
+struct BakeRecordHeader {
+    quint32 job;
+    quint32 seed;
+    float corners[4];   // tl, tr, bl, br heights given to populateTerrain
+    float minHeight;
+    float maxHeight;
+    quint32 slopeHistogram[BAKE_SLOPE_BINS];
+};
+#pragma pack(pop)
+
+inline qint64 bakeRecordSize(int sideLength) {
+    qint64 vertices = (qint64)sideLength * sideLength;
+    return sizeof(BakeRecordHeader) + vertices * sizeof(quint16) + vertices * 2 * sizeof(qint16);
+}
+
+#endif // BAKEFORMAT_H
@@ -0,0 +1,222 @@
+/**
+  terrainbake: generates many terrains offline with the same generator the
+  renderer uses, and writes their heights, normals and summary statistics
+  to one binary file (see bakeformat.h).  Needs no display or GL context.
+
+  usage: terrainbake [-j threads] [-d depth] jobs.txt out.bin
+
+  Every line of the job list is "seed tl tr bl br", the srand seed and the
+  four corner heights handed to Terrain::populateTerrain.  Blank lines and
+  lines starting with # are skipped.
+
+  Each worker thread owns one Terrain and reuses it for every job it takes,
+  so memory stays at one terrain per thread however long the job list is.
+**/
+
+#include "terrain.h"
+#include "bakeformat.h"
+#include <QThread>
+#include <QMutex>
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+using std::cout;
+using std::cerr;
+using std::endl;
+
+struct BakeJob {
+    unsigned int seed;
+    float corners[4];
+};
+
+/**
+  The job list and the output file, shared by all workers
+  **/
+class BakeQueue {
+public:
+    BakeQueue(const std::vector<BakeJob> &jobs, FILE *out, int sideLength)
+        : jobs_(jobs), out_(out), sideLength_(sideLength), next_(0), failed_(false) {}
+
+    // Hands out the next job index, -1 when the list is done
+    int take() {
+        QMutexLocker locker(&mutex_);
+        if (next_ >= (int)jobs_.size() || failed_) {
+            return -1;
+        }
+        return next_++;
+    }
+
+    const BakeJob &job(int i) const { return jobs_[i]; }
+
+    // Records have a fixed size, so each goes straight to its slot
+    void write(int i, const char *record, qint64 size) {
+        QMutexLocker locker(&mutex_);
+        off_t offset = sizeof(BakeFileHeader) + (off_t)i * bakeRecordSize(sideLength_);
+        if (fseeko(out_, offset, SEEK_SET) != 0 || fwrite(record, 1, size, out_) != (size_t)size) {
+            failed_ = true;
+        }
+        if (((i + 1) % 100) == 0) {
+            cout << "\t  " << (i + 1) << " / " << jobs_.size() << endl;
+        }
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    std::vector<BakeJob> jobs_;
+    FILE *out_;
+    int sideLength_;
+    int next_;
+    bool failed_;
+    QMutex mutex_;
+};
+
+class BakeWorker : public QThread {
+public:
+    BakeWorker(BakeQueue *queue, int depth) : queue_(queue), depth_(depth) {}
+
+protected:
+    void run() {
+        Terrain terrain(depth_);
+        int side = terrain.getSideLength();
+        int vertices = side * side;
+        std::vector<char> record(bakeRecordSize(side));
+        BakeRecordHeader *header = (BakeRecordHeader *)&record[0];
+        quint16 *heights = (quint16 *)(&record[0] + sizeof(BakeRecordHeader));
+        GLshort *normals = (GLshort *)(heights + vertices);
+
+        for (int i = queue_->take(); i != -1; i = queue_->take()) {
+            const BakeJob &job = queue_->job(i);
+            terrain.setSeed(job.seed);
+            terrain.populateTerrain(float3(-10, 10, job.corners[0]), float3(10, 10, job.corners[1]),
+                                    float3(-10, -10, job.corners[2]), float3(10, -10, job.corners[3]));
+            terrain.populateNormals();
+
+            float3 *points = terrain.getTerrain();
+            float3 *normalMap = terrain.getNormalMap();
+            memset(header, 0, sizeof(BakeRecordHeader));
+            header->job = i;
+            header->seed = job.seed;
+            memcpy(header->corners, job.corners, sizeof(header->corners));
+            header->minHeight = header->maxHeight = points[0].z;
+            for (int v = 1; v < vertices; v++) {
+                header->minHeight = MIN(header->minHeight, points[v].z);
+                header->maxHeight = MAX(header->maxHeight, points[v].z);
+            }
+
+            float range = header->maxHeight - header->minHeight;
+            float heightScale = range > 0 ? 65535.0f / range : 0.0f;
+            for (int v = 0; v < vertices; v++) {
+                heights[v] = (quint16)floor((points[v].z - header->minHeight) * heightScale + 0.5f);
+                Terrain::packNormal(normalMap[v], normals + 2 * v);
+
+                // slope is the angle between the normal and straight up
+                float up = fabs(normalMap[v].z);
+                float slope = acos(up > 1.0f ? 1.0f : up) * 180.0f / PI;
+                int bin = (int)(slope / (90.0f / BAKE_SLOPE_BINS));
+                header->slopeHistogram[bin < BAKE_SLOPE_BINS ? bin : BAKE_SLOPE_BINS - 1]++;
+            }
+
+            queue_->write(i, &record[0], record.size());
+        }
+    }
+
+private:
+    BakeQueue *queue_;
+    int depth_;
+};
+
+static bool readJobs(const char *path, std::vector<BakeJob> &jobs) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t")] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        BakeJob job;
+        if (!(fields >> job.seed >> job.corners[0] >> job.corners[1] >> job.corners[2] >> job.corners[3])) {
+            cerr << path << ":" << lineNumber << ": expected \"seed tl tr bl br\"" << endl;
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+static void usage() {
+    cerr << "usage: terrainbake [-j threads] [-d depth] jobs.txt out.bin" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = QThread::idealThreadCount();
+    int depth = 8;
+    const char *jobPath = NULL, *outPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else if (!jobPath) {
+            jobPath = argv[i];
+        } else if (!outPath) {
+            outPath = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (!jobPath || !outPath || depth < 1 || depth > 15) {
+        usage();
+        return 1;
+    }
+    threads = MAX(threads, 1);
+
+    std::vector<BakeJob> jobs;
+    if (!readJobs(jobPath, jobs)) {
+        cerr << "could not read job list " << jobPath << endl;
+        return 1;
+    }
+    FILE *out = fopen(outPath, "wb");
+    if (!out) {
+        cerr << "could not open " << outPath << " for writing" << endl;
+        return 1;
+    }
+
+    int sideLength = (1 << depth) + 1;
+    BakeFileHeader header;
+    memcpy(header.magic, BAKE_MAGIC, 4);
+    header.version = BAKE_VERSION;
+    header.jobCount = jobs.size();
+    header.sideLength = sideLength;
+    header.slopeBins = BAKE_SLOPE_BINS;
+    fwrite(&header, sizeof(header), 1, out);
+
+    cout << "Baking " << jobs.size() << " terrains of " << sideLength << "x" << sideLength
+         << " on " << threads << " threads" << endl;
+    BakeQueue queue(jobs, out, sideLength);
+    std::vector<BakeWorker *> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(new BakeWorker(&queue, depth));
+        workers.back()->start();
+    }
+    for (int i = 0; i < threads; i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+
+    bool ok = !queue.failed() && fclose(out) == 0;
+    if (!ok) {
+        cerr << "failed writing " << outPath << endl;
+        return 1;
+    }
+    cout << "Wrote " << outPath << endl;
+    return 0;
+}
@@ -0,0 +1,31 @@
+#-------------------------------------------------
+#
+# Offline terrain bake tool, runs without a display
+#
+#-------------------------------------------------
+
+QT += core opengl
+
+TARGET = terrainbake
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+SOURCES += main.cpp \
+    ../../terrain.cpp \
+    ../../occlusionculler.cpp \
+    ../../glstate.cpp
+
+HEADERS += bakeformat.h \
+    ../../terrain.h \
+    ../../occlusionculler.h \
+    ../../glstate.h \
+    ../../frustum.h \
+    ../../common.h \
+    ../../glext.h
+
+INCLUDEPATH += ../..
+DEPENDPATH += ../..
+
+QMAKE_CXXFLAGS_RELEASE -= -O2
+QMAKE_CXXFLAGS_RELEASE += -O3
@@ -0,0 +1,230 @@
+/**
+  uniformcheck: checks the tables DrawEngine looks its shader programs and
+  uniforms up by (see shaderids.h) against the shaders themselves, without
+  Qt or a GL context.
+
+  usage: uniformcheck [srcdir]
+
+  Run from src, or given it.  Fails when a table doesn't have an entry for
+  every id, when a program's source file is missing, when a post
+  processing combination is outside the programs reserved for it, or when
+  a ShaderUniform isn't declared in any program, so looking it up would
+  give -1 everywhere.  Prints which of the uniforms each program declares.
+
+  The shaders are read as text, whatever the preprocessor would keep, so a
+  uniform declared under any #ifdef counts.  Uniforms in blocks are set
+  through the uniform buffer, not looked up, and are left out.
+**/
+
+#include "shaderids.h"
+#include <string.h>
+#include <ctype.h>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <string>
+#include <set>
+using std::cout;
+using std::cerr;
+using std::endl;
+
+#define COUNT(array) (int)(sizeof(array) / sizeof((array)[0]))
+
+/**
+  Reads a whole file, false when it can't be opened
+  **/
+static bool readFile(const std::string &path, std::string &text) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    text = buffer.str();
+    return true;
+}
+
+/**
+  Blanks out the comments of GLSL source, keeping the line breaks
+  **/
+static std::string stripComments(const std::string &text) {
+    std::string out = text;
+    for (size_t i = 0; i < out.size(); i++) {
+        if (out.compare(i, 2, "//") == 0) {
+            while (i < out.size() && out[i] != '\n') {
+                out[i++] = ' ';
+            }
+        } else if (out.compare(i, 2, "/*") == 0) {
+            size_t end = out.find("*/", i + 2);
+            end = end == std::string::npos ? out.size() : end + 2;
+            for (; i < end; i++) {
+                if (out[i] != '\n') {
+                    out[i] = ' ';
+                }
+            }
+            i--;
+        }
+    }
+    return out;
+}
+
+/**
+  Adds the names of the uniforms a shader declares outside blocks, as in
+  "layout(...) uniform highp vec2 a, b[4];"
+  **/
+static void addUniforms(const std::string &source, std::set<std::string> &names) {
+    static const char *qualifiers[] = { "lowp", "mediump", "highp", "readonly", "writeonly",
+                                        "coherent", "volatile", "restrict" };
+    std::string text = stripComments(source);
+    // Statements end at ; and blocks open at {, either ends a declaration
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find_first_of(";{", start);
+        if (end == std::string::npos) {
+            break;
+        }
+        std::istringstream statement(text.substr(start, end - start));
+        bool block = text[end] == '{';
+        start = end + 1;
+
+        std::string word;
+        bool uniform = false;
+        while (statement >> word) {
+            if (word == "uniform") {
+                uniform = true;
+                break;
+            }
+        }
+        if (!uniform || block) {
+            continue;
+        }
+        std::string type;
+        while (statement >> type) {
+            bool qualifier = false;
+            for (int i = 0; i < COUNT(qualifiers); i++) {
+                qualifier = qualifier || type == qualifiers[i];
+            }
+            if (!qualifier) {
+                break;
+            }
+        }
+        std::string rest, part;
+        std::getline(statement, rest, '\0');
+        std::istringstream declarators(rest);
+        while (std::getline(declarators, part, ',')) {
+            size_t first = 0;
+            while (first < part.size() && isspace(part[first])) {
+                first++;
+            }
+            size_t last = first;
+            while (last < part.size() && (isalnum(part[last]) || part[last] == '_')) {
+                last++;
+            }
+            if (last > first) {
+                names.insert(part.substr(first, last - first));
+            }
+        }
+    }
+}
+
+/**
+  Reads the given source files, NULL ones skipped, and adds the uniforms
+  they declare.  False when one is missing.
+  **/
+static bool programUniforms(const std::string &srcdir, const char *const *paths, int count,
+                            std::set<std::string> &names) {
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        if (!paths[i]) {
+            continue;
+        }
+        std::string text;
+        if (!readFile(srcdir + paths[i], text)) {
+            cerr << "missing shader " << paths[i] << endl;
+            ok = false;
+            continue;
+        }
+        addUniforms(text, names);
+    }
+    return ok;
+}
+
+/**
+  Prints the ShaderUniform names a program declares and marks them found
+  **/
+static void report(const char *program, const std::set<std::string> &names, bool *found) {
+    cout << program << ":";
+    for (int u = 0; u < UNIFORM_COUNT; u++) {
+        if (names.count(UNIFORM_NAMES[u])) {
+            cout << " " << UNIFORM_NAMES[u];
+            found[u] = true;
+        }
+    }
+    cout << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        cerr << "usage: uniformcheck [srcdir]" << endl;
+        return 1;
+    }
+    std::string srcdir = argc == 2 ? std::string(argv[1]) + "/" : "";
+    bool ok = true;
+
+    if (COUNT(UNIFORM_NAMES) != UNIFORM_COUNT) {
+        cerr << COUNT(UNIFORM_NAMES) << " uniform names for " << UNIFORM_COUNT << " ShaderUniform ids" << endl;
+        return 1;
+    }
+    if (COUNT(PROGRAM_SOURCES) != PROGRAM_POST + 1) {
+        cerr << COUNT(PROGRAM_SOURCES) << " program sources for " << PROGRAM_POST + 1 << " programs" << endl;
+        return 1;
+    }
+    for (int u = 0; u < UNIFORM_COUNT; u++) {
+        for (int v = 0; v < u; v++) {
+            if (!strcmp(UNIFORM_NAMES[u], UNIFORM_NAMES[v])) {
+                cerr << "uniform " << UNIFORM_NAMES[u] << " has two ids, " << v << " and " << u << endl;
+                ok = false;
+            }
+        }
+    }
+    bool built[POST_STEP_COMBINATIONS] = { false };
+    for (int i = 0; i < COUNT(POST_PROGRAM_STEPS); i++) {
+        int steps = POST_PROGRAM_STEPS[i];
+        if (steps < 0 || steps >= POST_STEP_COMBINATIONS || built[steps]) {
+            cerr << "post processing steps " << steps << " don't map to a program of their own" << endl;
+            ok = false;
+        } else {
+            built[steps] = true;
+        }
+    }
+
+    bool found[UNIFORM_COUNT] = { false };
+    bool read = true;
+    for (int p = 0; p <= PROGRAM_POST; p++) {
+        const ShaderSources &sources = PROGRAM_SOURCES[p];
+        const char *paths[] = { sources.vertex, sources.geometry, sources.fragment };
+        if (!sources.vertex || !sources.fragment) {
+            cerr << "program " << p << " lacks a vertex or fragment shader" << endl;
+            ok = false;
+        }
+        std::set<std::string> names;
+        read = programUniforms(srcdir, paths, COUNT(paths), names) && read;
+        std::ostringstream program;
+        program << "program " << p << " (" << (sources.fragment ? sources.fragment : "?") << ")";
+        report(program.str().c_str(), names, found);
+    }
+    std::set<std::string> names;
+    read = programUniforms(srcdir, &COMPUTE_BLUR_SOURCE, 1, names) && read;
+    report(COMPUTE_BLUR_SOURCE, names, found);
+
+    // With shaders missing, every uniform they declare would be reported too
+    ok = ok && read;
+    for (int u = 0; u < UNIFORM_COUNT && read; u++) {
+        if (!found[u]) {
+            cerr << "uniform " << UNIFORM_NAMES[u] << " (id " << u << ") isn't declared by any program" << endl;
+            ok = false;
+        }
+    }
+    cout << (ok ? "all ids resolve" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,20 @@
+#-------------------------------------------------
+#
+# Offline check of the shader program and uniform tables,
+# needs neither Qt nor a GL context
+#
+#-------------------------------------------------
+
+QT -= core gui
+
+TARGET = uniformcheck
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle qt
+
+SOURCES += main.cpp
+
+HEADERS += ../../shaderids.h
+
+INCLUDEPATH += ../..
+DEPENDPATH += ../..
@@ -0,0 +1,106 @@
+#define GL_GLEXT_LEGACY // no glext.h, we have our own
+#include <GL/gl.h>
+#define GL_GLEXT_PROTOTYPES
+#include "glext.h"
+
+#include "uniformring.h"
+#include <string.h>
+#include <stdio.h>
+
+UniformRing::UniformRing() {
+    buffer_ = 0;
+    mapping_ = NULL;
+    alignment_ = 1;
+    region_ = 0;
+    offset_ = 0;
+    for (int i = 0; i < REGIONS; i++) {
+        fences_[i] = 0;
+    }
+}
+
+UniformRing::~UniformRing() {
+    for (int i = 0; i < REGIONS; i++) {
+        if (fences_[i]) {
+            glDeleteSync(fences_[i]);
+        }
+    }
+    if (buffer_) {
+        if (mapping_) {
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer_);
+            glUnmapBuffer(GL_UNIFORM_BUFFER);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &buffer_);
+    }
+}
+
+/**
+  Allocates the buffer, mapped for good when the context has GL 4.4.
+  **/
+void UniformRing::create() {
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment_);
+    int major = 0, minor = 0;
+    sscanf((const char *)glGetString(GL_VERSION), "%d.%d", &major, &minor);
+
+    glGenBuffers(1, &buffer_);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer_);
+    if (major > 4 || (major == 4 && minor >= 4)) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_UNIFORM_BUFFER, REGIONS * REGION_SIZE, NULL, flags);
+        mapping_ = (char *)glMapBufferRange(GL_UNIFORM_BUFFER, 0, REGIONS * REGION_SIZE, flags);
+    } else {
+        glBufferData(GL_UNIFORM_BUFFER, REGIONS * REGION_SIZE, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+/**
+  Writes a block of uniforms into the ring and binds it to the uniform
+  buffer binding point index, for the draws until it is bound again.
+  **/
+void UniformRing::bind(GLuint index, const void *data, GLsizeiptr size) {
+    GLintptr offset = (offset_ + alignment_ - 1) / alignment_ * alignment_;
+    if (offset + size > REGION_SIZE) {
+        nextRegion();
+        offset = 0;
+    }
+    offset += region_ * REGION_SIZE;
+    if (mapping_) {
+        memcpy(mapping_ + offset, data, size);
+    } else {
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer_);
+        glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+    }
+    glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer_, offset, size);
+    offset_ = offset - region_ * REGION_SIZE + size;
+}
+
+/**
+  Leaves the region written this frame, the next frame writes the next
+  one.
+  **/
+void UniformRing::endFrame() {
+    if (offset_ > 0) {
+        nextRegion();
+    }
+}
+
+/**
+  Fences the region written so far and moves on to the next one, waiting
+  for the GPU to be done with what was last written there.
+  **/
+void UniformRing::nextRegion() {
+    if (fences_[region_]) {
+        glDeleteSync(fences_[region_]);
+    }
+    fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    region_ = (region_ + 1) % REGIONS;
+    offset_ = 0;
+    if (fences_[region_]) {
+        // A second, at most, at a time
+        while (glClientWaitSync(fences_[region_], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fences_[region_]);
+        fences_[region_] = 0;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef UNIFORMRING_H
+#define UNIFORMRING_H
+
+#define GL_GLEXT_LEGACY // no glext.h, we have our own
+#include <qgl.h>
+
+// As glext.h declares it, which isn't included here
+typedef struct __GLsync *GLsync;
+
+/**
+  One uniform buffer that blocks of uniforms are written into as they are
+  needed, each block bound by range to its binding point.  A block is
+  never written over while the GPU may still be reading it: the buffer is
+  split into REGIONS regions, filled one after the other, and a region
+  is only written into again once the fence placed after its last use
+  has passed.  A region is left for the next one at the end of every
+  frame, or when a block doesn't fit in what is left of it.
+
+  On GL 4.4 the buffer is mapped once, persistently and coherently, and
+  blocks are copied straight into it.  Older contexts write them with
+  glBufferSubData instead, which the regions keep from stalling on blocks
+  still in use.
+  **/
+class UniformRing
+{
+public:
+    static const int REGIONS = 3;         // frames in flight
+    static const int REGION_SIZE = 16384; // bytes, a frame's blocks fit in one
+
+    UniformRing();
+    ~UniformRing();
+
+    void create();
+    void bind(GLuint index, const void *data, GLsizeiptr size);
+    void endFrame();
+
+    bool isPersistent() const { return mapping_ != NULL; }
+
+private:
+    void nextRegion();
+
+    GLuint buffer_;
+    char *mapping_;     // the whole buffer, NULL when not persistently mapped
+    GLint alignment_;   // of the offsets blocks are bound at
+    int region_;        // written into now
+    GLintptr offset_;   // next free byte of it
+    GLsync fences_[REGIONS]; // after the last draw reading each region, or 0
+};
+
+#endif // UNIFORMRING_H